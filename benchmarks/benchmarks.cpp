@@ -0,0 +1,273 @@
+#include "collisions/generator.hpp"
+#include "collisions/geometry.hpp"
+#include "collisions/mutable_scene.hpp"
+#include "collisions/spatial_index.hpp"
+#include <algorithm>
+#include <array>
+#include <benchmark/benchmark.h>
+#include <cmath>
+
+namespace {
+
+// Scenes keep the generator's constant triangle density, so the number of
+// collisions grows linearly with the scene size
+scene::Scene generateScene(size_t size, scene::Distribution distribution) {
+  return scene::SceneGenerator(distribution, size, size).generate(0);
+}
+
+geom::Triangle generateTriangle(scene::Random &random, glm::vec3 center,
+                                float radius) {
+  return geom::Triangle{center + random.ball(radius),
+                        center + random.ball(radius),
+                        center + random.ball(radius)};
+}
+
+enum class IntersectsPath { PlaneReject, Interval, Coplanar };
+
+std::vector<std::pair<geom::Triangle, geom::Triangle>>
+generatePairs(IntersectsPath path, size_t num) {
+  scene::Random random(static_cast<uint64_t>(path));
+  std::vector<std::pair<geom::Triangle, geom::Triangle>> res;
+  res.reserve(num);
+  for (size_t i = 0; i < num; ++i) {
+    glm::vec3 center = random.point(10.f);
+    switch (path) {
+    case IntersectsPath::PlaneReject: {
+      // Second triangle lies entirely in front of the first one's plane
+      auto tri = generateTriangle(random, center, 1.f);
+      glm::vec3 normal = glm::normalize(tri.getNormal());
+      res.emplace_back(tri,
+                       generateTriangle(random, center + normal * 3.f, 1.f));
+      break;
+    }
+    case IntersectsPath::Interval: {
+      // Both triangles pass through the center in different planes
+      auto through_center = [&]() {
+        glm::vec3 p1 = random.ball(1.f), p2 = random.ball(1.f);
+        return geom::Triangle{center + p1, center + p2,
+                              center - (p1 + p2) * 0.5f};
+      };
+      res.emplace_back(through_center(), through_center());
+      break;
+    }
+    case IntersectsPath::Coplanar: {
+      auto flat = [&]() {
+        glm::vec3 p = random.ball(1.f);
+        return center + glm::vec3{p.x, p.y, 0.f};
+      };
+      res.emplace_back(geom::Triangle{flat(), flat(), flat()},
+                       geom::Triangle{flat(), flat(), flat()});
+      break;
+    }
+    }
+  }
+  return res;
+}
+
+void BM_Intersects(benchmark::State &state) {
+  auto path = static_cast<IntersectsPath>(state.range(0));
+  constexpr size_t NumPairs = 1024;
+  auto pairs = generatePairs(path, NumPairs);
+  size_t i = 0;
+  for (auto _ : state) {
+    const auto &[tri1, tri2] = pairs[i++ % NumPairs];
+    benchmark::DoNotOptimize(geom::Intersects(tri1, tri2));
+  }
+  const char *names[] = {"plane-reject", "interval", "coplanar"};
+  state.SetLabel(names[state.range(0)]);
+}
+BENCHMARK(BM_Intersects)->DenseRange(0, 2);
+
+void BM_FindIntersectingTriangles(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  auto distribution = static_cast<scene::Distribution>(state.range(1));
+  auto triangles = generateScene(size, distribution);
+  size_t num_collisions = 0;
+  for (auto _ : state)
+    num_collisions = scene::findIntersectingTriangles(triangles).size();
+  state.SetLabel(scene::getName(distribution));
+  state.counters["collisions"] = static_cast<double>(num_collisions);
+  state.counters["triangles"] = benchmark::Counter(
+      static_cast<double>(size), benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_FindIntersectingTriangles)
+    ->ArgsProduct({benchmark::CreateRange(1000, 10000000, 10),
+                   benchmark::CreateDenseRange(0, 5, 1)})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_FindIntersectingTrianglesThreads(benchmark::State &state) {
+  auto triangles = generateScene(static_cast<size_t>(state.range(0)),
+                                 scene::Distribution::Uniform);
+  auto num_threads = static_cast<unsigned>(state.range(1));
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        scene::findIntersectingTriangles(triangles, num_threads));
+}
+BENCHMARK(BM_FindIntersectingTrianglesThreads)
+    ->ArgsProduct({{1000000}, {1, 2, 4, 8}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+enum class UpdateMode { Returned, InPlace, Packed };
+
+void BM_UpdateDynamicScene(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  auto mode = static_cast<UpdateMode>(state.range(1));
+  auto triangles = scene::SceneGenerator(scene::Distribution::Uniform, size,
+                                         size)
+                       .generateDynamic(0);
+  scene::PackedDynamicScene packed(triangles);
+  scene::Scene res;
+  float time = 0.f;
+  for (auto _ : state) {
+    time += 1.f / 60.f;
+    switch (mode) {
+    case UpdateMode::Returned:
+      res = scene::updateDynamicScene(triangles, time);
+      break;
+    case UpdateMode::InPlace:
+      scene::updateDynamicScene(triangles, time, res);
+      break;
+    case UpdateMode::Packed:
+      packed.update(time, res);
+      break;
+    }
+    benchmark::DoNotOptimize(res.data());
+  }
+  const char *names[] = {"returned", "in-place", "packed"};
+  state.SetLabel(names[state.range(1)]);
+  state.counters["triangles"] = benchmark::Counter(
+      static_cast<double>(size), benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_UpdateDynamicScene)
+    ->ArgsProduct({{10000, 1000000}, {0, 1, 2}})
+    ->Unit(benchmark::kMicrosecond);
+
+enum class RayMode { Single, Packet4, Packet8, AnyHit };
+
+// Coherent rays of a grid from a point outside the scene through a window of
+// its far side, like pixels of a camera looking at a part of the scene
+std::vector<geom::Ray> generateRays(const scene::Scene &triangles,
+                                     size_t num) {
+  geom::AABB bounds;
+  for (const auto &tri : triangles)
+    bounds.extend(geom::AABB(tri));
+  auto size = bounds.getSize();
+  glm::vec3 origin = bounds.getMin() - size * 0.5f;
+  constexpr float Window = 0.125f;
+  auto side = static_cast<size_t>(std::sqrt(static_cast<double>(num)));
+  std::vector<geom::Ray> res;
+  res.reserve(side * side);
+  // Rows of 8 neighbouring rays make up a packet
+  for (size_t y = 0; y < side; ++y)
+    for (size_t x = 0; x < side; ++x) {
+      glm::vec3 cell(1.f, .5f + (x + .5f) / side * Window,
+                     .5f + (y + .5f) / side * Window);
+      glm::vec3 target = bounds.getMin() + size * cell;
+      res.push_back(geom::Ray{origin, target - origin});
+    }
+  return res;
+}
+
+template <size_t N>
+size_t castPackets(const scene::SpatialIndex &index,
+                   const std::vector<geom::Ray> &rays) {
+  size_t num_hits = 0;
+  std::array<geom::Ray, N> packet;
+  for (size_t i = 0; i + N <= rays.size(); i += N) {
+    std::copy_n(rays.begin() + i, N, packet.begin());
+    for (const auto &hit : index.castRays(packet))
+      num_hits += hit.has_value();
+  }
+  return num_hits;
+}
+
+void BM_CastRays(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  auto mode = static_cast<RayMode>(state.range(1));
+  auto triangles = generateScene(size, scene::Distribution::Uniform);
+  scene::SpatialIndex index(triangles);
+  constexpr size_t NumRays = 64 * 64;
+  auto rays = generateRays(triangles, NumRays);
+  size_t num_hits = 0;
+  for (auto _ : state) {
+    num_hits = 0;
+    switch (mode) {
+    case RayMode::Single:
+      for (const auto &ray : rays)
+        num_hits += index.castRay(ray).has_value();
+      break;
+    case RayMode::Packet4:
+      num_hits = castPackets<4>(index, rays);
+      break;
+    case RayMode::Packet8:
+      num_hits = castPackets<8>(index, rays);
+      break;
+    case RayMode::AnyHit:
+      for (const auto &ray : rays)
+        num_hits += index.hitsAny(ray);
+      break;
+    }
+    benchmark::DoNotOptimize(num_hits);
+  }
+  const char *names[] = {"single", "packet4", "packet8", "any-hit"};
+  state.SetLabel(names[state.range(1)]);
+  state.counters["hits"] = static_cast<double>(num_hits);
+  state.counters["rays"] =
+      benchmark::Counter(static_cast<double>(rays.size()),
+                         benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_CastRays)
+    ->ArgsProduct({{100000, 1000000}, {0, 1, 2, 3}})
+    ->Unit(benchmark::kMillisecond);
+
+// Moves one triangle onto another one's place per edit, compare with
+// BM_FindIntersectingTriangles of the same size for a full recompute
+void BM_EditScene(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  auto triangles = generateScene(size, scene::Distribution::Uniform);
+  scene::MutableScene mutable_scene(triangles);
+  scene::Random random(1);
+  auto index = [&]() {
+    return static_cast<scene::TriangleIdx>(random.next() % size);
+  };
+  for (auto _ : state) {
+    const auto &tri = triangles[index()];
+    mutable_scene.update(index(), geom::Triangle{tri.getPoint(1),
+                                                 tri.getPoint(2),
+                                                 tri.getPoint(0)});
+  }
+  state.counters["collisions"] =
+      static_cast<double>(mutable_scene.getCollisions().size());
+}
+BENCHMARK(BM_EditScene)->Arg(100000)->Arg(1000000);
+
+// Moving triangles against a static scene: queries of a kept index of the
+// static scene, or findIntersectingPairs of both scenes merged
+void BM_FindCrossPairs(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  bool merged = state.range(1);
+  auto static_scene = generateScene(size, scene::Distribution::Uniform);
+  // Same density in a small cube at the center of the static scene
+  auto moving =
+      scene::SceneGenerator(scene::Distribution::Uniform, 1000, 1).generate(0);
+  scene::SpatialIndex index(static_scene);
+  auto all = static_scene;
+  all.insert(all.end(), moving.begin(), moving.end());
+  size_t num_pairs = 0;
+  for (auto _ : state)
+    num_pairs = merged ? scene::findIntersectingPairs(all).size()
+                       : scene::findIntersectingPairs(index, moving).size();
+  state.SetLabel(merged ? "merged" : "indexed");
+  state.counters["pairs"] = static_cast<double>(num_pairs);
+}
+// Merging a million triangle scene takes too long to repeat
+BENCHMARK(BM_FindCrossPairs)
+    ->Args({100000, 0})
+    ->Args({1000000, 0})
+    ->Args({100000, 1})
+    ->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Compares Google Benchmark JSON results with a stored baseline.
+
+Usage:
+  compare.py baseline.json current.json [--threshold PERCENT] [--update]
+
+Prints the relative change of real time for every benchmark present in both
+files and exits with status 1 if any of them became slower than the
+threshold allows, or if there is no baseline. With --update the current
+results replace the baseline.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    res = {}
+    for bench in data.get("benchmarks", []):
+        # Skip stddev/median aggregates, compare means of repetitions
+        if bench.get("run_type") == "aggregate" and \
+                bench.get("aggregate_name") != "mean":
+            continue
+        name = bench.get("run_name", bench["name"])
+        res[name] = bench["real_time"], bench.get("time_unit", "ns")
+    return res
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="allowed slowdown in percent (default 10)")
+    parser.add_argument("--update", action="store_true",
+                        help="store current results as the new baseline")
+    args = parser.parse_args()
+
+    if args.update:
+        shutil.copyfile(args.current, args.baseline)
+        print("baseline updated: " + args.baseline)
+        return 0
+    if not os.path.exists(args.baseline):
+        # Nothing was compared, which must not pass for a clean run
+        print("no baseline stored at " + args.baseline +
+              ", run with --update to create it", file=sys.stderr)
+        return 1
+
+    baseline, current = load(args.baseline), load(args.current)
+    regressions = 0
+    width = max((len(name) for name in current), default=0)
+    for name, (time, unit) in current.items():
+        if name not in baseline:
+            print("{:<{}}  {:>12.3f} {:<2}  (new)".format(name, width, time,
+                                                        unit))
+            continue
+        base_time, base_unit = baseline[name]
+        if base_unit != unit or base_time <= 0:
+            continue
+        change = (time - base_time) / base_time * 100.0
+        mark = ""
+        if change > args.threshold:
+            mark = "  REGRESSION"
+            regressions += 1
+        print("{:<{}}  {:>12.3f} {:<2}  {:+7.1f}%{}".format(
+            name, width, time, unit, change, mark))
+    for name in baseline:
+        if name not in current:
+            print("{:<{}}  (missing)".format(name, width))
+    if regressions:
+        print("{} benchmark(s) slower than baseline by more than {}%".format(
+            regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,229 @@
+#include "generator.hpp"
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <glm/gtc/constants.hpp>
+#include <glm/vec2.hpp>
+#include <thread>
+
+namespace scene {
+
+namespace {
+
+constexpr uint64_t Golden = 0x9e3779b97f4a7c15;
+// Streams of per-group values (cluster centers, sheet planes, pair points)
+// are taken from a different seed than per-triangle streams
+constexpr uint64_t GroupSeed = 0x5851f42d4c957f2d;
+
+uint64_t mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+template <typename T, typename Func>
+std::vector<T> generateRange(size_t begin, size_t end, unsigned num_threads,
+                             Func get) {
+  std::vector<T> res(end - begin);
+  if (!num_threads)
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t step = std::max<size_t>((res.size() + num_threads - 1) / num_threads,
+                                 1);
+  std::vector<std::future<void>> tasks;
+  for (size_t first = 0; first < res.size(); first += step)
+    tasks.push_back(std::async(std::launch::async, [&, first]() {
+      size_t last = std::min(first + step, res.size());
+      for (size_t i = first; i < last; ++i)
+        res[i] = get(begin + i);
+    }));
+  for (auto &task : tasks)
+    task.get();
+  return res;
+}
+
+} // namespace
+
+Random::Random(uint64_t seed, uint64_t stream)
+    : state_(mix(seed + mix(stream + Golden))) {}
+
+uint64_t Random::next() { return mix(state_ += Golden); }
+
+float Random::uniform(float min, float max) {
+  return min + (max - min) * static_cast<float>(next() >> 40) * 0x1p-24f;
+}
+
+float Random::normal(float sigma) {
+  // Marsaglia polar method
+  float u, v, s;
+  do {
+    u = uniform(-1.f, 1.f);
+    v = uniform(-1.f, 1.f);
+    s = u * u + v * v;
+  } while (s >= 1.f || s == 0.f);
+  return sigma * u * std::sqrt(-2.f * std::log(s) / s);
+}
+
+glm::vec3 Random::point(float half_extent) {
+  return glm::vec3{uniform(-half_extent, half_extent),
+                   uniform(-half_extent, half_extent),
+                   uniform(-half_extent, half_extent)};
+}
+
+glm::vec3 Random::direction() {
+  glm::vec3 dir;
+  do
+    dir = glm::vec3{normal(1.f), normal(1.f), normal(1.f)};
+  while (glm::length2(dir) < geom::epsilon);
+  return glm::normalize(dir);
+}
+
+glm::vec3 Random::ball(float radius) {
+  glm::vec3 p;
+  do
+    p = point(radius);
+  while (glm::length2(p) > radius * radius);
+  return p;
+}
+
+std::pair<glm::vec3, glm::vec3> getBasis(glm::vec3 n) {
+  glm::vec3 t;
+  if (std::abs(n.x) < std::abs(n.y)) {
+    if (std::abs(n.x) < std::abs(n.z))
+      t = glm::vec3{1.f, 0.f, 0.f};
+    else
+      t = glm::vec3{0.f, 0.f, 1.f};
+  } else {
+    if (std::abs(n.y) < std::abs(n.z))
+      t = glm::vec3{0.f, 1.f, 0.f};
+    else
+      t = glm::vec3{0.f, 0.f, 1.f};
+  }
+  glm::vec3 u = glm::normalize(glm::cross(n, t)), v = glm::cross(n, u);
+  return {u, v};
+}
+
+geom::Triangle generateRandomTri(Random &random, glm::vec3 center,
+                                 glm::vec3 normal) {
+  constexpr float pi = glm::pi<float>();
+  float angle1 = random.uniform(0.f, 2 * pi);
+  float angle2 = random.uniform(0.f, pi);
+  float angle3 = random.uniform(-pi, -pi + angle2);
+  auto generateVertex = [&random](float angle) {
+    float radius = random.uniform(0.0f, 1.0f);
+    return glm::vec2{radius * std::cos(angle), radius * std::sin(angle)};
+  };
+  std::array<glm::vec2, 3> vertices = {generateVertex(angle1),
+                                       generateVertex(angle1 + angle2),
+                                       generateVertex(angle1 + angle3)};
+  auto [u, v] = getBasis(normal);
+  return geom::Triangle{center + u * vertices[0].x + v * vertices[0].y,
+                        center + u * vertices[1].x + v * vertices[1].y,
+                        center + u * vertices[2].x + v * vertices[2].y};
+}
+
+namespace {
+
+constexpr std::pair<Distribution, const char *> DistributionNames[] = {
+    {Distribution::Uniform, "uniform"}, {Distribution::Clusters, "clusters"},
+    {Distribution::Sheets, "sheets"},   {Distribution::Slivers, "slivers"},
+    {Distribution::Pairs, "pairs"},     {Distribution::Nested, "nested"}};
+
+} // namespace
+
+std::optional<Distribution> parseDistribution(const std::string &name) {
+  for (auto [distribution, distribution_name] : DistributionNames)
+    if (name == distribution_name)
+      return distribution;
+  return std::nullopt;
+}
+
+const char *getName(Distribution distribution) {
+  for (auto [other, name] : DistributionNames)
+    if (other == distribution)
+      return name;
+  return "";
+}
+
+SceneGenerator::SceneGenerator(Distribution distribution, size_t size,
+                               uint64_t seed, float density)
+    : distribution_(distribution), size_(size), seed_(seed),
+      half_extent_(0.5f * std::cbrt(size / density)), num_groups_(1) {
+  if (distribution_ == Distribution::Clusters)
+    num_groups_ = std::max<size_t>(size / 1000, 1);
+  else if (distribution_ == Distribution::Sheets)
+    num_groups_ = std::max<size_t>(static_cast<size_t>(half_extent_), 1);
+}
+
+geom::Triangle SceneGenerator::getTriangle(size_t idx) const {
+  Random random(seed_, idx);
+  auto triangle = [&random](glm::vec3 center, float radius) {
+    return geom::Triangle{center + random.ball(radius),
+                          center + random.ball(radius),
+                          center + random.ball(radius)};
+  };
+  switch (distribution_) {
+  case Distribution::Uniform:
+    return triangle(random.point(half_extent_), 1.f);
+  case Distribution::Clusters: {
+    Random group(seed_ ^ GroupSeed, random.next() % num_groups_);
+    glm::vec3 offset{random.normal(2.f), random.normal(2.f),
+                     random.normal(2.f)};
+    return triangle(group.point(half_extent_) + offset, 1.f);
+  }
+  case Distribution::Sheets: {
+    // Every sheet is a square through a random point with random normal
+    Random group(seed_ ^ GroupSeed, random.next() % num_groups_);
+    glm::vec3 origin = group.point(half_extent_), normal = group.direction();
+    auto [u, v] = getBasis(normal);
+    glm::vec3 center = origin +
+                       u * random.uniform(-half_extent_, half_extent_) +
+                       v * random.uniform(-half_extent_, half_extent_);
+    return generateRandomTri(random, center, normal);
+  }
+  case Distribution::Slivers: {
+    glm::vec3 center = random.point(half_extent_), dir = random.direction();
+    // Unit perpendicular at a random angle around the long side
+    auto [u, v] = getBasis(dir);
+    float angle = random.uniform(0.f, glm::two_pi<float>());
+    glm::vec3 side = u * std::cos(angle) + v * std::sin(angle);
+    return geom::Triangle{center - dir * 5.f, center + dir * 5.f,
+                          center + side * 0.05f};
+  }
+  case Distribution::Pairs: {
+    // Both triangles of a pair contain the same point
+    glm::vec3 center = Random(seed_ ^ GroupSeed, idx / 2).point(half_extent_);
+    return generateRandomTri(random, center, random.direction());
+  }
+  case Distribution::Nested: {
+    float radius = std::exp(
+        random.uniform(std::log(0.01f), std::log(half_extent_ + 1.f)));
+    return triangle(random.point(half_extent_ * 0.1f), radius);
+  }
+  }
+  return geom::Triangle{};
+}
+
+DynamicTriangle SceneGenerator::getDynamicTriangle(size_t idx) const {
+  geom::Triangle tri = getTriangle(idx);
+  // Separate stream, so static and dynamic scenes share triangles
+  Random random(~seed_, idx);
+  glm::vec3 center =
+      (tri.getPoint(0) + tri.getPoint(1) + tri.getPoint(2)) / 3.f;
+  geom::Line axis(center + random.ball(1.f), random.direction());
+  return DynamicTriangle(tri, axis, random.uniform(-90.f, 90.f));
+}
+
+Scene SceneGenerator::generate(size_t begin, size_t end,
+                               unsigned num_threads) const {
+  return generateRange<geom::Triangle>(
+      begin, end, num_threads, [this](size_t i) { return getTriangle(i); });
+}
+
+DynamicScene SceneGenerator::generateDynamic(size_t begin, size_t end,
+                                             unsigned num_threads) const {
+  return generateRange<DynamicTriangle>(
+      begin, end, num_threads,
+      [this](size_t i) { return getDynamicTriangle(i); });
+}
+
+} // namespace scene
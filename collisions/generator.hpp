@@ -0,0 +1,78 @@
+#ifndef COLLISIONS_GENERATOR_HPP
+#define COLLISIONS_GENERATOR_HPP
+
+#include "scene.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace scene {
+
+// Small counter-based generator with its own distributions, so generated
+// scenes are identical across platforms and standard libraries
+class Random {
+public:
+  explicit Random(uint64_t seed, uint64_t stream = 0);
+  uint64_t next();
+  float uniform(float min, float max);
+  float normal(float sigma);
+  glm::vec3 point(float half_extent);
+  glm::vec3 direction();
+  glm::vec3 ball(float radius);
+
+private:
+  uint64_t state_;
+};
+
+std::pair<glm::vec3, glm::vec3> getBasis(glm::vec3 n);
+// Triangle lying in the plane with given normal, containing given center
+geom::Triangle generateRandomTri(Random &random, glm::vec3 center,
+                                 glm::vec3 normal);
+
+enum class Distribution {
+  Uniform,   // unit triangles spread uniformly over a cube
+  Clusters,  // unit triangles around Gaussian cluster centers
+  Sheets,    // triangles lying in a few arbitrary planes
+  Slivers,   // long thin triangles with random orientation
+  Pairs,     // pairs of triangles guaranteed to intersect
+  Nested     // log-uniform sizes around the center, big ones overlap many
+};
+
+std::optional<Distribution> parseDistribution(const std::string &name);
+const char *getName(Distribution distribution);
+
+// Every triangle is generated from its own random stream, so the result
+// depends only on the seed and the triangle index, not on how the scene is
+// split into pieces or between threads
+class SceneGenerator {
+public:
+  // Density is the average number of triangles per unit of volume
+  SceneGenerator(Distribution distribution, size_t size, uint64_t seed = 0,
+                 float density = 1.25f);
+  size_t size() const { return size_; }
+  geom::Triangle getTriangle(size_t idx) const;
+  // Rotates around a random axis passing near the triangle
+  DynamicTriangle getDynamicTriangle(size_t idx) const;
+
+  Scene generate(size_t begin, size_t end, unsigned num_threads = 1) const;
+  DynamicScene generateDynamic(size_t begin, size_t end,
+                               unsigned num_threads = 1) const;
+  Scene generate(unsigned num_threads = 1) const {
+    return generate(0, size_, num_threads);
+  }
+  DynamicScene generateDynamic(unsigned num_threads = 1) const {
+    return generateDynamic(0, size_, num_threads);
+  }
+
+private:
+  Distribution distribution_;
+  size_t size_;
+  uint64_t seed_;
+  float half_extent_;
+  size_t num_groups_;
+};
+
+} // namespace scene
+
+#endif
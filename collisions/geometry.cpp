@@ -1,4 +1,5 @@
 #include "geometry.hpp"
+#include <glm/gtc/matrix_access.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <iostream>
 
@@ -95,6 +96,41 @@ Range Triangle::getIntersectionRange(const Line &line,
   return Range(min, max);
 }
 
+bool Triangle::contains(glm::vec3 point) const {
+  // Distances are rounded relative to the coordinates
+  float scale = 1.f;
+  for (auto p : {p_[0], p_[1], p_[2], point})
+    scale = glm::max(scale, glm::max(glm::abs(p.x),
+                                     glm::max(glm::abs(p.y), glm::abs(p.z))));
+  float tolerance = 8.f * epsilon * scale;
+  glm::vec3 normal = getNormal();
+  if (isDegenerative()) {
+    // Segment or point, the point has to be on one of the edges
+    for (unsigned i = 0; i < 3; ++i) {
+      glm::vec3 edge = p_[(i + 1) % 3] - p_[i];
+      float length2 = glm::length2(edge);
+      float t = length2 > epsilon2
+                    ? glm::clamp(glm::dot(point - p_[i], edge) / length2, 0.f,
+                                 1.f)
+                    : 0.f;
+      if (glm::length(p_[i] + edge * t - point) <= tolerance)
+        return true;
+    }
+    return false;
+  }
+  float normal_length = glm::length(normal);
+  if (glm::abs(glm::dot(point - p_[0], normal)) > tolerance * normal_length)
+    return false;
+  // On the inner side of every edge
+  for (unsigned i = 0; i < 3; ++i) {
+    glm::vec3 edge = p_[(i + 1) % 3] - p_[i];
+    if (glm::dot(glm::cross(edge, point - p_[i]), normal) <
+        -tolerance * glm::length(edge) * normal_length)
+      return false;
+  }
+  return true;
+}
+
 void Triangle::dump(std::ostream &os) const {
   os << "(" << p_[0] << ", " << p_[1] << ", " << p_[2] << ")";
 }
@@ -234,4 +270,54 @@ std::optional<Line> Plane::intersect(const Plane &other) const {
   point /= det;
   return Line(point, dir);
 }
+
+void AABB::dump(std::ostream &os) const {
+  os << "[" << min_ << ", " << max_ << "]";
+}
+
+std::ostream &operator<<(std::ostream &os, const AABB &box) {
+  box.dump(os);
+  return os;
+}
+
+Frustum::Frustum(const glm::mat4 &view_proj) {
+  // Rows of the column-major matrix
+  glm::vec4 x = glm::row(view_proj, 0), y = glm::row(view_proj, 1),
+            z = glm::row(view_proj, 2), w = glm::row(view_proj, 3);
+  planes_ = {w + x, w - x, w + y, w - y, z, w - z};
+}
+
+Frustum::Overlap Frustum::classify(const AABB &box) const {
+  auto overlap = Overlap::Inside;
+  for (const auto &plane : planes_) {
+    glm::vec3 normal(plane);
+    // Box corners farthest along and against the normal
+    auto positive_axes = glm::greaterThan(normal, glm::vec3(0.f));
+    glm::vec3 farthest = glm::mix(box.getMin(), box.getMax(), positive_axes);
+    glm::vec3 nearest = glm::mix(box.getMax(), box.getMin(), positive_axes);
+    if (glm::dot(normal, farthest) + plane.w < 0.f)
+      return Overlap::Outside;
+    if (glm::dot(normal, nearest) + plane.w < 0.f)
+      overlap = Overlap::Partial;
+  }
+  return overlap;
+}
+
+std::optional<float> Intersect(const Ray &ray, const Triangle &tri) {
+  // Möller-Trumbore, comparisons are written to reject NaN of parallel rays
+  glm::vec3 edge1 = tri.getPoint(1) - tri.getPoint(0),
+            edge2 = tri.getPoint(2) - tri.getPoint(0);
+  glm::vec3 p = glm::cross(ray.dir, edge2);
+  float inv_det = 1.f / glm::dot(edge1, p);
+  glm::vec3 to_origin = ray.origin - tri.getPoint(0);
+  float u = glm::dot(to_origin, p) * inv_det;
+  glm::vec3 q = glm::cross(to_origin, edge1);
+  float v = glm::dot(ray.dir, q) * inv_det;
+  float t = glm::dot(edge2, q) * inv_det;
+  if (u >= 0.f && v >= 0.f && u + v <= 1.f && t >= 0.f &&
+      t <= ray.max_distance)
+    return t;
+  return std::nullopt;
+}
+
 } // namespace geom
@@ -6,7 +6,9 @@
 #include <glm/common.hpp>
 #include <glm/geometric.hpp>
 #include <glm/gtx/norm.hpp>
+#include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 #include <iosfwd>
 #include <optional>
 
@@ -55,6 +57,8 @@ public:
   Line(glm::vec3 point, glm::vec3 dir) : point_(point), dir_(dir) {
     assert(glm::length2(dir_) >= epsilon2);
   }
+  glm::vec3 getPoint() const { return point_; }
+  glm::vec3 getDirection() const { return dir_; }
   glm::vec3 rotatePoint(glm::vec3 point, float angle) const;
   float getProjection(glm::vec3 point) const {
     return glm::dot(point - point_, dir_);
@@ -80,6 +84,8 @@ public:
     return glm::cross(p_[1] - p_[0], p_[2] - p_[0]);
   }
   bool isDegenerative() const { return glm::length2(getNormal()) <= epsilon2; }
+  // Whether the point lies on the triangle, up to epsilon
+  bool contains(glm::vec3 point) const;
   Range getIntersectionRange(const Line &line, const Plane &plane) const;
   void dump(std::ostream &os) const;
   void read(std::istream &is);
@@ -190,6 +196,84 @@ inline std::optional<Line> Intersect(const Plane &pln1, const Plane &pln2) {
   return pln1.intersect(pln2);
 }
 
+class AABB {
+public:
+  AABB() = default;
+  AABB(glm::vec3 min, glm::vec3 max) : min_(min), max_(max) {}
+  AABB(const Triangle &tri) {
+    extend(tri.getPoint(0));
+    extend(tri.getPoint(1));
+    extend(tri.getPoint(2));
+  }
+  glm::vec3 getMin() const { return min_; }
+  glm::vec3 getMax() const { return max_; }
+  glm::vec3 getSize() const { return max_ - min_; }
+  bool isEmpty() const {
+    return min_.x > max_.x || min_.y > max_.y || min_.z > max_.z;
+  }
+  void extend(glm::vec3 point) {
+    min_ = glm::min(min_, point);
+    max_ = glm::max(max_, point);
+  }
+  void extend(const AABB &other) {
+    min_ = glm::min(min_, other.min_);
+    max_ = glm::max(max_, other.max_);
+  }
+  void expand(float margin) {
+    min_ -= glm::vec3(margin);
+    max_ += glm::vec3(margin);
+  }
+  bool intersects(const AABB &other) const {
+    return min_.x <= other.max_.x && other.min_.x <= max_.x &&
+           min_.y <= other.max_.y && other.min_.y <= max_.y &&
+           min_.z <= other.max_.z && other.min_.z <= max_.z;
+  }
+  bool contains(glm::vec3 point) const {
+    return min_.x <= point.x && point.x <= max_.x && min_.y <= point.y &&
+           point.y <= max_.y && min_.z <= point.z && point.z <= max_.z;
+  }
+  AAPlane::Axis getLongestAxis() const {
+    auto size = getSize();
+    if (size.x > size.y)
+      return size.x > size.z ? AAPlane::Axis::X : AAPlane::Axis::Z;
+    return size.y > size.z ? AAPlane::Axis::Y : AAPlane::Axis::Z;
+  }
+  void dump(std::ostream &os) const;
+
+private:
+  glm::vec3 min_{pos_inf, pos_inf, pos_inf}, max_{neg_inf, neg_inf, neg_inf};
+};
+
+inline bool Intersects(const AABB &box1, const AABB &box2) {
+  return box1.intersects(box2);
+}
+
+std::ostream &operator<<(std::ostream &os, const AABB &box);
+
+// View frustum as six planes with inward normals
+class Frustum {
+public:
+  enum class Overlap { Outside, Partial, Inside };
+  // From a view-projection matrix into Vulkan clip space: -w <= x, y <= w
+  // and 0 <= z <= w
+  explicit Frustum(const glm::mat4 &view_proj);
+  // Conservative: boxes crossing a plane outside of the frustum are partial
+  Overlap classify(const AABB &box) const;
+
+private:
+  std::array<glm::vec4, 6> planes_;
+};
+
+// Points origin + t * dir for 0 <= t <= max_distance, distances are in
+// units of the direction length
+struct Ray {
+  glm::vec3 origin, dir;
+  float max_distance = pos_inf;
+};
+
+// Distance along the ray to the triangle, rays in its plane miss it
+std::optional<float> Intersect(const Ray &ray, const Triangle &tri);
+
 } // namespace geom
 
 #endif
@@ -0,0 +1,341 @@
+#include "mesh_file.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace scene {
+
+namespace {
+
+void addPolygon(IndexedScene &scene, const std::vector<int64_t> &polygon) {
+  for (auto idx : polygon)
+    if (idx < 0 || static_cast<size_t>(idx) >= scene.vertices.size())
+      throw std::runtime_error("mesh face references missing vertex " +
+                               std::to_string(idx));
+  for (size_t i = 2; i < polygon.size(); ++i)
+    scene.triangles.push_back(IndexTriple{static_cast<uint32_t>(polygon[0]),
+                                          static_cast<uint32_t>(polygon[i - 1]),
+                                          static_cast<uint32_t>(polygon[i])});
+}
+
+class VertexMerger {
+public:
+  VertexMerger(IndexedScene &scene) : scene_(scene) {}
+  uint32_t add(glm::vec3 vertex) {
+    Key key;
+    std::memcpy(key.bits.data(), &vertex, sizeof(key.bits));
+    auto [it, inserted] = indices_.try_emplace(
+        key, static_cast<uint32_t>(scene_.vertices.size()));
+    if (inserted)
+      scene_.vertices.push_back(vertex);
+    return it->second;
+  }
+
+private:
+  struct Key {
+    std::array<uint32_t, 3> bits;
+    bool operator==(const Key &other) const { return bits == other.bits; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      size_t hash = key.bits[0];
+      hash = hash * 0x9E3779B1u ^ key.bits[1];
+      hash = hash * 0x9E3779B1u ^ key.bits[2];
+      return hash;
+    }
+  };
+  IndexedScene &scene_;
+  std::unordered_map<Key, uint32_t, KeyHash> indices_;
+};
+
+// PLY scalar types with their old and sized names
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float, Double };
+
+PlyType parsePlyType(const std::string &name) {
+  static const std::pair<const char *, PlyType> types[] = {
+      {"char", PlyType::Int8},     {"int8", PlyType::Int8},
+      {"uchar", PlyType::UInt8},   {"uint8", PlyType::UInt8},
+      {"short", PlyType::Int16},   {"int16", PlyType::Int16},
+      {"ushort", PlyType::UInt16}, {"uint16", PlyType::UInt16},
+      {"int", PlyType::Int32},     {"int32", PlyType::Int32},
+      {"uint", PlyType::UInt32},   {"uint32", PlyType::UInt32},
+      {"float", PlyType::Float},   {"float32", PlyType::Float},
+      {"double", PlyType::Double}, {"float64", PlyType::Double}};
+  for (const auto &[type_name, type] : types)
+    if (name == type_name)
+      return type;
+  throw std::runtime_error("unknown PLY property type " + name);
+}
+
+struct PlyProperty {
+  std::string name;
+  PlyType type;
+  bool is_list = false;
+  PlyType count_type = PlyType::UInt8;
+};
+
+struct PlyElement {
+  std::string name;
+  size_t count;
+  std::vector<PlyProperty> properties;
+};
+
+enum class PlyFormat { Ascii, LittleEndian, BigEndian };
+
+class PlyReader {
+public:
+  PlyReader(std::istream &is, PlyFormat format) : is_(is), format_(format) {}
+  double read(PlyType type) {
+    if (format_ == PlyFormat::Ascii) {
+      double value;
+      if (!(is_ >> value))
+        throw std::runtime_error("unexpected end of PLY data");
+      return value;
+    }
+    switch (type) {
+    case PlyType::Int8:
+      return readBinary<int8_t>();
+    case PlyType::UInt8:
+      return readBinary<uint8_t>();
+    case PlyType::Int16:
+      return readBinary<int16_t>();
+    case PlyType::UInt16:
+      return readBinary<uint16_t>();
+    case PlyType::Int32:
+      return readBinary<int32_t>();
+    case PlyType::UInt32:
+      return readBinary<uint32_t>();
+    case PlyType::Float:
+      return readBinary<float>();
+    case PlyType::Double:
+      return readBinary<double>();
+    }
+    return 0.;
+  }
+
+private:
+  std::istream &is_;
+  PlyFormat format_;
+
+  template <typename T> T readBinary() {
+    char bytes[sizeof(T)];
+    if (!is_.read(bytes, sizeof(T)))
+      throw std::runtime_error("unexpected end of PLY data");
+    const uint16_t probe = 1;
+    bool host_little = *reinterpret_cast<const char *>(&probe) == 1;
+    if (host_little != (format_ == PlyFormat::LittleEndian))
+      std::reverse(bytes, bytes + sizeof(T));
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+};
+
+std::string getExtension(const std::string &path) {
+  auto pos = path.find_last_of('.');
+  if (pos == std::string::npos)
+    return {};
+  auto ext = path.substr(pos + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return ext;
+}
+
+// Bytes left in the stream, zero if it can not seek
+uint64_t getRemainingSize(std::istream &is) {
+  auto pos = is.tellg();
+  if (pos < 0)
+    return 0;
+  if (!is.seekg(0, std::ios::end)) {
+    is.clear();
+    is.seekg(pos);
+    return 0;
+  }
+  auto end = is.tellg();
+  is.seekg(pos);
+  return end > pos ? static_cast<uint64_t>(end - pos) : 0;
+}
+
+} // namespace
+
+IndexedScene readOBJ(std::istream &is) {
+  IndexedScene res;
+  std::string line;
+  std::vector<int64_t> polygon;
+  while (std::getline(is, line)) {
+    std::istringstream ls(line);
+    std::string tag;
+    ls >> tag;
+    if (tag == "v") {
+      glm::vec3 vertex;
+      if (!(ls >> vertex.x >> vertex.y >> vertex.z))
+        throw std::runtime_error("invalid OBJ vertex: " + line);
+      res.vertices.push_back(vertex);
+    } else if (tag == "f") {
+      // Face entries look like v, v/vt, v//vn or v/vt/vn, negative indices
+      // are relative to the end of the vertex list
+      polygon.clear();
+      std::string entry;
+      while (ls >> entry) {
+        int64_t idx = std::stoll(entry.substr(0, entry.find('/')));
+        if (idx < 0)
+          idx += static_cast<int64_t>(res.vertices.size());
+        else
+          --idx;
+        polygon.push_back(idx);
+      }
+      addPolygon(res, polygon);
+    }
+  }
+  return res;
+}
+
+IndexedScene readSTL(std::istream &is) {
+  constexpr size_t HeaderSize = 80, RecordSize = 50;
+  char header[HeaderSize];
+  uint32_t num_triangles;
+  if (!is.read(header, HeaderSize) ||
+      !is.read(reinterpret_cast<char *>(&num_triangles), sizeof(uint32_t)))
+    throw std::runtime_error("invalid binary STL header");
+  IndexedScene res;
+  // Count of a truncated or corrupt file may exceed its size
+  res.triangles.reserve(static_cast<size_t>(
+      std::min<uint64_t>(num_triangles, getRemainingSize(is) / RecordSize)));
+  VertexMerger merger(res);
+  char record[RecordSize];
+  for (uint32_t i = 0; i < num_triangles; ++i) {
+    if (!is.read(record, RecordSize))
+      throw std::runtime_error("unexpected end of binary STL data");
+    // Facet normal is followed by three vertices and attribute byte count
+    float coords[9];
+    std::memcpy(coords, record + 3 * sizeof(float), sizeof(coords));
+    IndexTriple tri;
+    for (unsigned j = 0; j < 3; ++j)
+      tri[j] = merger.add(
+          glm::vec3{coords[j * 3], coords[j * 3 + 1], coords[j * 3 + 2]});
+    res.triangles.push_back(tri);
+  }
+  return res;
+}
+
+IndexedScene readPLY(std::istream &is) {
+  std::string line;
+  if (!std::getline(is, line) || line.rfind("ply", 0) != 0)
+    throw std::runtime_error("not a PLY file");
+  PlyFormat format = PlyFormat::Ascii;
+  std::vector<PlyElement> elements;
+  while (std::getline(is, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    std::istringstream ls(line);
+    std::string keyword;
+    ls >> keyword;
+    if (keyword == "end_header")
+      break;
+    if (keyword == "format") {
+      std::string name;
+      ls >> name;
+      if (name == "ascii")
+        format = PlyFormat::Ascii;
+      else if (name == "binary_little_endian")
+        format = PlyFormat::LittleEndian;
+      else if (name == "binary_big_endian")
+        format = PlyFormat::BigEndian;
+      else
+        throw std::runtime_error("unknown PLY format " + name);
+    } else if (keyword == "element") {
+      PlyElement element;
+      ls >> element.name >> element.count;
+      elements.push_back(element);
+    } else if (keyword == "property") {
+      if (elements.empty())
+        throw std::runtime_error("PLY property outside of element");
+      PlyProperty property;
+      std::string type;
+      ls >> type;
+      if (type == "list") {
+        std::string count_type;
+        ls >> count_type >> type;
+        property.is_list = true;
+        property.count_type = parsePlyType(count_type);
+      }
+      property.type = parsePlyType(type);
+      ls >> property.name;
+      elements.back().properties.push_back(property);
+    }
+  }
+
+  IndexedScene res;
+  PlyReader reader(is, format);
+  std::vector<int64_t> polygon;
+  for (const auto &element : elements) {
+    bool is_vertex = element.name == "vertex",
+         is_face = element.name == "face";
+    if (is_vertex) {
+      // Count of a truncated or corrupt file may exceed its size, every
+      // property takes at least a byte
+      auto num_fitting = getRemainingSize(is) /
+                         std::max<size_t>(element.properties.size(), 1);
+      res.vertices.reserve(static_cast<size_t>(
+          std::min<uint64_t>(element.count, num_fitting)));
+    }
+    for (size_t i = 0; i < element.count; ++i) {
+      glm::vec3 vertex{};
+      for (const auto &property : element.properties) {
+        if (property.is_list) {
+          auto count = static_cast<size_t>(reader.read(property.count_type));
+          bool is_indices = is_face && (property.name == "vertex_indices" ||
+                                        property.name == "vertex_index");
+          if (is_indices)
+            polygon.clear();
+          for (size_t j = 0; j < count; ++j) {
+            double value = reader.read(property.type);
+            if (is_indices)
+              polygon.push_back(static_cast<int64_t>(value));
+          }
+          if (is_indices)
+            addPolygon(res, polygon);
+          continue;
+        }
+        double value = reader.read(property.type);
+        if (is_vertex) {
+          if (property.name == "x")
+            vertex.x = static_cast<float>(value);
+          else if (property.name == "y")
+            vertex.y = static_cast<float>(value);
+          else if (property.name == "z")
+            vertex.z = static_cast<float>(value);
+        }
+      }
+      if (is_vertex)
+        res.vertices.push_back(vertex);
+    }
+  }
+  return res;
+}
+
+bool isMeshFile(const std::string &path) {
+  auto ext = getExtension(path);
+  return ext == "obj" || ext == "stl" || ext == "ply";
+}
+
+IndexedScene loadMesh(const std::string &path) {
+  std::ifstream is(path, std::ios::binary);
+  if (!is)
+    throw std::runtime_error("can not open mesh file " + path);
+  auto ext = getExtension(path);
+  if (ext == "obj")
+    return readOBJ(is);
+  if (ext == "stl")
+    return readSTL(is);
+  if (ext == "ply")
+    return readPLY(is);
+  throw std::runtime_error("unknown mesh format " + path);
+}
+
+} // namespace scene
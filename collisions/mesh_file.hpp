@@ -0,0 +1,23 @@
+#ifndef COLLISIONS_MESH_FILE_HPP
+#define COLLISIONS_MESH_FILE_HPP
+
+#include "scene.hpp"
+#include <iosfwd>
+#include <string>
+
+namespace scene {
+
+// Polygons are triangulated as fans, streams should be opened in binary mode
+IndexedScene readOBJ(std::istream &is);
+// Binary STL, vertices with equal coordinates are merged
+IndexedScene readSTL(std::istream &is);
+// ASCII and binary PLY
+IndexedScene readPLY(std::istream &is);
+
+// Chooses loader by file extension: .obj, .stl or .ply
+bool isMeshFile(const std::string &path);
+IndexedScene loadMesh(const std::string &path);
+
+} // namespace scene
+
+#endif
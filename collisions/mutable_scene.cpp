@@ -0,0 +1,250 @@
+#include "mutable_scene.hpp"
+#include <algorithm>
+
+namespace scene {
+
+static float getArea(const geom::AABB &box) {
+  auto size = box.getSize();
+  return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+static geom::AABB getUnion(geom::AABB box, const geom::AABB &other) {
+  box.extend(other);
+  return box;
+}
+
+// Triangles closer than epsilon intersect
+static geom::AABB getNeighbourhood(const geom::Triangle &tri) {
+  geom::AABB box(tri);
+  box.expand(geom::epsilon);
+  return box;
+}
+
+template <typename Fn>
+void MutableScene::forEachOverlap(const geom::AABB &box, Fn fn) const {
+  if (root_ == NoNode)
+    return;
+  std::vector<uint32_t> stack{root_};
+  while (!stack.empty()) {
+    const auto &node = nodes_[stack.back()];
+    stack.pop_back();
+    if (!node.bounds.intersects(box))
+      continue;
+    if (node.children[0] == NoNode)
+      fn(node.triangle);
+    else
+      stack.insert(stack.end(), node.children, node.children + 2);
+  }
+}
+
+MutableScene::MutableScene(SceneView scene)
+    : triangles_(scene.size()), leaves_(scene.size()),
+      counts_(scene.size()), size_(scene.size()) {
+  nodes_.reserve(2 * scene.size());
+  std::vector<uint32_t> leaves(scene.size());
+  for (TriangleIdx i = 0; i < scene.size(); ++i) {
+    triangles_[i] = scene[i];
+    leaves[i] = leaves_[i] = allocateNode();
+    nodes_[leaves[i]].bounds = geom::AABB(triangles_[i]);
+    nodes_[leaves[i]].triangle = i;
+  }
+  if (!leaves.empty())
+    root_ = build(leaves.begin(), leaves.end());
+  // Every pair is tested once, from its smaller index
+  for (TriangleIdx i = 0; i < scene.size(); ++i)
+    forEachOverlap(getNeighbourhood(triangles_[i]), [&](TriangleIdx other) {
+      if (other > i && intersects(i, other)) {
+        ++counts_[i];
+        ++counts_[other];
+      }
+    });
+}
+
+TriangleIdx MutableScene::insert(const geom::Triangle &tri) {
+  TriangleIdx idx;
+  if (!free_triangles_.empty()) {
+    idx = free_triangles_.back();
+    free_triangles_.pop_back();
+    triangles_[idx] = tri;
+  } else {
+    idx = static_cast<TriangleIdx>(triangles_.size());
+    triangles_.push_back(tri);
+    leaves_.push_back(NoNode);
+    counts_.push_back(0);
+  }
+  auto leaf = allocateNode();
+  nodes_[leaf].bounds = geom::AABB(tri);
+  nodes_[leaf].triangle = idx;
+  leaves_[idx] = leaf;
+  insertLeaf(leaf);
+  addCollisions(idx, 1);
+  ++size_;
+  return idx;
+}
+
+void MutableScene::erase(TriangleIdx idx) {
+  assert(contains(idx));
+  addCollisions(idx, -1);
+  auto leaf = leaves_[idx];
+  removeLeaf(leaf);
+  free_nodes_.push_back(leaf);
+  leaves_[idx] = NoNode;
+  free_triangles_.push_back(idx);
+  --size_;
+}
+
+void MutableScene::update(TriangleIdx idx, const geom::Triangle &tri) {
+  assert(contains(idx));
+  addCollisions(idx, -1);
+  auto leaf = leaves_[idx];
+  removeLeaf(leaf);
+  triangles_[idx] = tri;
+  nodes_[leaf].bounds = geom::AABB(tri);
+  insertLeaf(leaf);
+  addCollisions(idx, 1);
+}
+
+Collisions MutableScene::getCollisions() const {
+  Collisions collisions;
+  for (TriangleIdx i = 0; i < getNumSlots(); ++i)
+    if (contains(i) && counts_[i])
+      collisions.insert(collisions.end(), i);
+  return collisions;
+}
+
+uint32_t MutableScene::build(std::vector<uint32_t>::iterator begin,
+                             std::vector<uint32_t>::iterator end) {
+  if (end - begin == 1)
+    return *begin;
+  // Doubled centers of the leaves, only compared
+  auto getCenter = [&](uint32_t leaf) {
+    return nodes_[leaf].bounds.getMin() + nodes_[leaf].bounds.getMax();
+  };
+  geom::AABB bounds, centers;
+  for (auto it = begin; it != end; ++it) {
+    bounds.extend(nodes_[*it].bounds);
+    centers.extend(getCenter(*it));
+  }
+  auto axis = static_cast<unsigned>(centers.getLongestAxis());
+  auto middle = begin + (end - begin) / 2;
+  std::nth_element(begin, middle, end, [&](uint32_t leaf1, uint32_t leaf2) {
+    return getCenter(leaf1)[axis] < getCenter(leaf2)[axis];
+  });
+  auto node = allocateNode();
+  uint32_t children[2] = {build(begin, middle), build(middle, end)};
+  for (unsigned i = 0; i < 2; ++i) {
+    nodes_[node].children[i] = children[i];
+    nodes_[children[i]].parent = node;
+  }
+  nodes_[node].bounds = bounds;
+  return node;
+}
+
+uint32_t MutableScene::allocateNode() {
+  if (free_nodes_.empty()) {
+    nodes_.emplace_back();
+    return static_cast<uint32_t>(nodes_.size() - 1);
+  }
+  auto node = free_nodes_.back();
+  free_nodes_.pop_back();
+  nodes_[node] = Node{};
+  return node;
+}
+
+void MutableScene::insertLeaf(uint32_t leaf) {
+  nodes_[leaf].parent = NoNode;
+  if (root_ == NoNode) {
+    root_ = leaf;
+    return;
+  }
+  // Descends while a child grows less by taking the leaf than a new parent
+  // of the leaf and the node would cost, counting the growth of ancestors
+  auto box = nodes_[leaf].bounds;
+  uint32_t sibling = root_;
+  while (nodes_[sibling].children[0] != NoNode) {
+    const auto &node = nodes_[sibling];
+    float area = getArea(node.bounds);
+    float combined_area = getArea(getUnion(node.bounds, box));
+    float cost = 2.f * combined_area;
+    float inherited_cost = 2.f * (combined_area - area);
+    float child_costs[2];
+    for (unsigned i = 0; i < 2; ++i) {
+      const auto &child = nodes_[node.children[i]];
+      float child_area = getArea(getUnion(child.bounds, box));
+      if (child.children[0] != NoNode)
+        child_area -= getArea(child.bounds);
+      child_costs[i] = child_area + inherited_cost;
+    }
+    if (cost < child_costs[0] && cost < child_costs[1])
+      break;
+    sibling = node.children[child_costs[1] < child_costs[0] ? 1 : 0];
+  }
+
+  auto old_parent = nodes_[sibling].parent;
+  auto parent = allocateNode();
+  nodes_[parent].parent = old_parent;
+  nodes_[parent].bounds = getUnion(nodes_[sibling].bounds, box);
+  nodes_[parent].children[0] = sibling;
+  nodes_[parent].children[1] = leaf;
+  nodes_[sibling].parent = parent;
+  nodes_[leaf].parent = parent;
+  if (old_parent == NoNode) {
+    root_ = parent;
+    return;
+  }
+  auto &children = nodes_[old_parent].children;
+  children[children[0] == sibling ? 0 : 1] = parent;
+  refit(old_parent);
+}
+
+void MutableScene::removeLeaf(uint32_t leaf) {
+  if (leaf == root_) {
+    root_ = NoNode;
+    return;
+  }
+  // Sibling takes the place of the parent
+  auto parent = nodes_[leaf].parent;
+  auto grand_parent = nodes_[parent].parent;
+  const auto &siblings = nodes_[parent].children;
+  auto sibling = siblings[siblings[0] == leaf ? 1 : 0];
+  nodes_[sibling].parent = grand_parent;
+  free_nodes_.push_back(parent);
+  if (grand_parent == NoNode) {
+    root_ = sibling;
+    return;
+  }
+  auto &children = nodes_[grand_parent].children;
+  children[children[0] == parent ? 0 : 1] = sibling;
+  refit(grand_parent);
+}
+
+void MutableScene::refit(uint32_t node) {
+  // Ancestors of a node whose bounds did not change keep theirs
+  for (; node != NoNode; node = nodes_[node].parent) {
+    const auto &children = nodes_[node].children;
+    auto bounds =
+        getUnion(nodes_[children[0]].bounds, nodes_[children[1]].bounds);
+    auto &old_bounds = nodes_[node].bounds;
+    if (bounds.getMin() == old_bounds.getMin() &&
+        bounds.getMax() == old_bounds.getMax())
+      break;
+    old_bounds = bounds;
+  }
+}
+
+void MutableScene::addCollisions(TriangleIdx idx, int change) {
+  forEachOverlap(getNeighbourhood(triangles_[idx]), [&](TriangleIdx other) {
+    if (other != idx && intersects(idx, other)) {
+      counts_[idx] += change;
+      counts_[other] += change;
+    }
+  });
+}
+
+bool MutableScene::intersects(TriangleIdx idx1, TriangleIdx idx2) const {
+  if (idx1 > idx2)
+    std::swap(idx1, idx2);
+  return geom::Intersects(triangles_[idx1], triangles_[idx2]);
+}
+
+} // namespace scene
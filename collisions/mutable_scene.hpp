@@ -0,0 +1,85 @@
+#ifndef COLLISIONS_MUTABLE_SCENE_HPP
+#define COLLISIONS_MUTABLE_SCENE_HPP
+
+#include "scene.hpp"
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace scene {
+
+// Scene edited a few triangles at a time with its collisions kept up to
+// date. Triangles are leaves of a bounding volume hierarchy that is built
+// once and then changed only along the path of the edited leaf, and every
+// triangle counts the triangles it intersects, so an edit costs a query of
+// its neighbourhood instead of a full findIntersectingTriangles run.
+class MutableScene {
+public:
+  MutableScene() = default;
+  explicit MutableScene(SceneView scene);
+  // Number of triangles, erased ones excluded
+  size_t size() const { return size_; }
+  // Indices are below this, erased ones included
+  size_t getNumSlots() const { return triangles_.size(); }
+  bool contains(TriangleIdx idx) const {
+    return idx < leaves_.size() && leaves_[idx] != NoNode;
+  }
+  const geom::Triangle &operator[](TriangleIdx idx) const {
+    assert(contains(idx));
+    return triangles_[idx];
+  }
+  // Reuses the index of an erased triangle if there is one
+  TriangleIdx insert(const geom::Triangle &tri);
+  void erase(TriangleIdx idx);
+  void update(TriangleIdx idx, const geom::Triangle &tri);
+  // Triangles intersecting the triangle
+  uint32_t getNumCollisions(TriangleIdx idx) const {
+    assert(contains(idx));
+    return counts_[idx];
+  }
+  // Same as findIntersectingTriangles of the triangles left, with their
+  // indices here
+  Collisions getCollisions() const;
+
+private:
+  static constexpr uint32_t NoNode = std::numeric_limits<uint32_t>::max();
+  struct Node {
+    geom::AABB bounds;
+    uint32_t parent = NoNode;
+    // Leaves have no children and hold a triangle
+    uint32_t children[2] = {NoNode, NoNode};
+    TriangleIdx triangle = 0;
+  };
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> free_nodes_;
+  uint32_t root_ = NoNode;
+  Scene triangles_;
+  // Leaf of every triangle, NoNode if erased
+  std::vector<uint32_t> leaves_;
+  std::vector<uint32_t> counts_;
+  Triangles free_triangles_;
+  size_t size_ = 0;
+
+  // Adds the subtree of the leaves, splitting them at the median of the
+  // longest axis, returns its node
+  uint32_t build(std::vector<uint32_t>::iterator begin,
+                 std::vector<uint32_t>::iterator end);
+  uint32_t allocateNode();
+  // Links the leaf next to the node whose bounds grow the least
+  void insertLeaf(uint32_t leaf);
+  void removeLeaf(uint32_t leaf);
+  // Recomputes bounds from the node up to the root
+  void refit(uint32_t node);
+  template <typename Fn>
+  void forEachOverlap(const geom::AABB &box, Fn fn) const;
+  // Tests the triangle against its neighbours, adding change to the counts
+  // of both triangles of every intersecting pair
+  void addCollisions(TriangleIdx idx, int change);
+  // Triangles are tested in index order, so erasing a triangle finds the
+  // same pairs as inserting it did
+  bool intersects(TriangleIdx idx1, TriangleIdx idx2) const;
+};
+
+} // namespace scene
+
+#endif
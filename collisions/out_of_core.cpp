@@ -0,0 +1,279 @@
+#include "out_of_core.hpp"
+#include "spatial_index.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+
+namespace fs = std::filesystem;
+
+namespace scene {
+
+namespace {
+
+struct Record {
+  TriangleIdx idx;
+  geom::Triangle tri;
+};
+
+static_assert(std::is_trivially_copyable_v<Record>,
+              "records are spilled to disk as raw bytes");
+
+// Rough memory cost of a triangle inside a bin: the record itself, its copy
+// in the local scene and its indices in the tree
+constexpr size_t BytesPerTriangle = 128;
+constexpr unsigned MaxDepth = 4;
+constexpr size_t MaxFlushRecords = 4096;
+constexpr size_t ReadChunkRecords = 4096;
+
+class Grid {
+public:
+  Grid(const geom::AABB &bounds, size_t num_cells)
+      : origin_(bounds.getMin()), dims_{1, 1, 1} {
+    auto size = bounds.getSize();
+    while (static_cast<size_t>(dims_[0]) * dims_[1] * dims_[2] < num_cells) {
+      unsigned axis = 0;
+      for (unsigned i = 1; i < 3; ++i)
+        if (size[i] / dims_[i] > size[axis] / dims_[axis])
+          axis = i;
+      ++dims_[axis];
+    }
+    for (unsigned i = 0; i < 3; ++i) {
+      cell_size_[i] = size[i] / dims_[i];
+      inv_cell_size_[i] = size[i] > 0.f ? dims_[i] / size[i] : 0.f;
+    }
+  }
+  size_t size() const {
+    return static_cast<size_t>(dims_[0]) * dims_[1] * dims_[2];
+  }
+  // Both ends use the same monotonic mapping, so any point shared by two
+  // boxes falls into a cell which both boxes are assigned to
+  template <typename Fn> void forEachCell(const geom::AABB &box, Fn fn) const {
+    std::array<unsigned, 3> from, to;
+    for (unsigned i = 0; i < 3; ++i) {
+      from[i] = getCoord(box.getMin()[i], i);
+      to[i] = getCoord(box.getMax()[i], i);
+    }
+    for (unsigned x = from[0]; x <= to[0]; ++x)
+      for (unsigned y = from[1]; y <= to[1]; ++y)
+        for (unsigned z = from[2]; z <= to[2]; ++z)
+          fn((static_cast<size_t>(x) * dims_[1] + y) * dims_[2] + z);
+  }
+  geom::AABB getCellBounds(size_t cell) const {
+    glm::vec3 coord{static_cast<float>(cell / dims_[2] / dims_[1]),
+                    static_cast<float>(cell / dims_[2] % dims_[1]),
+                    static_cast<float>(cell % dims_[2])};
+    glm::vec3 min = origin_ + coord * cell_size_;
+    return geom::AABB(min, min + cell_size_);
+  }
+
+private:
+  glm::vec3 origin_, cell_size_, inv_cell_size_;
+  std::array<unsigned, 3> dims_;
+
+  unsigned getCoord(float pos, unsigned axis) const {
+    float coord = std::floor((pos - origin_[axis]) * inv_cell_size_[axis]);
+    if (!(coord > 0.f))
+      return 0;
+    return std::min(static_cast<unsigned>(std::min(coord, 4e9f)),
+                    dims_[axis] - 1);
+  }
+};
+
+// Streams records back from a spilled bin
+struct BinSource {
+  fs::path path;
+
+  template <typename Fn> void operator()(Fn fn) const {
+    std::ifstream is(path, std::ios::binary);
+    std::vector<Record> chunk(ReadChunkRecords);
+    while (is) {
+      is.read(reinterpret_cast<char *>(chunk.data()),
+              chunk.size() * sizeof(Record));
+      size_t num = static_cast<size_t>(is.gcount()) / sizeof(Record);
+      for (size_t i = 0; i < num; ++i)
+        fn(chunk[i]);
+    }
+  }
+};
+
+class OutOfCoreSolver {
+public:
+  OutOfCoreSolver(const OutOfCoreOptions &options)
+      : budget_(std::max(options.memory_budget, BytesPerTriangle)),
+        num_threads_(options.num_threads) {
+    fs::path temp_dir = options.temp_dir.empty()
+                            ? fs::temp_directory_path()
+                            : fs::path(options.temp_dir);
+    fs::create_directories(temp_dir);
+    // A fresh directory, so runs never share bins
+    std::random_device rd;
+    do
+      dir_ = temp_dir / ("triangles-" + std::to_string(rd()));
+    while (!fs::create_directory(dir_));
+  }
+  OutOfCoreSolver(const OutOfCoreSolver &) = delete;
+  OutOfCoreSolver &operator=(const OutOfCoreSolver &) = delete;
+  ~OutOfCoreSolver() {
+    std::error_code ec;
+    fs::remove_all(dir_, ec);
+  }
+
+  Collisions solve(SceneView scene) {
+    geom::AABB bounds;
+    for (TriangleIdx i = 0; i < scene.size(); ++i)
+      bounds.extend(geom::AABB(scene[i]));
+    auto source = [scene](auto fn) {
+      for (TriangleIdx i = 0; i < scene.size(); ++i)
+        fn(Record{i, scene[i]});
+    };
+    partition(source, bounds, scene.size(), 0, dir_);
+    return std::move(res_);
+  }
+
+private:
+  size_t budget_;
+  unsigned num_threads_;
+  fs::path dir_;
+  Collisions res_;
+
+  bool fits(size_t count) const { return count * BytesPerTriangle <= budget_; }
+
+  template <typename Source>
+  void partition(Source source, const geom::AABB &bounds, size_t count,
+                 unsigned depth, const fs::path &dir) {
+    Grid grid(bounds, (count * BytesPerTriangle + budget_ - 1) / budget_);
+    std::vector<size_t> counts(grid.size());
+    {
+      std::vector<std::vector<Record>> buffers(grid.size());
+      size_t flush_records = std::clamp<size_t>(
+          budget_ / 2 / (grid.size() * sizeof(Record)), 1, MaxFlushRecords);
+      auto flush = [&](size_t cell) {
+        auto &buffer = buffers[cell];
+        if (buffer.empty())
+          return;
+        std::ofstream os(getBinPath(dir, cell),
+                         std::ios::binary | std::ios::app);
+        os.write(reinterpret_cast<const char *>(buffer.data()),
+                 buffer.size() * sizeof(Record));
+        if (!os)
+          throw std::runtime_error("failed to spill triangles bin to " +
+                                   dir.string());
+        buffer.clear();
+      };
+      source([&](const Record &rec) {
+        geom::AABB box(rec.tri);
+        box.expand(geom::epsilon);
+        grid.forEachCell(box, [&](size_t cell) {
+          buffers[cell].push_back(rec);
+          ++counts[cell];
+          if (buffers[cell].size() >= flush_records)
+            flush(cell);
+        });
+      });
+      for (size_t cell = 0; cell < grid.size(); ++cell)
+        flush(cell);
+    }
+    for (size_t cell = 0; cell < grid.size(); ++cell) {
+      if (!counts[cell])
+        continue;
+      auto path = getBinPath(dir, cell);
+      if (!fits(counts[cell]) && depth < MaxDepth && counts[cell] < count) {
+        // Bin is still too large, split it further
+        auto subdir = dir / ("bin" + std::to_string(cell));
+        fs::create_directory(subdir);
+        partition(BinSource{path}, grid.getCellBounds(cell), counts[cell],
+                  depth + 1, subdir);
+        fs::remove_all(subdir);
+      } else
+        solveBin(path, counts[cell]);
+      fs::remove(path);
+    }
+  }
+
+  void solveBin(const fs::path &path, size_t count) {
+    if (!fits(count)) {
+      solveBlocks(path, count);
+      return;
+    }
+    auto records = readRecords(path, 0, count);
+    for (auto idx : findIntersectingTriangles(getScene(records), num_threads_))
+      res_.insert(records[idx].idx);
+  }
+
+  // Bins that splitting does not shrink below the budget, e.g. dense
+  // clusters, copies of one triangle or large straddlers, are tested in
+  // blocks of half the budget: every block alone, then against each later
+  // block, so memory stays bounded at the cost of reading blocks again
+  void solveBlocks(const fs::path &path, size_t count) {
+    size_t block_size = std::max<size_t>(budget_ / 2 / BytesPerTriangle, 1);
+    for (size_t begin1 = 0; begin1 < count; begin1 += block_size) {
+      auto records1 =
+          readRecords(path, begin1, std::min(block_size, count - begin1));
+      auto block1 = getScene(records1);
+      for (auto idx : findIntersectingTriangles(block1, num_threads_))
+        res_.insert(records1[idx].idx);
+      // Triangles closer than epsilon intersect
+      auto bounds1 = getBounds(block1);
+      bounds1.expand(geom::epsilon);
+      for (size_t begin2 = begin1 + block_size; begin2 < count;
+           begin2 += block_size) {
+        auto records2 =
+            readRecords(path, begin2, std::min(block_size, count - begin2));
+        auto block2 = getScene(records2);
+        if (!bounds1.intersects(getBounds(block2)))
+          continue;
+        for (auto [idx1, idx2] :
+             findIntersectingPairs(block1, block2, num_threads_)) {
+          res_.insert(records1[idx1].idx);
+          res_.insert(records2[idx2].idx);
+        }
+      }
+    }
+  }
+
+  static std::vector<Record> readRecords(const fs::path &path, size_t begin,
+                                         size_t count) {
+    std::vector<Record> records(count);
+    std::ifstream is(path, std::ios::binary);
+    is.seekg(static_cast<std::streamoff>(begin * sizeof(Record)));
+    is.read(reinterpret_cast<char *>(records.data()), count * sizeof(Record));
+    if (!is)
+      throw std::runtime_error("failed to read triangles bin " + path.string());
+    return records;
+  }
+
+  static Scene getScene(const std::vector<Record> &records) {
+    Scene scene;
+    scene.reserve(records.size());
+    for (const auto &rec : records)
+      scene.push_back(rec.tri);
+    return scene;
+  }
+
+  static geom::AABB getBounds(const Scene &scene) {
+    geom::AABB bounds;
+    for (const auto &tri : scene)
+      bounds.extend(geom::AABB(tri));
+    return bounds;
+  }
+
+  static fs::path getBinPath(const fs::path &dir, size_t cell) {
+    return dir / ("bin" + std::to_string(cell) + ".dat");
+  }
+};
+
+} // namespace
+
+Collisions findIntersectingTrianglesOutOfCore(SceneView scene,
+                                              const OutOfCoreOptions &options) {
+  if (scene.size() * BytesPerTriangle <= options.memory_budget)
+    return findIntersectingTriangles(scene, options.num_threads);
+  return OutOfCoreSolver(options).solve(scene);
+}
+
+} // namespace scene
@@ -0,0 +1,30 @@
+#ifndef COLLISIONS_OUT_OF_CORE_HPP
+#define COLLISIONS_OUT_OF_CORE_HPP
+
+#include "scene.hpp"
+#include <string>
+
+namespace scene {
+
+struct OutOfCoreOptions {
+  // Approximate limit for memory used by a single bin, in bytes
+  size_t memory_budget = size_t(1) << 30;
+  // Directory for spilled bins, system temporary directory if empty
+  std::string temp_dir;
+  // Threads used by the in-memory engine for every bin
+  unsigned num_threads = 1;
+};
+
+// Streaming version of findIntersectingTriangles for scenes that do not fit
+// in memory together with their tree. Triangles are spilled to disk into
+// spatial bins (triangles crossing bin borders are duplicated into every bin
+// they touch), then bins are processed one at a time by the in-memory engine.
+// Bins that stay over the budget after splitting, e.g. dense clusters, are
+// tested in blocks of half the budget, one pair of blocks at a time, which
+// keeps memory bounded but costs time quadratic in the number of blocks.
+Collisions findIntersectingTrianglesOutOfCore(
+    SceneView scene, const OutOfCoreOptions &options = OutOfCoreOptions{});
+
+} // namespace scene
+
+#endif
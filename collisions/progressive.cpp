@@ -0,0 +1,96 @@
+#include "progressive.hpp"
+
+namespace scene {
+
+static std::vector<geom::AABB> getSweptBounds(const DynamicScene &scene) {
+  std::vector<geom::AABB> bounds;
+  bounds.reserve(scene.size());
+  for (const auto &tri : scene)
+    bounds.push_back(tri.getSweptBounds());
+  return bounds;
+}
+
+ProgressiveDetector::ProgressiveDetector(const DynamicScene &scene)
+    : scene_(scene), index_(getSweptBounds(scene)),
+      colliding_(scene.size()), positions_(scene.size()),
+      moved_(scene.size()), refreshed_(scene.size()) {}
+
+size_t ProgressiveDetector::update(float time, const geom::Frustum &frustum,
+                                   Budget budget) {
+  // Update 0 marks triangles not moved or refreshed yet
+  ++update_;
+  time_ = time;
+  auto start = std::chrono::steady_clock::now();
+  size_t num_refreshed = 0;
+  auto refreshBatch = [&](auto next_triangle) {
+    for (size_t i = 0; i < BatchSize; ++i) {
+      auto idx = next_triangle();
+      if (refreshed_[idx] != update_)
+        num_refreshed += refresh(idx);
+    }
+    return std::chrono::steady_clock::now() - start < budget;
+  };
+
+  // Visible triangles continue where the last update ran out of time
+  Triangles visible;
+  for (auto range : index_.findVisible(frustum))
+    visible.insert(visible.end(), index_.getOrder().begin() + range.begin,
+                   index_.getOrder().begin() + range.end);
+  size_t visible_end = visible_cursor_ + visible.size();
+  bool in_budget = true;
+  while (in_budget && visible_cursor_ < visible_end)
+    in_budget = refreshBatch([&]() {
+      return visible[visible_cursor_++ % visible.size()];
+    });
+  visible_cursor_ = visible.empty() ? 0 : visible_cursor_ % visible.size();
+
+  // Off-screen ones after them, at most one pass per update
+  for (size_t i = 0; in_budget && i < size(); i += BatchSize)
+    in_budget = refreshBatch([&]() {
+      cursor_ = (cursor_ + 1) % size();
+      return index_.getOrder()[cursor_];
+    });
+  return num_refreshed;
+}
+
+Collisions ProgressiveDetector::getCollisions() const {
+  Collisions collisions;
+  for (TriangleIdx i = 0; i < size(); ++i)
+    if (colliding_[i])
+      collisions.insert(collisions.end(), i);
+  return collisions;
+}
+
+const geom::Triangle &ProgressiveDetector::getPosition(TriangleIdx idx) {
+  if (moved_[idx] != update_) {
+    positions_[idx] = scene_[idx].get(time_);
+    moved_[idx] = update_;
+  }
+  return positions_[idx];
+}
+
+size_t ProgressiveDetector::refresh(TriangleIdx idx) {
+  const auto &tri = getPosition(idx);
+  // Triangles closer than epsilon intersect
+  geom::AABB box(tri);
+  box.expand(geom::epsilon);
+  colliding_[idx] = false;
+  refreshed_[idx] = update_;
+  size_t num_refreshed = 1;
+  // Stops at the first hit, which also refreshes the other triangle
+  index_.forEachOverlap(box, [&](TriangleIdx other) {
+    if (other == idx || colliding_[idx])
+      return;
+    const auto &other_tri = getPosition(other);
+    if (!box.intersects(geom::AABB(other_tri)) ||
+        !geom::Intersects(tri, other_tri))
+      return;
+    colliding_[idx] = colliding_[other] = true;
+    if (refreshed_[other] != update_)
+      ++num_refreshed;
+    refreshed_[other] = update_;
+  });
+  return num_refreshed;
+}
+
+} // namespace scene
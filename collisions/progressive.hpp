@@ -0,0 +1,54 @@
+#ifndef COLLISIONS_PROGRESSIVE_HPP
+#define COLLISIONS_PROGRESSIVE_HPP
+
+#include "scene.hpp"
+#include "spatial_index.hpp"
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace scene {
+
+// Collision state of a dynamic scene kept across frames and refreshed within
+// a time budget: triangles in the view frustum first, then the others round
+// robin, so off-screen state is refreshed progressively. Triangles are
+// tested against the ones whose bounds over all time overlap them, found in
+// an index built once, and moved only when tested.
+class ProgressiveDetector {
+public:
+  // Triangles are tested in batches of this size between clock reads, so at
+  // least one batch is refreshed per update
+  static constexpr size_t BatchSize = 64;
+  using Budget = std::chrono::duration<double>;
+
+  ProgressiveDetector() = default;
+  explicit ProgressiveDetector(const DynamicScene &scene);
+  size_t size() const { return scene_.size(); }
+  // Returns the number of triangles refreshed, including the ones found
+  // colliding with refreshed triangles
+  size_t update(float time, const geom::Frustum &frustum, Budget budget);
+  // Nonzero if the triangle collided when it was last refreshed
+  const std::vector<uint8_t> &getColliding() const { return colliding_; }
+  Collisions getCollisions() const;
+
+private:
+  DynamicScene scene_;
+  // Of the bounds over all time
+  SpatialIndex index_;
+  std::vector<uint8_t> colliding_;
+  // Positions at the time of the update they were computed in
+  std::vector<geom::Triangle> positions_;
+  std::vector<uint32_t> moved_, refreshed_;
+  uint32_t update_ = 0;
+  float time_ = 0.f;
+  // Where the next visible and off-screen refresh starts
+  size_t visible_cursor_ = 0, cursor_ = 0;
+
+  const geom::Triangle &getPosition(TriangleIdx idx);
+  // Returns the number of triangles refreshed
+  size_t refresh(TriangleIdx idx);
+};
+
+} // namespace scene
+
+#endif
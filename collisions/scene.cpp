@@ -1,42 +1,168 @@
 #include "scene.hpp"
 #include "geometry.hpp"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <glm/gtc/quaternion.hpp>
 #include <iostream>
 #include <numeric>
+#include <thread>
+#include <type_traits>
 
 namespace scene {
-TreeNode::TreeNode(const Triangles &tris, const Scene &scene) {
-  // Find separating plane
-  // TODO: better heuristic
-  glm::vec3 min{geom::pos_inf, geom::pos_inf, geom::pos_inf},
-      max{geom::neg_inf, geom::neg_inf, geom::neg_inf};
-  for (auto idx : tris) {
-    const geom::Triangle &tri = scene[idx];
-    for (auto p : {tri.getPoint(0), tri.getPoint(1), tri.getPoint(2)}) {
-      min.x = std::min(min.x, p.x);
-      min.y = std::min(min.y, p.y);
-      min.z = std::min(min.z, p.z);
-      max.x = std::max(max.x, p.x);
-      max.y = std::max(max.y, p.y);
-      max.z = std::max(max.z, p.z);
+
+namespace {
+
+unsigned getNumThreads(unsigned num_threads) {
+  if (num_threads)
+    return num_threads;
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// Runs task(i, result) for every i in [0, num_tasks) on num_threads threads
+// with dynamic scheduling, each thread accumulates its own result
+template <typename Result, typename Task>
+std::vector<Result> runParallel(size_t num_tasks, unsigned num_threads,
+                                Task task) {
+  num_threads = static_cast<unsigned>(
+      std::max<size_t>(std::min<size_t>(num_threads, num_tasks), 1));
+  std::vector<Result> results(num_threads);
+  std::atomic<size_t> next{0};
+  auto worker = [&](unsigned thread_idx) {
+    for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) <
+                   num_tasks;)
+      task(i, results[thread_idx]);
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker, i);
+  worker(0);
+  for (auto &thread : threads)
+    thread.join();
+  return results;
+}
+
+using Clock = std::chrono::steady_clock;
+
+double getSeconds(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+Collisions merge(std::vector<Collisions> results) {
+  for (size_t i = 1; i < results.size(); ++i)
+    results[0].merge(results[i]);
+  return std::move(results[0]);
+}
+
+Pairs merge(std::vector<Pairs> results) {
+  for (size_t i = 1; i < results.size(); ++i)
+    results[0].insert(results[0].end(), results[i].begin(), results[i].end());
+  std::sort(results[0].begin(), results[0].end());
+  return std::move(results[0]);
+}
+
+// Pair can be skipped once both triangles are known to collide
+bool isKnown(const Collisions &res, TriangleIdx idx1, TriangleIdx idx2) {
+  return res.count(idx1) && res.count(idx2);
+}
+
+bool isKnown(const Pairs &, TriangleIdx, TriangleIdx) { return false; }
+
+void addHit(Collisions &res, TriangleIdx idx1, TriangleIdx idx2) {
+  res.insert({idx1, idx2});
+}
+
+void addHit(Pairs &res, TriangleIdx idx1, TriangleIdx idx2) {
+  res.emplace_back(std::min(idx1, idx2), std::max(idx1, idx2));
+}
+
+size_t getMemory(const Collisions &res) {
+  // Red-black tree node: value, three links and color
+  return res.size() * (sizeof(TriangleIdx) + 4 * sizeof(void *));
+}
+
+size_t getMemory(const Pairs &res) {
+  return res.capacity() * sizeof(TrianglePair);
+}
+
+template <typename Result>
+void testPair(SceneView scene, TriangleIdx idx1, TriangleIdx idx2,
+              Result &res) {
+  if (isKnown(res, idx1, idx2))
+    return;
+#ifndef NDEBUG
+  std::cerr << "Testing tris " << idx1 << " and " << idx2 << '\n';
+#endif
+  if (geom::Intersects(scene[idx1], scene[idx2]))
+    addHit(res, idx1, idx2);
+}
+
+// Per-thread result of instrumented testing. Candidates are collected into
+// batches, so the clock is read once per batch instead of once per pair.
+template <typename Result> struct CountingResult {
+  static constexpr size_t BatchSize = 1024;
+  Result res;
+  Pairs batch;
+  uint64_t candidates = 0, skipped = 0, hits = 0;
+  double total_time = 0., narrow_phase_time = 0.;
+};
+
+template <typename Result>
+void testBatch(SceneView scene, CountingResult<Result> &state) {
+  auto start = Clock::now();
+  for (auto [idx1, idx2] : state.batch) {
+    if (isKnown(state.res, idx1, idx2)) {
+      ++state.skipped;
+      continue;
+    }
+    if (geom::Intersects(scene[idx1], scene[idx2])) {
+      ++state.hits;
+      addHit(state.res, idx1, idx2);
     }
   }
-  geom::AAPlane::Axis axis;
-  if (max.x - min.x > max.y - min.y) {
-    if (max.x - min.x > max.z - min.z)
-      axis = geom::AAPlane::Axis::X;
-    else
-      axis = geom::AAPlane::Axis::Z;
-  } else {
-    if (max.y - min.y > max.z - min.z)
-      axis = geom::AAPlane::Axis::Y;
+  state.candidates += state.batch.size();
+  state.batch.clear();
+  state.narrow_phase_time += getSeconds(start);
+}
+
+void addToHistogram(std::vector<uint64_t> &histogram, size_t value) {
+  size_t bucket = 0;
+  for (; value; value >>= 1)
+    ++bucket;
+  if (histogram.size() <= bucket)
+    histogram.resize(bucket + 1);
+  ++histogram[bucket];
+}
+
+void dumpHistogram(std::ostream &os, const std::vector<uint64_t> &histogram) {
+  for (size_t i = 0; i < histogram.size(); ++i) {
+    if (!histogram[i])
+      continue;
+    os << ' ';
+    if (i == 0)
+      os << '0';
     else
-      axis = geom::AAPlane::Axis::Z;
+      os << (size_t(1) << (i - 1)) << '-' << (size_t(1) << i) - 1;
+    os << ':' << histogram[i];
   }
-  geom::AAPlane plane(
-      (min[static_cast<unsigned>(axis)] + max[static_cast<unsigned>(axis)]) *
-          0.5f,
-      axis);
+}
+
+} // namespace
+
+TreeNode::TreeNode(const Triangles &tris, SceneView scene,
+                   unsigned num_threads) {
+  // Find separating plane
+  // TODO: better heuristic
+  geom::AABB bounds;
+  for (auto idx : tris)
+    bounds.extend(geom::AABB(scene[idx]));
+  auto axis = bounds.getLongestAxis();
+  geom::AAPlane plane((bounds.getMin()[static_cast<unsigned>(axis)] +
+                       bounds.getMax()[static_cast<unsigned>(axis)]) *
+                          0.5f,
+                      axis);
   // Do separation
   for (auto idx : tris) {
     if (plane.isFront(scene[idx])) {
@@ -49,51 +175,200 @@ TreeNode::TreeNode(const Triangles &tris, const Scene &scene) {
     }
     tris_.push_back(idx);
   }
-  if (!children_tris_.first.empty())
-    children_.first = std::make_unique<TreeNode>(children_tris_.first, scene);
+  // Subtrees are independent, so the first one is built on a separate thread
+  // while there are threads to spare
+  std::future<std::unique_ptr<TreeNode>> first;
+  unsigned first_threads = num_threads / 2;
+  if (!children_tris_.first.empty()) {
+    auto build = [this, scene, first_threads]() {
+      return std::make_unique<TreeNode>(children_tris_.first, scene,
+                                        first_threads);
+    };
+    if (first_threads)
+      first = std::async(std::launch::async, build);
+    else
+      children_.first = build();
+  }
   if (!children_tris_.second.empty())
-    children_.second = std::make_unique<TreeNode>(children_tris_.second, scene);
+    children_.second = std::make_unique<TreeNode>(
+        children_tris_.second, scene, num_threads - first_threads);
+  if (first.valid())
+    children_.first = first.get();
 }
 
-Collisions TreeNode::testCollisions(const Scene &scene) {
-  Collisions res;
-  auto do_test = [&](TriangleIdx idx1, TriangleIdx idx2) {
-    if (res.count(idx1) && res.count(idx2))
-      return;
-#ifndef NDEBUG
-    std::cerr << "Testing tris " << idx1 << " and " << idx2 << '\n';
-#endif
-    if (geom::Intersects(scene[idx1], scene[idx2]))
-      res.insert({idx1, idx2});
-  };
+void TreeNode::collectNodes(std::vector<const TreeNode *> &nodes) const {
+  nodes.push_back(this);
+  if (children_.first)
+    children_.first->collectNodes(nodes);
+  if (children_.second)
+    children_.second->collectNodes(nodes);
+}
+
+template <typename Fn> void TreeNode::forEachCandidate(Fn fn) const {
   // Test all triangles on current hierarchy level with each other and with
   // children triangles
   for (unsigned i = 0; i < tris_.size(); ++i) {
     for (unsigned j = i + 1; j < tris_.size(); ++j)
-      do_test(tris_[i], tris_[j]);
+      fn(tris_[i], tris_[j]);
     for (unsigned j = 0; j < children_tris_.first.size(); ++j)
-      do_test(tris_[i], children_tris_.first[j]);
+      fn(tris_[i], children_tris_.first[j]);
     for (unsigned j = 0; j < children_tris_.second.size(); ++j)
-      do_test(tris_[i], children_tris_.second[j]);
+      fn(tris_[i], children_tris_.second[j]);
   }
+}
+
+void TreeNode::collectStats(Stats &stats, size_t depth) const {
+  ++stats.num_nodes;
+  stats.max_depth = std::max(stats.max_depth, depth);
+  stats.tree_memory += sizeof(TreeNode) +
+                       (tris_.capacity() + children_tris_.first.capacity() +
+                        children_tris_.second.capacity()) *
+                           sizeof(TriangleIdx);
+  bool is_leaf = !children_.first && !children_.second;
+  addToHistogram(is_leaf ? stats.leaf_sizes : stats.straddler_sizes,
+                 tris_.size());
   if (children_.first)
-    res.merge(children_.first->testCollisions(scene));
+    children_.first->collectStats(stats, depth + 1);
   if (children_.second)
-    res.merge(children_.second->testCollisions(scene));
-  return res;
+    children_.second->collectStats(stats, depth + 1);
+}
+
+template <typename Result>
+Result TreeNode::test(SceneView scene, unsigned num_threads,
+                      Stats *stats) const {
+  std::vector<const TreeNode *> nodes;
+  collectNodes(nodes);
+  num_threads = getNumThreads(num_threads);
+  if (!stats)
+    return merge(runParallel<Result>(
+        nodes.size(), num_threads, [&](size_t i, Result &res) {
+          nodes[i]->forEachCandidate(
+              [&](TriangleIdx idx1, TriangleIdx idx2) {
+                testPair(scene, idx1, idx2, res);
+              });
+        }));
+
+  size_t tree_memory = stats->tree_memory;
+  collectStats(*stats, 1);
+  tree_memory = stats->tree_memory - tree_memory;
+  auto results = runParallel<CountingResult<Result>>(
+      nodes.size(), num_threads, [&](size_t i, CountingResult<Result> &state) {
+        auto start = Clock::now();
+        nodes[i]->forEachCandidate([&](TriangleIdx idx1, TriangleIdx idx2) {
+          state.batch.emplace_back(idx1, idx2);
+          if (state.batch.size() == state.BatchSize)
+            testBatch(scene, state);
+        });
+        testBatch(scene, state);
+        state.total_time += getSeconds(start);
+      });
+  std::vector<Result> res;
+  size_t memory = tree_memory + nodes.capacity() * sizeof(TreeNode *);
+  for (auto &state : results) {
+    stats->candidate_pairs += state.candidates;
+    stats->skipped_pairs += state.skipped;
+    stats->rejected_pairs += state.candidates - state.skipped - state.hits;
+    stats->hits += state.hits;
+    stats->traversal_time += state.total_time - state.narrow_phase_time;
+    stats->narrow_phase_time += state.narrow_phase_time;
+    memory += getMemory(state.res) +
+              state.batch.capacity() * sizeof(TrianglePair);
+    res.push_back(std::move(state.res));
+  }
+  stats->peak_memory = std::max(stats->peak_memory, memory);
+  return merge(std::move(res));
+}
+
+Collisions TreeNode::testCollisions(SceneView scene, unsigned num_threads,
+                                    Stats *stats) {
+  return test<Collisions>(scene, num_threads, stats);
+}
+
+Pairs TreeNode::findPairs(SceneView scene, unsigned num_threads,
+                          Stats *stats) {
+  return test<Pairs>(scene, num_threads, stats);
 }
 
-Collisions findIntersectingTriangles(const Scene &scene) {
+namespace {
+
+template <typename Result>
+Result findIntersecting(SceneView scene, unsigned num_threads, Stats *stats) {
+  if (stats)
+    *stats = Stats{};
+  auto start = Clock::now();
   Triangles tris(scene.size());
   std::iota(tris.begin(), tris.end(), 0);
-  return TreeNode(tris, scene).testCollisions(scene);
+  num_threads = getNumThreads(num_threads);
+  TreeNode tree(tris, scene, num_threads);
+  if (stats)
+    stats->build_time = getSeconds(start);
+  if constexpr (std::is_same_v<Result, Collisions>)
+    return tree.testCollisions(scene, num_threads, stats);
+  else
+    return tree.findPairs(scene, num_threads, stats);
+}
+
+} // namespace
+
+Collisions findIntersectingTriangles(SceneView scene, unsigned num_threads,
+                                     Stats *stats) {
+  return findIntersecting<Collisions>(scene, num_threads, stats);
+}
+
+Pairs findIntersectingPairs(SceneView scene, unsigned num_threads,
+                            Stats *stats) {
+  return findIntersecting<Pairs>(scene, num_threads, stats);
+}
+
+Collisions findIntersectingTrianglesBruteForce(SceneView scene,
+                                               unsigned num_threads) {
+  auto test_row = [scene](size_t i, Collisions &res) {
+    for (TriangleIdx j = i + 1; j < scene.size(); ++j)
+      testPair(scene, i, j, res);
+  };
+  return merge(runParallel<Collisions>(
+      scene.size(), getNumThreads(num_threads), test_row));
+}
+
+Pairs findIntersectingPairsBruteForce(SceneView scene, unsigned num_threads) {
+  auto test_row = [scene](size_t i, Pairs &res) {
+    for (TriangleIdx j = i + 1; j < scene.size(); ++j)
+      testPair(scene, i, j, res);
+  };
+  return merge(runParallel<Pairs>(scene.size(), getNumThreads(num_threads),
+                                  test_row));
 }
 
 geom::Triangle DynamicTriangle::get(float time) const {
-  float angle = glm::radians(fmod(speed_ * time, 360.f));
-  return geom::Triangle(axis_.rotatePoint(tri_.getPoint(0), angle),
-                        axis_.rotatePoint(tri_.getPoint(1), angle),
-                        axis_.rotatePoint(tri_.getPoint(2), angle));
+  // Same rotation as Line::rotatePoint, built once for all vertices
+  float angle = glm::radians(std::fmod(speed_ * time, 360.f));
+  auto quat = glm::normalize(glm::angleAxis(angle, axis_.getDirection()));
+  glm::vec3 point = axis_.getPoint();
+  return geom::Triangle(point + quat * (tri_.getPoint(0) - point),
+                        point + quat * (tri_.getPoint(1) - point),
+                        point + quat * (tri_.getPoint(2) - point));
+}
+
+geom::AABB DynamicTriangle::getSweptBounds() const {
+  glm::vec3 dir = glm::normalize(axis_.getDirection());
+  // Extent of a unit circle perpendicular to the axis along each coordinate
+  glm::vec3 extent(std::sqrt(std::max(0.f, 1.f - dir.x * dir.x)),
+                   std::sqrt(std::max(0.f, 1.f - dir.y * dir.y)),
+                   std::sqrt(std::max(0.f, 1.f - dir.z * dir.z)));
+  geom::AABB bounds;
+  for (int i = 0; i < 3; ++i) {
+    glm::vec3 point = tri_.getPoint(i);
+    glm::vec3 center = axis_.getPoint() +
+                       dir * glm::dot(point - axis_.getPoint(), dir);
+    float radius = glm::length(point - center);
+    bounds.extend(center - extent * radius);
+    bounds.extend(center + extent * radius);
+  }
+  // Rotated vertices may be off by rounding
+  float scale = glm::length(
+      glm::max(glm::abs(bounds.getMin()), glm::abs(bounds.getMax())));
+  bounds.expand(16.f * geom::epsilon * (1.f + scale));
+  return bounds;
 }
 
 void DynamicTriangle::dump(std::ostream &os) const {
@@ -113,11 +388,127 @@ std::istream &operator>>(std::istream &is, DynamicTriangle &tri) {
   return is;
 }
 
+void Stats::dump(std::ostream &os) const {
+  os << "build time: " << build_time * 1e3 << " ms\n"
+     << "traversal time: " << traversal_time * 1e3 << " ms\n"
+     << "narrow phase time: " << narrow_phase_time * 1e3 << " ms\n"
+     << "nodes: " << num_nodes << ", max depth: " << max_depth << '\n'
+     << "leaf sizes:";
+  dumpHistogram(os, leaf_sizes);
+  os << "\nstraddler sizes:";
+  dumpHistogram(os, straddler_sizes);
+  os << "\ncandidate pairs: " << candidate_pairs
+     << ", skipped: " << skipped_pairs << ", rejected: " << rejected_pairs
+     << ", hits: " << hits << '\n'
+     << "tree memory: " << tree_memory << " bytes, peak memory: "
+     << peak_memory << " bytes\n";
+}
+
+std::ostream &operator<<(std::ostream &os, const Stats &stats) {
+  stats.dump(os);
+  return os;
+}
+
 Scene updateDynamicScene(const DynamicScene &scene, float time) {
   Scene res;
-  std::transform(scene.begin(), scene.end(), std::back_inserter(res),
-                 [time](const DynamicTriangle &tri) { return tri.get(time); });
+  updateDynamicScene(scene, time, res);
   return res;
 }
 
+void updateDynamicScene(const DynamicScene &scene, float time, Scene &out) {
+  out.resize(scene.size());
+  std::transform(scene.begin(), scene.end(), out.begin(),
+                 [time](const DynamicTriangle &tri) { return tri.get(time); });
+}
+
+PackedDynamicScene::PackedDynamicScene(const DynamicScene &scene) {
+  for (auto &array : vertices_)
+    array.reserve(scene.size());
+  for (unsigned i = 0; i < 3; ++i) {
+    points_[i].reserve(scene.size());
+    dirs_[i].reserve(scene.size());
+  }
+  dir_lengths2_.reserve(scene.size());
+  speeds_.reserve(scene.size());
+  for (const auto &tri : scene) {
+    glm::vec3 point = tri.getAxis().getPoint(),
+              dir = tri.getAxis().getDirection();
+    for (unsigned i = 0; i < 3; ++i) {
+      glm::vec3 vertex = tri.getTriangle().getPoint(i) - point;
+      for (unsigned j = 0; j < 3; ++j)
+        vertices_[i * 3 + j].push_back(vertex[j]);
+      points_[i].push_back(point[i]);
+      dirs_[i].push_back(dir[i]);
+    }
+    dir_lengths2_.push_back(glm::length2(dir));
+    speeds_.push_back(tri.getSpeed());
+  }
+}
+
+void PackedDynamicScene::update(float time, Scene &out,
+                                unsigned num_threads) const {
+  out.resize(size());
+  // Small scenes are not worth waking up threads
+  constexpr size_t TaskSize = 16384;
+  size_t num_tasks = (size() + TaskSize - 1) / TaskSize;
+  runParallel<char>(num_tasks, getNumThreads(num_threads),
+                    [&](size_t i, char &) {
+                      update(time, i * TaskSize,
+                             std::min(size(), (i + 1) * TaskSize), out.data());
+                    });
+}
+
+namespace {
+
+// Sine and cosine of x in [-pi, pi]: Taylor polynomials of x / 2 and double
+// angle formulas. Unlike std::sin and std::cos this vectorizes.
+void getSinCos(float x, float &sin, float &cos) {
+  float h = x * 0.5f, h2 = h * h;
+  float s = -2.5052108e-8f;
+  s = s * h2 + 1.f / 362880;
+  s = s * h2 - 1.f / 5040;
+  s = s * h2 + 1.f / 120;
+  s = s * h2 - 1.f / 6;
+  s = (s * h2 + 1.f) * h;
+  float c = 2.0876757e-9f;
+  c = c * h2 - 2.7557319e-7f;
+  c = c * h2 + 1.f / 40320;
+  c = c * h2 - 1.f / 720;
+  c = c * h2 + 1.f / 24;
+  c = c * h2 - 0.5f;
+  c = c * h2 + 1.f;
+  sin = 2.f * s * c;
+  cos = c * c - s * s;
+}
+
+} // namespace
+
+void PackedDynamicScene::update(float time, size_t begin, size_t end,
+                                geom::Triangle *out) const {
+  for (size_t idx = begin; idx < end; ++idx) {
+    // Reduced like std::fmod, sign of the result does not change rotation
+    float degrees = speeds_[idx] * time;
+    degrees -= 360.f * std::trunc(degrees * (1.f / 360.f));
+    float w, s;
+    getSinCos(glm::radians(degrees) * 0.5f, s, w);
+    float norm = 1.f / std::sqrt(w * w + dir_lengths2_[idx] * s * s);
+    float qw = w * norm, qs = s * norm;
+    float qx = dirs_[0][idx] * qs, qy = dirs_[1][idx] * qs,
+          qz = dirs_[2][idx] * qs;
+    glm::vec3 point{points_[0][idx], points_[1][idx], points_[2][idx]};
+    glm::vec3 res[3];
+    for (unsigned j = 0; j < 3; ++j) {
+      float x = vertices_[j * 3][idx], y = vertices_[j * 3 + 1][idx],
+            z = vertices_[j * 3 + 2][idx];
+      // v' = v + w * t + q x t, where t = 2 * (q x v)
+      float tx = 2.f * (qy * z - qz * y), ty = 2.f * (qz * x - qx * z),
+            tz = 2.f * (qx * y - qy * x);
+      res[j] = point + glm::vec3{x + qw * tx + (qy * tz - qz * ty),
+                                 y + qw * ty + (qz * tx - qx * tz),
+                                 z + qw * tz + (qx * ty - qy * tx)};
+    }
+    out[idx] = geom::Triangle(res[0], res[1], res[2]);
+  }
+}
+
 } // namespace scene
@@ -2,6 +2,9 @@
 #define COLLISIONS_SCENE_HPP
 
 #include "geometry.hpp"
+#include <array>
+#include <cstdint>
+#include <iosfwd>
 #include <memory>
 #include <set>
 #include <vector>
@@ -12,18 +15,104 @@ using TriangleIdx = uint32_t;
 using Triangles = std::vector<TriangleIdx>;
 using Collisions = std::set<TriangleIdx>;
 
+// Triangles sharing vertex storage: a vertex array plus an index triple per
+// triangle
+using IndexTriple = std::array<uint32_t, 3>;
+struct IndexedScene {
+  std::vector<glm::vec3> vertices;
+  std::vector<IndexTriple> triangles;
+};
+
+// Non-owning view of triangle storage: either contiguous triangles (a Scene
+// or a mapped binary scene file) or an indexed mesh
+class SceneView {
+public:
+  SceneView() = default;
+  SceneView(const geom::Triangle *tris, size_t size)
+      : tris_(tris), size_(size) {}
+  SceneView(const glm::vec3 *vertices, const IndexTriple *indices,
+            size_t size)
+      : vertices_(vertices), indices_(indices), size_(size) {}
+  SceneView(const Scene &scene) : SceneView(scene.data(), scene.size()) {}
+  SceneView(const IndexedScene &scene)
+      : SceneView(scene.vertices.data(), scene.triangles.data(),
+                  scene.triangles.size()) {}
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  bool isIndexed() const { return indices_ != nullptr; }
+  geom::Triangle operator[](TriangleIdx idx) const {
+    assert(idx < size_);
+    if (!indices_)
+      return tris_[idx];
+    const auto &tri = indices_[idx];
+    return geom::Triangle(vertices_[tri[0]], vertices_[tri[1]],
+                          vertices_[tri[2]]);
+  }
+
+private:
+  const geom::Triangle *tris_ = nullptr;
+  const glm::vec3 *vertices_ = nullptr;
+  const IndexTriple *indices_ = nullptr;
+  size_t size_ = 0;
+};
+
+using TrianglePair = std::pair<TriangleIdx, TriangleIdx>;
+using Pairs = std::vector<TrianglePair>;
+
+// Per-phase statistics of the tree engine. findIntersecting* functions reset
+// it, so it describes the last run only.
+struct Stats {
+  // Seconds, traversal and narrow phase are summed over worker threads
+  double build_time = 0., traversal_time = 0., narrow_phase_time = 0.;
+  size_t num_nodes = 0, max_depth = 0;
+  // Bucket 0 counts empty nodes, bucket i > 0 sizes in [2^(i-1), 2^i)
+  std::vector<uint64_t> leaf_sizes, straddler_sizes;
+  // Candidates produced by the tree, skipped because both triangles were
+  // already known to collide, rejected by the narrow phase, and hits
+  uint64_t candidate_pairs = 0, skipped_pairs = 0, rejected_pairs = 0,
+           hits = 0;
+  // Approximate bytes held by the tree and by the tree plus results
+  size_t tree_memory = 0, peak_memory = 0;
+
+  void dump(std::ostream &os) const;
+};
+
+std::ostream &operator<<(std::ostream &os, const Stats &stats);
+
 class TreeNode {
 public:
-  TreeNode(const Triangles &tris, const Scene &scene);
-  Collisions testCollisions(const Scene &scene);
+  TreeNode(const Triangles &tris, SceneView scene, unsigned num_threads = 1);
+  // Stats collection batches candidate pairs and reads the clock per batch,
+  // results are the same as without it
+  Collisions testCollisions(SceneView scene, unsigned num_threads = 1,
+                            Stats *stats = nullptr);
+  Pairs findPairs(SceneView scene, unsigned num_threads = 1,
+                  Stats *stats = nullptr);
 
 private:
   Triangles tris_;
   std::pair<Triangles, Triangles> children_tris_;
   std::pair<std::unique_ptr<TreeNode>, std::unique_ptr<TreeNode>> children_;
+
+  void collectNodes(std::vector<const TreeNode *> &nodes) const;
+  void collectStats(Stats &stats, size_t depth) const;
+  template <typename Fn> void forEachCandidate(Fn fn) const;
+  template <typename Result>
+  Result test(SceneView scene, unsigned num_threads, Stats *stats) const;
 };
 
-Collisions findIntersectingTriangles(const Scene &scene);
+// num_threads == 0 means all hardware threads
+Collisions findIntersectingTriangles(SceneView scene, unsigned num_threads = 1,
+                                     Stats *stats = nullptr);
+// Every intersecting pair once, ordered as (smaller, larger) and sorted
+Pairs findIntersectingPairs(SceneView scene, unsigned num_threads = 1,
+                            Stats *stats = nullptr);
+
+// Reference engines testing every pair of triangles
+Collisions findIntersectingTrianglesBruteForce(SceneView scene,
+                                               unsigned num_threads = 1);
+Pairs findIntersectingPairsBruteForce(SceneView scene,
+                                      unsigned num_threads = 1);
 
 class DynamicTriangle {
 public:
@@ -31,6 +120,12 @@ public:
   DynamicTriangle(const geom::Triangle &tri, const geom::Line axis, float speed)
       : tri_(tri), axis_(axis), speed_(speed) {}
   geom::Triangle get(float time) const;
+  // Bounds of the triangle at any time: every vertex stays on a circle
+  // around the axis
+  geom::AABB getSweptBounds() const;
+  const geom::Triangle &getTriangle() const { return tri_; }
+  const geom::Line &getAxis() const { return axis_; }
+  float getSpeed() const { return speed_; }
   void dump(std::ostream &os) const;
   void read(std::istream &is);
 
@@ -47,6 +142,30 @@ std::istream &operator>>(std::istream &is, DynamicTriangle &tri);
 using DynamicScene = std::vector<DynamicTriangle>;
 
 Scene updateDynamicScene(const DynamicScene &scene, float time);
+// Writes into caller-owned scene, which is resized only if its size differs
+void updateDynamicScene(const DynamicScene &scene, float time, Scene &out);
+
+// Structure-of-arrays copy of a dynamic scene for updating every frame.
+// Rotation is computed once per triangle, and triangles are processed in
+// batches of plain arithmetic over arrays, which compilers vectorize.
+class PackedDynamicScene {
+public:
+  PackedDynamicScene() = default;
+  explicit PackedDynamicScene(const DynamicScene &scene);
+  size_t size() const { return speeds_.size(); }
+  // num_threads == 0 means all hardware threads
+  void update(float time, Scene &out, unsigned num_threads = 1) const;
+
+private:
+  // Vertex coordinates relative to the axis point: x, y, z of every vertex
+  std::array<std::vector<float>, 9> vertices_;
+  std::array<std::vector<float>, 3> points_, dirs_;
+  // Squared axis direction length, quaternion built from it is normalized
+  std::vector<float> dir_lengths2_;
+  std::vector<float> speeds_;
+
+  void update(float time, size_t begin, size_t end, geom::Triangle *out) const;
+};
 
 } // namespace scene
 
@@ -0,0 +1,383 @@
+#include "scene_file.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace scene {
+
+namespace {
+
+constexpr char Magic[4] = {'T', 'R', 'I', 'S'};
+constexpr uint32_t ByteOrderMark = 0x01020304;
+constexpr uint64_t HeaderSize = 64;
+
+enum HeaderFlags : uint32_t { Dynamic = 1 };
+
+struct Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t flags;
+  float max_time;
+  uint32_t reserved;
+  uint64_t num_triangles;
+  uint64_t triangles_offset, axes_offset, speeds_offset;
+};
+
+static_assert(sizeof(Header) <= HeaderSize, "header does not fit");
+static_assert(sizeof(geom::Triangle) == 9 * sizeof(float),
+              "triangles must be stored as packed floats");
+
+constexpr uint64_t TriangleSize = 9 * sizeof(float);
+constexpr uint64_t AxisSize = 6 * sizeof(float);
+constexpr uint64_t SpeedSize = sizeof(float);
+// Count of a corrupt text scene may be huge, larger scenes grow as read
+constexpr size_t MaxTextReserve = size_t(1) << 20;
+
+Header makeHeader(uint64_t num_triangles, bool dynamic, float max_time) {
+  Header header{};
+  std::memcpy(header.magic, Magic, sizeof(Magic));
+  header.version = BinarySceneVersion;
+  header.byte_order = ByteOrderMark;
+  header.flags = dynamic ? static_cast<uint32_t>(Dynamic) : 0u;
+  header.max_time = max_time;
+  header.num_triangles = num_triangles;
+  header.triangles_offset = HeaderSize;
+  if (dynamic) {
+    header.axes_offset = header.triangles_offset + num_triangles * TriangleSize;
+    header.speeds_offset = header.axes_offset + num_triangles * AxisSize;
+  }
+  return header;
+}
+
+void writeHeader(std::ostream &os, const Header &header) {
+  char buf[HeaderSize] = {};
+  std::memcpy(buf, &header, sizeof(Header));
+  os.write(buf, HeaderSize);
+}
+
+void writeFloats(std::ostream &os, const float *data, size_t count) {
+  os.write(reinterpret_cast<const char *>(data), count * sizeof(float));
+}
+
+void writeTriangle(std::ostream &os, const geom::Triangle &tri) {
+  os.write(reinterpret_cast<const char *>(&tri), sizeof(geom::Triangle));
+}
+
+void writeAxis(std::ostream &os, const geom::Line &line) {
+  glm::vec3 point = line.getPoint(), dir = line.getDirection();
+  float axis[6] = {point.x, point.y, point.z, dir.x, dir.y, dir.z};
+  writeFloats(os, axis, 6);
+}
+
+void writeText(std::ostream &os, glm::vec3 p) {
+  os << p.x << ' ' << p.y << ' ' << p.z;
+}
+
+void writeText(std::ostream &os, const geom::Triangle &tri) {
+  writeText(os, tri.getPoint(0));
+  os << ' ';
+  writeText(os, tri.getPoint(1));
+  os << ' ';
+  writeText(os, tri.getPoint(2));
+}
+
+bool isInside(uint64_t offset, uint64_t size, uint64_t file_size) {
+  return offset <= file_size && size <= file_size - offset &&
+         offset % alignof(float) == 0;
+}
+
+} // namespace
+
+Scene readTextScene(std::istream &is) {
+  TriangleIdx num = 0;
+  if (!(is >> num))
+    throw std::runtime_error("invalid text scene header");
+  Scene res;
+  res.reserve(std::min<size_t>(num, MaxTextReserve));
+  for (TriangleIdx i = 0; i < num; ++i) {
+    geom::Triangle tri;
+    if (!(is >> tri))
+      throw std::runtime_error("unexpected end of text scene data");
+    res.push_back(tri);
+  }
+  return res;
+}
+
+DynamicScene readTextDynamicScene(std::istream &is, float &max_time) {
+  TriangleIdx num = 0;
+  if (!(is >> num >> max_time))
+    throw std::runtime_error("invalid text scene header");
+  DynamicScene res;
+  res.reserve(std::min<size_t>(num, MaxTextReserve));
+  for (TriangleIdx i = 0; i < num; ++i) {
+    DynamicTriangle tri;
+    if (!(is >> tri))
+      throw std::runtime_error("unexpected end of text scene data");
+    res.push_back(tri);
+  }
+  return res;
+}
+
+void writeTextSceneHeader(std::ostream &os, size_t num_triangles) {
+  os << num_triangles << '\n';
+}
+
+void writeTextSceneHeader(std::ostream &os, size_t num_triangles,
+                          float max_time) {
+  os << num_triangles << ' ' << std::setprecision(9) << max_time << '\n';
+}
+
+void writeTextTriangles(std::ostream &os, SceneView triangles) {
+  os << std::setprecision(9);
+  for (TriangleIdx i = 0; i < triangles.size(); ++i) {
+    writeText(os, triangles[i]);
+    os << '\n';
+  }
+}
+
+void writeTextTriangles(std::ostream &os, const DynamicScene &triangles) {
+  os << std::setprecision(9);
+  // Axis is stored as two points on it
+  for (const auto &tri : triangles) {
+    const auto &axis = tri.getAxis();
+    writeText(os, tri.getTriangle());
+    os << ' ';
+    writeText(os, axis.getPoint());
+    os << ' ';
+    writeText(os, axis.getPoint() + axis.getDirection());
+    os << ' ' << tri.getSpeed() << '\n';
+  }
+}
+
+void writeBinaryScene(std::ostream &os, SceneView scene) {
+  writeHeader(os, makeHeader(scene.size(), false, 0.f));
+  for (TriangleIdx i = 0; i < scene.size(); ++i)
+    writeTriangle(os, scene[i]);
+  if (!os)
+    throw std::runtime_error("failed to write binary scene");
+}
+
+void writeBinaryScene(std::ostream &os, const DynamicScene &scene,
+                      float max_time) {
+  writeHeader(os, makeHeader(scene.size(), true, max_time));
+  for (const auto &tri : scene)
+    writeTriangle(os, tri.getTriangle());
+  for (const auto &tri : scene)
+    writeAxis(os, tri.getAxis());
+  for (const auto &tri : scene) {
+    float speed = tri.getSpeed();
+    writeFloats(os, &speed, 1);
+  }
+  if (!os)
+    throw std::runtime_error("failed to write binary scene");
+}
+
+BinarySceneWriter::BinarySceneWriter(const std::string &path,
+                                     size_t num_triangles, bool dynamic,
+                                     float max_time)
+    : os_(path, std::ios::binary), num_triangles_(num_triangles) {
+  if (!os_)
+    throw std::runtime_error("can not open " + path);
+  Header header = makeHeader(num_triangles, dynamic, max_time);
+  triangles_offset_ = header.triangles_offset;
+  axes_offset_ = header.axes_offset;
+  speeds_offset_ = header.speeds_offset;
+  writeHeader(os_, header);
+}
+
+void BinarySceneWriter::seek(uint64_t offset) {
+  os_.seekp(static_cast<std::streamoff>(offset));
+}
+
+void BinarySceneWriter::write(size_t first, SceneView triangles) {
+  if (first + triangles.size() > num_triangles_)
+    throw std::out_of_range("triangles do not fit in binary scene");
+  seek(triangles_offset_ + first * TriangleSize);
+  for (TriangleIdx i = 0; i < triangles.size(); ++i)
+    writeTriangle(os_, triangles[i]);
+}
+
+void BinarySceneWriter::write(size_t first, const DynamicScene &triangles) {
+  if (!axes_offset_)
+    throw std::logic_error("binary scene is not dynamic");
+  if (first + triangles.size() > num_triangles_)
+    throw std::out_of_range("triangles do not fit in binary scene");
+  seek(triangles_offset_ + first * TriangleSize);
+  for (const auto &tri : triangles)
+    writeTriangle(os_, tri.getTriangle());
+  seek(axes_offset_ + first * AxisSize);
+  for (const auto &tri : triangles)
+    writeAxis(os_, tri.getAxis());
+  seek(speeds_offset_ + first * SpeedSize);
+  for (const auto &tri : triangles) {
+    float speed = tri.getSpeed();
+    writeFloats(os_, &speed, 1);
+  }
+}
+
+void BinarySceneWriter::close() {
+  os_.close();
+  if (!os_)
+    throw std::runtime_error("failed to write binary scene");
+}
+
+MappedScene::MappedScene(const std::string &path) {
+#ifdef _WIN32
+  file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    file_ = nullptr;
+    throw std::runtime_error("can not open scene file " + path);
+  }
+  LARGE_INTEGER file_size;
+  GetFileSizeEx(file_, &file_size);
+  size_ = static_cast<size_t>(file_size.QuadPart);
+  if (size_ != 0) {
+    mapping_ =
+        CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_)
+      data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (!data_) {
+      unmap();
+      throw std::runtime_error("can not map scene file " + path);
+    }
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("can not open scene file " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("can not stat scene file " + path);
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ != 0) {
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data_ == MAP_FAILED) {
+      data_ = nullptr;
+      close(fd);
+      throw std::runtime_error("can not map scene file " + path);
+    }
+  }
+  close(fd);
+#endif
+
+  Header header;
+  if (size_ < HeaderSize) {
+    unmap();
+    throw std::runtime_error("scene file is too small: " + path);
+  }
+  std::memcpy(&header, data_, sizeof(Header));
+  auto fail = [&](const char *reason) {
+    unmap();
+    throw std::runtime_error(std::string(reason) + ": " + path);
+  };
+  if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0)
+    fail("not a binary scene file");
+  if (header.version != BinarySceneVersion)
+    fail("unsupported binary scene version");
+  if (header.byte_order != ByteOrderMark)
+    fail("binary scene byte order does not match");
+  uint64_t num = header.num_triangles;
+  if (num > std::numeric_limits<TriangleIdx>::max() ||
+      !isInside(header.triangles_offset, num * TriangleSize, size_))
+    fail("corrupted triangles block");
+  auto base = static_cast<const char *>(data_);
+  scene_ = SceneView(
+      reinterpret_cast<const geom::Triangle *>(base + header.triangles_offset),
+      num);
+  if (header.flags & Dynamic) {
+    if (!isInside(header.axes_offset, num * AxisSize, size_) ||
+        !isInside(header.speeds_offset, num * SpeedSize, size_))
+      fail("corrupted dynamic blocks");
+    axes_ = reinterpret_cast<const float *>(base + header.axes_offset);
+    speeds_ = reinterpret_cast<const float *>(base + header.speeds_offset);
+    max_time_ = header.max_time;
+  }
+}
+
+MappedScene::MappedScene(MappedScene &&rhs)
+    : data_(std::exchange(rhs.data_, nullptr)),
+      size_(std::exchange(rhs.size_, 0)),
+#ifdef _WIN32
+      file_(std::exchange(rhs.file_, nullptr)),
+      mapping_(std::exchange(rhs.mapping_, nullptr)),
+#endif
+      scene_(std::exchange(rhs.scene_, SceneView{})),
+      axes_(std::exchange(rhs.axes_, nullptr)),
+      speeds_(std::exchange(rhs.speeds_, nullptr)), max_time_(rhs.max_time_) {
+}
+
+MappedScene &MappedScene::operator=(MappedScene &&rhs) {
+  if (this != &rhs) {
+    unmap();
+    data_ = std::exchange(rhs.data_, nullptr);
+    size_ = std::exchange(rhs.size_, 0);
+#ifdef _WIN32
+    file_ = std::exchange(rhs.file_, nullptr);
+    mapping_ = std::exchange(rhs.mapping_, nullptr);
+#endif
+    scene_ = std::exchange(rhs.scene_, SceneView{});
+    axes_ = std::exchange(rhs.axes_, nullptr);
+    speeds_ = std::exchange(rhs.speeds_, nullptr);
+    max_time_ = rhs.max_time_;
+  }
+  return *this;
+}
+
+MappedScene::~MappedScene() { unmap(); }
+
+void MappedScene::unmap() {
+#ifdef _WIN32
+  if (data_)
+    UnmapViewOfFile(data_);
+  if (mapping_)
+    CloseHandle(mapping_);
+  if (file_)
+    CloseHandle(file_);
+  mapping_ = file_ = nullptr;
+#else
+  if (data_)
+    munmap(data_, size_);
+#endif
+  data_ = nullptr;
+  size_ = 0;
+}
+
+DynamicScene MappedScene::getDynamicScene() const {
+  if (!isDynamic())
+    throw std::runtime_error("scene file has no dynamic data");
+  DynamicScene res;
+  res.reserve(scene_.size());
+  for (TriangleIdx i = 0; i < scene_.size(); ++i) {
+    const float *axis = axes_ + i * 6;
+    res.emplace_back(scene_[i],
+                     geom::Line(glm::vec3{axis[0], axis[1], axis[2]},
+                                glm::vec3{axis[3], axis[4], axis[5]}),
+                     speeds_[i]);
+  }
+  return res;
+}
+
+} // namespace scene
@@ -0,0 +1,85 @@
+#ifndef COLLISIONS_SCENE_FILE_HPP
+#define COLLISIONS_SCENE_FILE_HPP
+
+#include "scene.hpp"
+#include <cstdint>
+#include <fstream>
+#include <iosfwd>
+#include <string>
+
+namespace scene {
+
+// Binary scene file layout (native byte order, checked on load):
+//   header (64 bytes): magic "TRIS", version, byte order mark, flags,
+//                      max time, triangle count and block offsets
+//   triangles block:   9 packed floats per triangle
+//   axes block:        6 packed floats per triangle (point, direction),
+//                      only present in dynamic scenes
+//   speeds block:      1 float per triangle, only present in dynamic scenes
+constexpr uint32_t BinarySceneVersion = 1;
+
+Scene readTextScene(std::istream &is);
+DynamicScene readTextDynamicScene(std::istream &is, float &max_time);
+
+// Text writers print the header and the triangles separately, so large
+// scenes can be written in pieces
+void writeTextSceneHeader(std::ostream &os, size_t num_triangles);
+void writeTextSceneHeader(std::ostream &os, size_t num_triangles,
+                          float max_time);
+void writeTextTriangles(std::ostream &os, SceneView triangles);
+void writeTextTriangles(std::ostream &os, const DynamicScene &triangles);
+
+void writeBinaryScene(std::ostream &os, SceneView scene);
+void writeBinaryScene(std::ostream &os, const DynamicScene &scene,
+                      float max_time);
+
+// Writes binary scene file in pieces placed by triangle index, for scenes
+// that do not fit in memory
+class BinarySceneWriter {
+public:
+  BinarySceneWriter(const std::string &path, size_t num_triangles,
+                    bool dynamic = false, float max_time = 0.f);
+  void write(size_t first, SceneView triangles);
+  void write(size_t first, const DynamicScene &triangles);
+  // Flushes the file, throws if anything failed to be written
+  void close();
+
+private:
+  std::ofstream os_;
+  size_t num_triangles_;
+  uint64_t triangles_offset_, axes_offset_, speeds_offset_;
+
+  void seek(uint64_t offset);
+};
+
+class MappedScene {
+public:
+  explicit MappedScene(const std::string &path);
+  MappedScene(const MappedScene &) = delete;
+  MappedScene(MappedScene &&rhs);
+  MappedScene &operator=(const MappedScene &) = delete;
+  MappedScene &operator=(MappedScene &&rhs);
+  ~MappedScene();
+
+  // Triangles are used in place, without copying out of the mapping
+  SceneView getScene() const { return scene_; }
+  bool isDynamic() const { return axes_ != nullptr; }
+  float getMaxTime() const { return max_time_; }
+  DynamicScene getDynamicScene() const;
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  void *file_ = nullptr, *mapping_ = nullptr;
+#endif
+  SceneView scene_;
+  const float *axes_ = nullptr, *speeds_ = nullptr;
+  float max_time_ = 0.f;
+
+  void unmap();
+};
+
+} // namespace scene
+
+#endif
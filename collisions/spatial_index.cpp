@@ -0,0 +1,356 @@
+#include "spatial_index.hpp"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
+
+namespace scene {
+
+namespace {
+
+constexpr uint32_t NoHit = std::numeric_limits<uint32_t>::max();
+
+// Rays as structure of arrays
+template <size_t N> struct RayPacket {
+  float origin[3][N], dir[3][N], inv_dir[3][N];
+  // Nearest hit so far, negative once any hit is found in any-hit mode
+  float max_distance[N];
+};
+
+// Entry distance of the nearest ray entering the box, infinity if none does
+template <size_t N>
+float enterBox(const RayPacket<N> &rays, const geom::AABB &box) {
+  glm::vec3 min = box.getMin(), max = box.getMax();
+  float entry = geom::pos_inf;
+  for (size_t i = 0; i < N; ++i) {
+    float near = 0.f, far = rays.max_distance[i];
+    for (unsigned axis = 0; axis < 3; ++axis) {
+      float t0 = (min[axis] - rays.origin[axis][i]) * rays.inv_dir[axis][i];
+      float t1 = (max[axis] - rays.origin[axis][i]) * rays.inv_dir[axis][i];
+      near = std::max(near, std::min(t0, t1));
+      far = std::min(far, std::max(t0, t1));
+    }
+    entry = std::min(entry, near <= far ? near : geom::pos_inf);
+  }
+  return entry;
+}
+
+// geom::Intersect for every ray, hits shorten the rays
+template <size_t N, bool AnyHit>
+void intersect(RayPacket<N> &rays, const geom::Triangle &tri, uint32_t pos,
+               float (&distances)[N], uint32_t (&hits)[N]) {
+  glm::vec3 p0 = tri.getPoint(0);
+  glm::vec3 edge1 = tri.getPoint(1) - p0, edge2 = tri.getPoint(2) - p0;
+  for (size_t i = 0; i < N; ++i) {
+    glm::vec3 dir(rays.dir[0][i], rays.dir[1][i], rays.dir[2][i]);
+    glm::vec3 to_origin(rays.origin[0][i] - p0.x, rays.origin[1][i] - p0.y,
+                        rays.origin[2][i] - p0.z);
+    glm::vec3 p = glm::cross(dir, edge2);
+    float inv_det = 1.f / glm::dot(edge1, p);
+    float u = glm::dot(to_origin, p) * inv_det;
+    glm::vec3 q = glm::cross(to_origin, edge1);
+    float v = glm::dot(dir, q) * inv_det;
+    float t = glm::dot(edge2, q) * inv_det;
+    bool hit = u >= 0.f && v >= 0.f && u + v <= 1.f && t >= 0.f &&
+               t <= rays.max_distance[i];
+    distances[i] = hit ? t : distances[i];
+    hits[i] = hit ? pos : hits[i];
+    rays.max_distance[i] = hit ? (AnyHit ? -1.f : t) : rays.max_distance[i];
+  }
+}
+
+} // namespace
+
+static std::vector<geom::AABB> getBoxes(SceneView scene) {
+  std::vector<geom::AABB> boxes;
+  boxes.reserve(scene.size());
+  for (TriangleIdx i = 0; i < scene.size(); ++i)
+    boxes.emplace_back(scene[i]);
+  return boxes;
+}
+
+SpatialIndex::SpatialIndex(SceneView scene) : SpatialIndex(getBoxes(scene)) {
+  triangles_.reserve(scene.size());
+  for (auto tri : order_)
+    triangles_.push_back(scene[tri]);
+}
+
+SpatialIndex::SpatialIndex(std::vector<geom::AABB> boxes) {
+  Triangles tris(boxes.size());
+  for (TriangleIdx i = 0; i < boxes.size(); ++i)
+    tris[i] = i;
+  order_.resize(boxes.size());
+  if (!tris.empty())
+    build(boxes, std::move(tris), 0, false);
+  boxes_.reserve(boxes.size());
+  for (auto tri : order_)
+    boxes_.push_back(boxes[tri]);
+}
+
+uint32_t SpatialIndex::build(const std::vector<geom::AABB> &boxes,
+                             Triangles tris, uint32_t begin,
+                             bool straddling) {
+  auto idx = static_cast<uint32_t>(nodes_.size());
+  nodes_.emplace_back();
+  geom::AABB bounds;
+  for (auto tri : tris)
+    bounds.extend(boxes[tri]);
+
+  // Same separation as TreeNode, a triangle is in front of the plane if its
+  // bounding box is. Straddlers are split by their box centers.
+  Triangles own, children_tris[3];
+  if (tris.size() <= LeafSize)
+    own.swap(tris);
+  else {
+    auto axis = bounds.getLongestAxis();
+    auto axis_idx = static_cast<unsigned>(axis);
+    geom::AAPlane plane(
+        (bounds.getMin()[axis_idx] + bounds.getMax()[axis_idx]) * 0.5f, axis);
+    for (auto tri : tris) {
+      const auto &box = boxes[tri];
+      if (straddling) {
+        bool front = plane.isFront((box.getMin() + box.getMax()) * 0.5f);
+        children_tris[front ? 1 : 2].push_back(tri);
+      } else if (plane.isFront(box.getMin()))
+        children_tris[1].push_back(tri);
+      else if (plane.isBack(box.getMax()))
+        children_tris[2].push_back(tri);
+      else
+        children_tris[0].push_back(tri);
+    }
+    // Centers on one side cannot be split, few straddlers stay at the node
+    if (straddling &&
+        (children_tris[1].empty() || children_tris[2].empty())) {
+      own.swap(tris);
+      children_tris[1].clear();
+      children_tris[2].clear();
+    } else if (children_tris[0].size() <= LeafSize)
+      own.swap(children_tris[0]);
+  }
+
+  std::copy(own.begin(), own.end(), order_.begin() + begin);
+  auto end = begin + static_cast<uint32_t>(own.size());
+  uint32_t children[3] = {0, 0, 0};
+  for (int i = 0; i < 3; ++i)
+    if (!children_tris[i].empty()) {
+      // Straddlers of the parent may still straddle the planes of their
+      // subtree
+      children[i] = build(boxes, std::move(children_tris[i]), end,
+                          straddling || i == 0);
+      end = nodes_[children[i]].end;
+    }
+  // Children may have reallocated the nodes
+  auto &node = nodes_[idx];
+  node.bounds = bounds;
+  node.begin = begin;
+  node.split = begin + static_cast<uint32_t>(own.size());
+  node.end = end;
+  std::copy(children, children + 3, node.children);
+  return idx;
+}
+
+Triangles SpatialIndex::findOverlapping(const geom::AABB &box) const {
+  Triangles res;
+  forEachOverlap(box, [&res](TriangleIdx tri) { res.push_back(tri); });
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+Triangles SpatialIndex::findIntersecting(const geom::Triangle &tri) const {
+  assert(triangles_.size() == size());
+  // Triangles closer than epsilon intersect, as in isFront and isBack
+  geom::AABB box(tri);
+  box.expand(geom::epsilon);
+  Triangles res;
+  forEachOverlapPosition(box, [&](uint32_t pos) {
+    if (geom::Intersects(tri, triangles_[pos]))
+      res.push_back(order_[pos]);
+  });
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+Triangles SpatialIndex::findContaining(glm::vec3 point) const {
+  assert(triangles_.size() == size());
+  // Wider than the tolerance of Triangle::contains
+  geom::AABB box(point, point);
+  box.expand(16.f * geom::epsilon * (1.f + glm::length(point)));
+  Triangles res;
+  forEachOverlapPosition(box, [&](uint32_t pos) {
+    if (triangles_[pos].contains(point))
+      res.push_back(order_[pos]);
+  });
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+std::optional<SpatialIndex::Hit>
+SpatialIndex::castRay(const geom::Ray &ray) const {
+  return traceRays<1, false>({ray})[0];
+}
+
+bool SpatialIndex::hitsAny(const geom::Ray &ray) const {
+  return traceRays<1, true>({ray})[0].has_value();
+}
+
+template <size_t N>
+std::array<std::optional<SpatialIndex::Hit>, N>
+SpatialIndex::castRays(const std::array<geom::Ray, N> &rays) const {
+  static_assert(N == 4 || N == 8, "packets have 4 or 8 rays");
+  return traceRays<N, false>(rays);
+}
+
+template <size_t N>
+std::array<bool, N>
+SpatialIndex::hitAny(const std::array<geom::Ray, N> &rays) const {
+  static_assert(N == 4 || N == 8, "packets have 4 or 8 rays");
+  auto hits = traceRays<N, true>(rays);
+  std::array<bool, N> res;
+  for (size_t i = 0; i < N; ++i)
+    res[i] = hits[i].has_value();
+  return res;
+}
+
+template std::array<std::optional<SpatialIndex::Hit>, 4>
+SpatialIndex::castRays(const std::array<geom::Ray, 4> &rays) const;
+template std::array<std::optional<SpatialIndex::Hit>, 8>
+SpatialIndex::castRays(const std::array<geom::Ray, 8> &rays) const;
+template std::array<bool, 4>
+SpatialIndex::hitAny(const std::array<geom::Ray, 4> &rays) const;
+template std::array<bool, 8>
+SpatialIndex::hitAny(const std::array<geom::Ray, 8> &rays) const;
+
+template <size_t N, bool AnyHit>
+std::array<std::optional<SpatialIndex::Hit>, N>
+SpatialIndex::traceRays(const std::array<geom::Ray, N> &rays) const {
+  assert(triangles_.size() == size());
+  RayPacket<N> packet;
+  float distances[N];
+  uint32_t hits[N];
+  for (size_t i = 0; i < N; ++i) {
+    for (unsigned axis = 0; axis < 3; ++axis) {
+      float dir = rays[i].dir[axis];
+      packet.origin[axis][i] = rays[i].origin[axis];
+      packet.dir[axis][i] = dir;
+      // Finite, so that zero times it is not NaN
+      packet.inv_dir[axis][i] =
+          1.f / (dir != 0.f ? dir : std::numeric_limits<float>::min());
+    }
+    packet.max_distance[i] = rays[i].max_distance;
+    hits[i] = NoHit;
+  }
+
+  // Nodes with the entry distance of their nearest ray, nearer children
+  // are visited first
+  std::vector<std::pair<float, uint32_t>> stack;
+  stack.reserve(64);
+  if (!nodes_.empty()) {
+    float entry = enterBox(packet, nodes_[0].bounds);
+    if (entry < geom::pos_inf)
+      stack.emplace_back(entry, 0);
+  }
+  while (!stack.empty()) {
+    auto [entry, idx] = stack.back();
+    stack.pop_back();
+    // Rays may have hit nearer triangles since the node was pushed
+    float max_distance = packet.max_distance[0];
+    for (size_t i = 1; i < N; ++i)
+      max_distance = std::max(max_distance, packet.max_distance[i]);
+    if (entry > max_distance)
+      continue;
+    const auto &node = nodes_[idx];
+    for (auto pos = node.begin; pos < node.split; ++pos)
+      if (enterBox(packet, boxes_[pos]) < geom::pos_inf)
+        intersect<N, AnyHit>(packet, triangles_[pos], pos, distances, hits);
+    std::pair<float, uint32_t> children[3];
+    size_t num_children = 0;
+    for (auto child : node.children)
+      if (child) {
+        float child_entry = enterBox(packet, nodes_[child].bounds);
+        if (child_entry < geom::pos_inf)
+          children[num_children++] = {child_entry, child};
+      }
+    std::sort(children, children + num_children, std::greater<>());
+    stack.insert(stack.end(), children, children + num_children);
+  }
+
+  std::array<std::optional<Hit>, N> res;
+  for (size_t i = 0; i < N; ++i)
+    if (hits[i] != NoHit)
+      res[i] = Hit{order_[hits[i]], distances[i]};
+  return res;
+}
+
+std::vector<SpatialIndex::Range>
+SpatialIndex::findVisible(const geom::Frustum &frustum) const {
+  std::vector<Range> ranges;
+  auto add = [&ranges](uint32_t begin, uint32_t end) {
+    if (begin == end)
+      return;
+    if (!ranges.empty() && ranges.back().end == begin)
+      ranges.back().end = end;
+    else
+      ranges.push_back({begin, end});
+  };
+  if (nodes_.empty())
+    return ranges;
+  // Preorder traversal, which visits ranges in increasing order
+  std::vector<uint32_t> stack{0};
+  while (!stack.empty()) {
+    const auto &node = nodes_[stack.back()];
+    stack.pop_back();
+    auto overlap = frustum.classify(node.bounds);
+    if (overlap == geom::Frustum::Overlap::Outside)
+      continue;
+    if (overlap == geom::Frustum::Overlap::Inside) {
+      add(node.begin, node.end);
+      continue;
+    }
+    add(node.begin, node.split);
+    for (int i = 2; i >= 0; --i)
+      if (node.children[i])
+        stack.push_back(node.children[i]);
+  }
+  return ranges;
+}
+
+Pairs findIntersectingPairs(const SpatialIndex &index, SceneView scene,
+                            unsigned num_threads) {
+  if (!num_threads)
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  // Small sets are not worth a thread
+  num_threads = static_cast<unsigned>(
+      std::max<size_t>(std::min<size_t>(num_threads, scene.size() / 256), 1));
+  std::vector<Pairs> results(num_threads);
+  auto worker = [&](unsigned thread_idx) {
+    auto begin = scene.size() * thread_idx / num_threads;
+    auto end = scene.size() * (thread_idx + 1) / num_threads;
+    for (auto i = static_cast<TriangleIdx>(begin); i < end; ++i)
+      for (auto other : index.findIntersecting(scene[i]))
+        results[thread_idx].emplace_back(other, i);
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker, i);
+  worker(0);
+  for (auto &thread : threads)
+    thread.join();
+
+  for (size_t i = 1; i < results.size(); ++i)
+    results[0].insert(results[0].end(), results[i].begin(), results[i].end());
+  std::sort(results[0].begin(), results[0].end());
+  return std::move(results[0]);
+}
+
+Pairs findIntersectingPairs(SceneView scene1, SceneView scene2,
+                            unsigned num_threads) {
+  if (scene1.size() >= scene2.size())
+    return findIntersectingPairs(SpatialIndex(scene1), scene2, num_threads);
+  auto pairs = findIntersectingPairs(SpatialIndex(scene2), scene1, num_threads);
+  for (auto &[idx1, idx2] : pairs)
+    std::swap(idx1, idx2);
+  std::sort(pairs.begin(), pairs.end());
+  return pairs;
+}
+
+} // namespace scene
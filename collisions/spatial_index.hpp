@@ -0,0 +1,135 @@
+#ifndef COLLISIONS_SPATIAL_INDEX_HPP
+#define COLLISIONS_SPATIAL_INDEX_HPP
+
+#include "geometry.hpp"
+#include "scene.hpp"
+#include <array>
+#include <optional>
+#include <vector>
+
+namespace scene {
+
+// Hierarchy of the collision tree with bounding boxes, kept for queries: a
+// node is split by the plane of the collision tree and passes the triangles
+// on either side to its children. Triangles straddling the plane form a
+// third subtree split by their centers, so queries do not scan them one by
+// one and cost O(log n + k) for k results in well-spread scenes. Triangles
+// are reordered, so that every subtree covers a contiguous range of the
+// order. Queries are const and may run concurrently.
+class SpatialIndex {
+public:
+  // Nodes with at most this many triangles are not split
+  static constexpr size_t LeafSize = 16;
+  // Positions [begin, end) in getOrder()
+  struct Range {
+    uint32_t begin, end;
+  };
+  struct Hit {
+    TriangleIdx triangle;
+    // Along the ray, see geom::Ray
+    float distance;
+  };
+
+  SpatialIndex() = default;
+  // Keeps a copy of the triangles for the exact queries
+  explicit SpatialIndex(SceneView scene);
+  // Indexes arbitrary boxes, e.g. bounds of moving triangles over time
+  explicit SpatialIndex(std::vector<geom::AABB> boxes);
+  size_t size() const { return order_.size(); }
+  // Triangle indices of the scene in index order
+  const Triangles &getOrder() const { return order_; }
+  geom::AABB getBounds() const {
+    return nodes_.empty() ? geom::AABB{} : nodes_[0].bounds;
+  }
+  size_t getNumNodes() const { return nodes_.size(); }
+  // Sorted, non-adjacent ranges with every triangle whose bounding box
+  // overlaps the frustum, and possibly some near it
+  std::vector<Range> findVisible(const geom::Frustum &frustum) const;
+  // Calls fn with every triangle whose bounding box overlaps the box
+  template <typename Fn>
+  void forEachOverlap(const geom::AABB &box, Fn fn) const;
+  // Results are sorted triangle indices
+  Triangles findOverlapping(const geom::AABB &box) const;
+  // Only for indices built from a scene
+  Triangles findIntersecting(const geom::Triangle &tri) const;
+  Triangles findContaining(glm::vec3 point) const;
+  // Nearest triangle hit by the ray
+  std::optional<Hit> castRay(const geom::Ray &ray) const;
+  // Stops at the first hit found
+  bool hitsAny(const geom::Ray &ray) const;
+  // Coherent rays, e.g. through neighbouring pixels, traversed together:
+  // a node is visited once for all of them and per-ray arithmetic runs in
+  // loops over the rays, which compilers vectorize. N is 4 or 8.
+  template <size_t N>
+  std::array<std::optional<Hit>, N>
+  castRays(const std::array<geom::Ray, N> &rays) const;
+  template <size_t N>
+  std::array<bool, N> hitAny(const std::array<geom::Ray, N> &rays) const;
+
+private:
+  struct Node {
+    // Of all triangles in the subtree
+    geom::AABB bounds;
+    // Own triangles [begin, split), subtree [begin, end)
+    uint32_t begin, split, end;
+    // Straddling, front and back subtrees, zero if missing, as the root is
+    // nobody's child
+    uint32_t children[3] = {0, 0, 0};
+  };
+  std::vector<Node> nodes_;
+  Triangles order_;
+  // Bounding boxes and triangles in index order
+  std::vector<geom::AABB> boxes_;
+  Scene triangles_;
+
+  // Adds the subtree with triangles placed from begin, returns its node.
+  // Straddling triangles are split by their centers only.
+  uint32_t build(const std::vector<geom::AABB> &boxes, Triangles tris,
+                 uint32_t begin, bool straddling);
+  // Nearest or any hits of rays, a single ray is a packet of one
+  template <size_t N, bool AnyHit>
+  std::array<std::optional<Hit>, N>
+  traceRays(const std::array<geom::Ray, N> &rays) const;
+  // Calls fn with positions in index order
+  template <typename Fn>
+  void forEachOverlapPosition(const geom::AABB &box, Fn fn) const;
+};
+
+template <typename Fn>
+void SpatialIndex::forEachOverlapPosition(const geom::AABB &box,
+                                          Fn fn) const {
+  if (nodes_.empty())
+    return;
+  std::vector<uint32_t> stack{0};
+  while (!stack.empty()) {
+    const auto &node = nodes_[stack.back()];
+    stack.pop_back();
+    if (!node.bounds.intersects(box))
+      continue;
+    for (auto i = node.begin; i < node.split; ++i)
+      if (boxes_[i].intersects(box))
+        fn(i);
+    for (auto child : node.children)
+      if (child)
+        stack.push_back(child);
+  }
+}
+
+template <typename Fn>
+void SpatialIndex::forEachOverlap(const geom::AABB &box, Fn fn) const {
+  forEachOverlapPosition(box, [&](uint32_t pos) { fn(order_[pos]); });
+}
+
+// Intersecting pairs of a triangle of the indexed scene and a triangle of
+// the other scene, as (indexed, other) and sorted. Pairs within either scene
+// are not tested, and the index of a static scene can be kept for queries
+// of moving triangles. num_threads == 0 means all hardware threads.
+Pairs findIntersectingPairs(const SpatialIndex &index, SceneView scene,
+                            unsigned num_threads = 1);
+// Indexes the larger scene, pairs are (first scene, second scene)
+Pairs findIntersectingPairs(SceneView scene1, SceneView scene2,
+                            unsigned num_threads = 1);
+
+} // namespace scene
+
+#endif
@@ -1,8 +1,19 @@
+#include "generator.hpp"
 #include "geometry.hpp"
+#include "mesh_file.hpp"
+#include "mutable_scene.hpp"
+#include "out_of_core.hpp"
+#include "progressive.hpp"
 #include "scene.hpp"
-#include <glm/gtc/random.hpp>
+#include "scene_file.hpp"
+#include "spatial_index.hpp"
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <glm/gtc/matrix_transform.hpp>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <sstream>
 
 TEST(Geometry, Triangles) {
   geom::Triangle tri{glm::vec3{5.f, 6.f, 7.f}, glm::vec3{6.f, 5.f, 4.f},
@@ -24,82 +35,45 @@ TEST(Geometry, Triangles) {
     EXPECT_TRUE(geom::Intersects(tri, other_tri) == answer);
 }
 
-static std::pair<glm::vec3, glm::vec3> getBasis(glm::vec3 n) {
-  glm::vec3 t;
-  if (std::abs(n.x) < std::abs(n.y)) {
-    if (std::abs(n.x) < std::abs(n.z))
-      t = glm::vec3{1.f, 0.f, 0.f};
-    else
-      t = glm::vec3{0.f, 0.f, 1.f};
-  } else {
-    if (std::abs(n.y) < std::abs(n.z))
-      t = glm::vec3{0.f, 1.f, 0.f};
-    else
-      t = glm::vec3{0.f, 0.f, 1.f};
-  }
-  glm::vec3 u = glm::normalize(glm::cross(n, t)), v = glm::cross(n, u);
-  return {u, v};
-}
-
-static geom::Triangle generateRandomTri(glm::vec3 center, glm::vec3 normal) {
-  constexpr float pi = glm::pi<float>();
-  float angle1 = glm::linearRand(0.f, 2 * pi);
-  float angle2 = glm::linearRand(0.f, pi);
-  float angle3 = glm::linearRand(-pi, -pi + angle2);
-  auto generateVertex = [](float angle) {
-    float radius = glm::linearRand(0.0f, 1.0f);
-    return glm::vec2{radius * std::cos(angle), radius * std::sin(angle)};
-  };
-  std::array<glm::vec2, 3> vertices = {generateVertex(angle1),
-                                       generateVertex(angle1 + angle2),
-                                       generateVertex(angle1 + angle3)};
-  auto [u, v] = getBasis(normal);
-  return geom::Triangle{center + u * vertices[0].x + v * vertices[0].y,
-                        center + u * vertices[1].x + v * vertices[1].y,
-                        center + u * vertices[2].x + v * vertices[2].y};
-}
-
 TEST(Geometry, IntersectingNonComplanarTriangles) {
   constexpr unsigned N = 100;
+  scene::Random random(1);
   for (unsigned i = 0; i < N; ++i) {
-    glm::vec3 common_point = glm::linearRand(glm::vec3(-10.f, -10.f, -10.f),
-                                             glm::vec3(10.f, 10.f, 10.f));
-    glm::vec3 normal1 = glm::sphericalRand(1.f),
-              normal2 = glm::sphericalRand(1.f);
-    auto tri1 = generateRandomTri(common_point, normal1),
-         tri2 = generateRandomTri(common_point, normal2);
+    glm::vec3 common_point = random.point(10.f);
+    glm::vec3 normal1 = random.direction(), normal2 = random.direction();
+    auto tri1 = scene::generateRandomTri(random, common_point, normal1),
+         tri2 = scene::generateRandomTri(random, common_point, normal2);
     EXPECT_TRUE(geom::Intersects(tri1, tri2));
   }
 }
 
 TEST(Geometry, IntersectingComplanarTriangles) {
   constexpr unsigned N = 100;
+  scene::Random random(2);
   for (unsigned i = 0; i < N; ++i) {
-    glm::vec3 common_point = glm::linearRand(glm::vec3(-10.f, -10.f, -10.f),
-                                             glm::vec3(10.f, 10.f, 10.f));
+    glm::vec3 common_point = random.point(10.f);
     glm::vec3 normal{1.f, 0.f, 0.f};
-    auto tri1 = generateRandomTri(common_point, normal),
-         tri2 = generateRandomTri(common_point, normal);
+    auto tri1 = scene::generateRandomTri(random, common_point, normal),
+         tri2 = scene::generateRandomTri(random, common_point, normal);
     EXPECT_TRUE(geom::Intersects(tri1, tri2));
   }
 }
 
 TEST(Geometry, NonIntersectingTriangles) {
   constexpr unsigned N = 100;
+  scene::Random random(3);
   for (unsigned i = 0; i < N; ++i) {
-    glm::vec3 n = glm::sphericalRand(1.f);
-    auto [u, v] = getBasis(n);
-    auto generatePosVertex = [n, u, v]() {
-      return n * glm::linearRand(0.001f, 10.f) +
-             u * glm::linearRand(-10.f, 10.f) +
-             v * glm::linearRand(-10.f, 10.f);
+    glm::vec3 n = random.direction();
+    auto [u, v] = scene::getBasis(n);
+    auto generatePosVertex = [&random, n, u = u, v = v]() {
+      return n * random.uniform(0.001f, 10.f) +
+             u * random.uniform(-10.f, 10.f) + v * random.uniform(-10.f, 10.f);
     };
     geom::Triangle tri1{generatePosVertex(), generatePosVertex(),
                         generatePosVertex()};
-    auto generateNegVertex = [n, u, v]() {
-      return n * glm::linearRand(-0.001f, -10.f) +
-             u * glm::linearRand(-10.f, 10.f) +
-             v * glm::linearRand(-10.f, 10.f);
+    auto generateNegVertex = [&random, n, u = u, v = v]() {
+      return n * random.uniform(-10.f, -0.001f) +
+             u * random.uniform(-10.f, 10.f) + v * random.uniform(-10.f, 10.f);
     };
     geom::Triangle tri2{generateNegVertex(), generateNegVertex(),
                         generateNegVertex()};
@@ -108,15 +82,8 @@ TEST(Geometry, NonIntersectingTriangles) {
 }
 
 TEST(Scene, RandomScene) {
-  constexpr unsigned N = 10000;
-  scene::Scene triangles;
-  for (unsigned i = 0; i < N; ++i) {
-    glm::vec3 center = glm::linearRand(glm::vec3(-10.f, -10.f, -10.f),
-                                       glm::vec3(10.f, 10.f, 10.f));
-    triangles.emplace_back(center + glm::ballRand(1.f),
-                           center + glm::ballRand(1.f),
-                           center + glm::ballRand(1.f));
-  }
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Uniform, 10000, 1).generate();
   scene::Collisions res1;
   for (scene::TriangleIdx i = 0; i < triangles.size(); ++i)
     for (scene::TriangleIdx j = i + 1; j < triangles.size(); ++j)
@@ -125,3 +92,659 @@ TEST(Scene, RandomScene) {
   auto res2 = scene::findIntersectingTriangles(triangles);
   EXPECT_TRUE(res1 == res2);
 }
+
+static bool isSameTriangle(const geom::Triangle &tri1,
+                           const geom::Triangle &tri2) {
+  return tri1.getPoint(0) == tri2.getPoint(0) &&
+         tri1.getPoint(1) == tri2.getPoint(1) &&
+         tri1.getPoint(2) == tri2.getPoint(2);
+}
+
+// Parallel triangles closer than epsilon, which intersect while their
+// bounding boxes do not
+static scene::Scene getNearTouchingPair() {
+  auto gap = geom::epsilon * 0.5f;
+  return {geom::Triangle{glm::vec3{0.f, 0.f, 0.f}, glm::vec3{1.f, 0.f, 0.f},
+                         glm::vec3{0.f, 1.f, 0.f}},
+          geom::Triangle{glm::vec3{0.f, 0.f, gap}, glm::vec3{1.f, 0.f, gap},
+                         glm::vec3{0.f, 1.f, gap}}};
+}
+
+TEST(SceneFile, StaticRoundTrip) {
+  std::istringstream text("3\n"
+                          "0 0 0 1 0 0 0 1 0\n"
+                          "0 0 -1 0 0 1 1 1 0\n"
+                          "5 5 5 6 5 5 5 6 5\n");
+  auto triangles = scene::readTextScene(text);
+  ASSERT_EQ(triangles.size(), 3u);
+  auto path = testing::TempDir() + "static_scene.bin";
+  {
+    std::ofstream os(path, std::ios::binary);
+    scene::writeBinaryScene(os, triangles);
+  }
+  scene::MappedScene mapped(path);
+  EXPECT_FALSE(mapped.isDynamic());
+  auto view = mapped.getScene();
+  ASSERT_EQ(view.size(), triangles.size());
+  for (scene::TriangleIdx i = 0; i < view.size(); ++i)
+    EXPECT_TRUE(isSameTriangle(view[i], triangles[i]));
+  EXPECT_TRUE(scene::findIntersectingTriangles(view) ==
+              scene::findIntersectingTriangles(triangles));
+}
+
+TEST(SceneFile, DynamicRoundTrip) {
+  std::istringstream text("2 10\n"
+                          "0 0 0 1 0 0 0 1 0 0 0 0 0 0 1 90\n"
+                          "0 0 -1 0 0 1 1 1 0 1 1 1 2 2 2 -45\n");
+  float max_time;
+  auto triangles = scene::readTextDynamicScene(text, max_time);
+  auto path = testing::TempDir() + "dynamic_scene.bin";
+  {
+    std::ofstream os(path, std::ios::binary);
+    scene::writeBinaryScene(os, triangles, max_time);
+  }
+  scene::MappedScene mapped(path);
+  ASSERT_TRUE(mapped.isDynamic());
+  EXPECT_EQ(mapped.getMaxTime(), max_time);
+  auto loaded = mapped.getDynamicScene();
+  ASSERT_EQ(loaded.size(), triangles.size());
+  for (scene::TriangleIdx i = 0; i < loaded.size(); ++i)
+    EXPECT_TRUE(isSameTriangle(loaded[i].get(3.f), triangles[i].get(3.f)));
+}
+
+TEST(SceneFile, InvalidFile) {
+  auto path = testing::TempDir() + "invalid_scene.bin";
+  {
+    std::ofstream os(path, std::ios::binary);
+    os << "3 0 0 0 1 0 0 0 1 0";
+  }
+  EXPECT_THROW(scene::MappedScene{path}, std::runtime_error);
+
+  // Text scenes with a bad count or fewer triangles than counted
+  for (const char *text : {"x\n0 0 0 1 0 0 0 1 0\n", "2\n0 0 0 1 0 0 0 1 0\n",
+                           "1\n0 0 0 1 0 0 0 1\n"}) {
+    std::istringstream is(text);
+    EXPECT_THROW(scene::readTextScene(is), std::runtime_error) << text;
+  }
+  std::istringstream dynamic("1 10\n0 0 0 1 0 0 0 1 0 0 0 0 0 0 1\n");
+  float max_time;
+  EXPECT_THROW(scene::readTextDynamicScene(dynamic, max_time),
+               std::runtime_error);
+}
+
+TEST(Generator, Reproducible) {
+  scene::SceneGenerator generator(scene::Distribution::Clusters, 5000, 42);
+  auto triangles = generator.generate();
+  // Any split between threads and pieces gives the same scene
+  auto parallel = generator.generate(4);
+  auto piece = generator.generate(1000, 3000, 3);
+  ASSERT_EQ(parallel.size(), triangles.size());
+  ASSERT_EQ(piece.size(), 2000u);
+  for (size_t i = 0; i < triangles.size(); ++i)
+    EXPECT_TRUE(isSameTriangle(parallel[i], triangles[i]));
+  for (size_t i = 0; i < piece.size(); ++i)
+    EXPECT_TRUE(isSameTriangle(piece[i], triangles[i + 1000]));
+  auto other = scene::SceneGenerator(scene::Distribution::Clusters, 5000, 43)
+                   .generate();
+  EXPECT_FALSE(isSameTriangle(other[0], triangles[0]));
+}
+
+TEST(Generator, IntersectingPairs) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Pairs, 2000, 7).generate();
+  for (size_t i = 0; i + 1 < triangles.size(); i += 2)
+    EXPECT_TRUE(geom::Intersects(triangles[i], triangles[i + 1]));
+}
+
+TEST(Generator, WrittenInPieces) {
+  scene::SceneGenerator generator(scene::Distribution::Slivers, 300, 5);
+  auto triangles = generator.generateDynamic();
+  auto path = testing::TempDir() + "generated_scene.bin";
+  {
+    scene::BinarySceneWriter writer(path, triangles.size(), true, 5.f);
+    writer.write(200, generator.generateDynamic(200, 300));
+    writer.write(0, generator.generateDynamic(0, 200));
+    writer.close();
+  }
+  auto loaded = scene::MappedScene(path).getDynamicScene();
+  std::stringstream text;
+  scene::writeTextSceneHeader(text, triangles.size(), 5.f);
+  scene::writeTextTriangles(text, triangles);
+  float max_time;
+  auto parsed = scene::readTextDynamicScene(text, max_time);
+  EXPECT_EQ(max_time, 5.f);
+  ASSERT_EQ(loaded.size(), triangles.size());
+  ASSERT_EQ(parsed.size(), triangles.size());
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    EXPECT_TRUE(isSameTriangle(loaded[i].get(1.f), triangles[i].get(1.f)));
+    EXPECT_TRUE(isSameTriangle(parsed[i].getTriangle(),
+                               triangles[i].getTriangle()));
+  }
+}
+
+TEST(Scene, ParallelEngines) {
+  // Same extent as in the random scene, but sparser
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Uniform, 3000, 2, 0.375f)
+          .generate();
+  auto pairs = scene::findIntersectingPairsBruteForce(triangles);
+  EXPECT_TRUE(scene::findIntersectingPairs(triangles) == pairs);
+  EXPECT_TRUE(scene::findIntersectingPairs(triangles, 4) == pairs);
+  EXPECT_TRUE(scene::findIntersectingPairsBruteForce(triangles, 4) == pairs);
+  scene::Collisions collisions;
+  for (auto [idx1, idx2] : pairs)
+    collisions.insert({idx1, idx2});
+  EXPECT_TRUE(scene::findIntersectingTriangles(triangles, 4) == collisions);
+  EXPECT_TRUE(scene::findIntersectingTrianglesBruteForce(triangles, 4) ==
+              collisions);
+}
+
+TEST(Scene, Stats) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Clusters, 3000, 4).generate();
+  scene::Stats stats;
+  auto pairs = scene::findIntersectingPairs(triangles, 2, &stats);
+  EXPECT_TRUE(pairs == scene::findIntersectingPairs(triangles));
+  EXPECT_EQ(stats.hits, pairs.size());
+  EXPECT_EQ(stats.skipped_pairs, 0u);
+  EXPECT_EQ(stats.candidate_pairs, stats.rejected_pairs + stats.hits);
+  EXPECT_GT(stats.num_nodes, 1u);
+  uint64_t num_nodes = 0;
+  for (auto count : stats.leaf_sizes)
+    num_nodes += count;
+  for (auto count : stats.straddler_sizes)
+    num_nodes += count;
+  EXPECT_EQ(num_nodes, stats.num_nodes);
+  EXPECT_GE(stats.peak_memory, stats.tree_memory);
+
+  // Collisions skip pairs of already colliding triangles
+  auto collisions = scene::findIntersectingTriangles(triangles, 2, &stats);
+  EXPECT_TRUE(collisions == scene::findIntersectingTriangles(triangles));
+  EXPECT_EQ(stats.candidate_pairs,
+            stats.skipped_pairs + stats.rejected_pairs + stats.hits);
+  EXPECT_LE(stats.hits, pairs.size());
+}
+
+static bool isNearTriangle(const geom::Triangle &tri1,
+                           const geom::Triangle &tri2) {
+  for (unsigned i = 0; i < 3; ++i)
+    if (glm::length(tri1.getPoint(i) - tri2.getPoint(i)) > 1e-4f)
+      return false;
+  return true;
+}
+
+TEST(Scene, DynamicUpdate) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Uniform, 40000, 6)
+          .generateDynamic();
+  // Axis direction read from text is not normalized
+  triangles[0] = scene::DynamicTriangle(
+      triangles[0].getTriangle(),
+      geom::Line(glm::vec3{1.f, 2.f, 3.f}, glm::vec3{0.f, 3.f, 4.f}), 30.f);
+  scene::PackedDynamicScene packed(triangles);
+  scene::Scene updated, packed_updated(5), parallel_updated;
+  for (float time : {0.f, 1.5f, 7.f}) {
+    scene::updateDynamicScene(triangles, time, updated);
+    packed.update(time, packed_updated);
+    packed.update(time, parallel_updated, 4);
+    ASSERT_EQ(updated.size(), triangles.size());
+    ASSERT_EQ(packed_updated.size(), triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+      float angle = glm::radians(std::fmod(triangles[i].getSpeed() * time,
+                                           360.f));
+      const auto &axis = triangles[i].getAxis();
+      const auto &tri = triangles[i].getTriangle();
+      geom::Triangle expected(axis.rotatePoint(tri.getPoint(0), angle),
+                              axis.rotatePoint(tri.getPoint(1), angle),
+                              axis.rotatePoint(tri.getPoint(2), angle));
+      EXPECT_TRUE(isNearTriangle(updated[i], expected));
+      EXPECT_TRUE(isNearTriangle(packed_updated[i], expected));
+      EXPECT_TRUE(isSameTriangle(parallel_updated[i], packed_updated[i]));
+    }
+  }
+}
+
+TEST(Scene, OutOfCore) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Uniform, 20000, 3, 0.3125f)
+          .generate();
+  scene::OutOfCoreOptions options;
+  options.memory_budget = 64 * 1024;
+  options.temp_dir = testing::TempDir();
+  EXPECT_TRUE(scene::findIntersectingTrianglesOutOfCore(triangles, options) ==
+              scene::findIntersectingTriangles(triangles));
+
+  // Cluster that splitting does not shrink below the budget
+  scene::Scene cluster(triangles.begin(), triangles.begin() + 2000);
+  for (auto &tri : cluster) {
+    auto center = tri.getPoint(0);
+    tri = geom::Triangle{center * 0.01f, tri.getPoint(1) - center * 0.99f,
+                         tri.getPoint(2) - center * 0.99f};
+  }
+  EXPECT_TRUE(scene::findIntersectingTrianglesOutOfCore(cluster, options) ==
+              scene::findIntersectingTriangles(cluster));
+
+  // Pair closer than epsilon, tested in blocks of one triangle
+  auto near = getNearTouchingPair();
+  options.memory_budget = 128;
+  EXPECT_EQ(scene::findIntersectingTrianglesOutOfCore(near, options).size(),
+            2u);
+}
+
+static scene::Scene expandIndexedScene(const scene::IndexedScene &mesh) {
+  scene::SceneView view(mesh);
+  scene::Scene res;
+  for (scene::TriangleIdx i = 0; i < view.size(); ++i)
+    res.push_back(view[i]);
+  return res;
+}
+
+TEST(MeshFile, OBJ) {
+  // Unit square split into two triangles and a quad crossing it
+  std::istringstream obj("# test mesh\n"
+                         "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+                         "f 1 2 3\nf 1/1 3/3 4/4\n"
+                         "v 0.5 0.5 -1\nv 0.5 0.5 1\nv 0.6 0.6 1\n"
+                         "v 0.6 0.6 -1\n"
+                         "f -4//1 -3//1 -2//1 -1//1\n");
+  auto mesh = scene::readOBJ(obj);
+  ASSERT_EQ(mesh.vertices.size(), 8u);
+  ASSERT_EQ(mesh.triangles.size(), 4u);
+  EXPECT_TRUE(mesh.triangles[1] == (scene::IndexTriple{0, 2, 3}));
+  auto collisions = scene::findIntersectingTriangles(mesh);
+  EXPECT_TRUE(collisions ==
+              scene::findIntersectingTriangles(expandIndexedScene(mesh)));
+  EXPECT_TRUE(collisions.count(2) || collisions.count(3));
+}
+
+TEST(MeshFile, STL) {
+  std::stringstream stl(std::ios::in | std::ios::out | std::ios::binary);
+  stl << std::string(80, ' ');
+  uint32_t num_triangles = 2;
+  stl.write(reinterpret_cast<const char *>(&num_triangles), sizeof(uint32_t));
+  float facets[2][12] = {{0, 0, 1, 0, 0, 0, 1, 0, 0, 1, 1, 0},
+                         {0, 0, 1, 0, 0, 0, 1, 1, 0, 0, 1, 0}};
+  for (const auto &facet : facets) {
+    stl.write(reinterpret_cast<const char *>(facet), sizeof(facet));
+    stl.write("\0\0", 2);
+  }
+  auto mesh = scene::readSTL(stl);
+  EXPECT_EQ(mesh.vertices.size(), 4u);
+  ASSERT_EQ(mesh.triangles.size(), 2u);
+  EXPECT_EQ(mesh.triangles[0][0], mesh.triangles[1][0]);
+  EXPECT_EQ(mesh.triangles[0][2], mesh.triangles[1][1]);
+
+  // Truncated file claiming a billion triangles
+  std::stringstream truncated(std::ios::in | std::ios::out | std::ios::binary);
+  truncated << std::string(80, ' ');
+  num_triangles = 1000000000;
+  truncated.write(reinterpret_cast<const char *>(&num_triangles),
+                  sizeof(uint32_t));
+  EXPECT_THROW(scene::readSTL(truncated), std::runtime_error);
+}
+
+TEST(MeshFile, PLY) {
+  std::istringstream ply("ply\n"
+                         "format ascii 1.0\n"
+                         "element vertex 4\n"
+                         "property float x\nproperty float y\n"
+                         "property float z\nproperty uchar red\n"
+                         "element face 1\n"
+                         "property list uchar int vertex_indices\n"
+                         "end_header\n"
+                         "0 0 0 255\n1 0 0 255\n1 1 0 255\n0 1 0 255\n"
+                         "4 0 1 2 3\n");
+  auto mesh = scene::readPLY(ply);
+  EXPECT_EQ(mesh.vertices.size(), 4u);
+  ASSERT_EQ(mesh.triangles.size(), 2u);
+  EXPECT_TRUE(mesh.triangles[1] == (scene::IndexTriple{0, 2, 3}));
+
+  // Truncated file claiming billions of vertices
+  std::istringstream truncated("ply\n"
+                               "format binary_little_endian 1.0\n"
+                               "element vertex 4000000000\n"
+                               "property float x\nproperty float y\n"
+                               "property float z\n"
+                               "end_header\n");
+  EXPECT_THROW(scene::readPLY(truncated), std::runtime_error);
+}
+
+TEST(SpatialIndex, FrustumCulling) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Clusters, 20000, 3)
+          .generate();
+  scene::SpatialIndex index(triangles);
+  ASSERT_EQ(index.size(), triangles.size());
+  auto order = index.getOrder();
+  std::sort(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); ++i)
+    ASSERT_EQ(order[i], i);
+
+  // Narrow view into the middle of the scene
+  auto center = (index.getBounds().getMin() + index.getBounds().getMax()) *
+                0.5f;
+  auto proj = glm::perspective(glm::radians(20.f), 1.f, 0.1f, 100.f);
+  auto view_proj =
+      proj * glm::lookAt(center + glm::vec3(0.f, 0.f, 10.f), center,
+                         glm::vec3(0.f, 1.f, 0.f));
+  geom::Frustum frustum(view_proj);
+  auto ranges = index.findVisible(frustum);
+  std::vector<bool> visible(triangles.size());
+  size_t num_visible = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    ASSERT_LT(ranges[i].begin, ranges[i].end);
+    if (i) {
+      ASSERT_LT(ranges[i - 1].end, ranges[i].begin);
+    }
+    for (auto j = ranges[i].begin; j < ranges[i].end; ++j)
+      visible[index.getOrder()[j]] = true;
+    num_visible += ranges[i].end - ranges[i].begin;
+  }
+  for (size_t i = 0; i < triangles.size(); ++i)
+    EXPECT_TRUE(visible[i] || frustum.classify(geom::AABB(triangles[i])) ==
+                                  geom::Frustum::Overlap::Outside)
+        << i;
+  EXPECT_GT(num_visible, 0u);
+  EXPECT_LT(num_visible, triangles.size() / 2);
+
+  // Looking away from the scene
+  auto away = proj * glm::lookAt(center + glm::vec3(0.f, 0.f, 1000.f),
+                                 center + glm::vec3(0.f, 0.f, 2000.f),
+                                 glm::vec3(0.f, 1.f, 0.f));
+  EXPECT_TRUE(index.findVisible(geom::Frustum(away)).empty());
+}
+
+TEST(Scene, ProgressiveDetection) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Clusters, 5000, 8)
+          .generateDynamic();
+  for (const auto &tri : triangles) {
+    auto bounds = tri.getSweptBounds();
+    for (float time : {0.f, 0.7f, 3.f}) {
+      geom::AABB box(tri.get(time));
+      ASSERT_TRUE(bounds.contains(box.getMin()));
+      ASSERT_TRUE(bounds.contains(box.getMax()));
+    }
+  }
+
+  // Everything visible and enough time refreshes every triangle
+  glm::mat4 everything(1e-4f);
+  everything[3] = glm::vec4(0.f, 0.f, 0.5f, 1.f);
+  scene::ProgressiveDetector detector(triangles);
+  EXPECT_EQ(detector.update(2.f, geom::Frustum(everything),
+                            scene::ProgressiveDetector::Budget::max()),
+            triangles.size());
+  auto expected = scene::findIntersectingTriangles(
+      scene::updateDynamicScene(triangles, 2.f));
+  EXPECT_TRUE(detector.getCollisions() == expected);
+
+  // Nothing visible and no time still refreshes a batch per update, all of
+  // them round robin
+  glm::mat4 away = glm::perspective(glm::radians(20.f), 1.f, 0.1f, 100.f) *
+                   glm::lookAt(glm::vec3(0.f, 0.f, 1000.f),
+                               glm::vec3(0.f, 0.f, 2000.f),
+                               glm::vec3(0.f, 1.f, 0.f));
+  expected = scene::findIntersectingTriangles(
+      scene::updateDynamicScene(triangles, 5.f));
+  auto batch_size = scene::ProgressiveDetector::BatchSize;
+  for (size_t i = 0; i < triangles.size(); i += batch_size) {
+    auto refreshed = detector.update(5.f, geom::Frustum(away),
+                                     scene::ProgressiveDetector::Budget(0));
+    ASSERT_GE(refreshed, batch_size);
+    ASSERT_LE(refreshed, 2 * batch_size);
+  }
+  EXPECT_TRUE(detector.getCollisions() == expected);
+
+  // Still pair closer than epsilon
+  scene::DynamicScene near;
+  for (const auto &tri : getNearTouchingPair())
+    near.emplace_back(tri, geom::Line(glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f)),
+                      0.f);
+  scene::ProgressiveDetector near_detector(near);
+  near_detector.update(0.f, geom::Frustum(everything),
+                       scene::ProgressiveDetector::Budget::max());
+  EXPECT_EQ(near_detector.getCollisions().size(), 2u);
+}
+
+TEST(SpatialIndex, Queries) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Clusters, 20000, 4)
+          .generate();
+  auto queries =
+      scene::SceneGenerator(scene::Distribution::Clusters, 500, 5)
+          .generate();
+  scene::SpatialIndex index(triangles);
+  auto findLinear = [&](auto predicate) {
+    scene::Triangles res;
+    for (scene::TriangleIdx i = 0; i < triangles.size(); ++i)
+      if (predicate(triangles[i]))
+        res.push_back(i);
+    return res;
+  };
+
+  size_t num_hits = 0;
+  for (const auto &query : queries) {
+    geom::AABB box(query);
+    box.expand(0.5f);
+    EXPECT_EQ(index.findOverlapping(box), findLinear([&](const auto &tri) {
+                return box.intersects(geom::AABB(tri));
+              }));
+    auto hits = index.findIntersecting(query);
+    EXPECT_EQ(hits, findLinear([&](const auto &tri) {
+                return geom::Intersects(query, tri);
+              }));
+    num_hits += hits.size();
+  }
+  EXPECT_GT(num_hits, 0u);
+  auto near = getNearTouchingPair();
+  ASSERT_TRUE(geom::Intersects(near[0], near[1]));
+  EXPECT_EQ(scene::SpatialIndex(scene::SceneView(near.data(), 1))
+                .findIntersecting(near[1]),
+            scene::Triangles{0});
+
+  for (scene::TriangleIdx i = 0; i < triangles.size(); i += 97) {
+    const auto &tri = triangles[i];
+    auto center = (tri.getPoint(0) + tri.getPoint(1) + tri.getPoint(2)) / 3.f;
+    for (auto point : {center, tri.getPoint(1)}) {
+      auto containing = index.findContaining(point);
+      EXPECT_TRUE(std::binary_search(containing.begin(), containing.end(), i));
+      EXPECT_EQ(containing, findLinear([&](const auto &other) {
+                  return other.contains(point);
+                }));
+    }
+  }
+
+  // Concurrent queries on the shared index
+  std::vector<std::future<size_t>> threads;
+  for (size_t thread = 0; thread < 4; ++thread)
+    threads.push_back(std::async(std::launch::async, [&]() {
+      size_t num_thread_hits = 0;
+      for (const auto &query : queries)
+        num_thread_hits += index.findIntersecting(query).size();
+      return num_thread_hits;
+    }));
+  for (auto &thread : threads)
+    EXPECT_EQ(thread.get(), num_hits);
+}
+
+TEST(SpatialIndex, RayCasting) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Clusters, 20000, 6)
+          .generate();
+  scene::SpatialIndex index(triangles);
+  geom::AABB bounds;
+  for (const auto &tri : triangles)
+    bounds.extend(geom::AABB(tri));
+  auto castLinear = [&](const geom::Ray &ray) {
+    std::optional<scene::SpatialIndex::Hit> res;
+    for (scene::TriangleIdx i = 0; i < triangles.size(); ++i)
+      if (auto distance = geom::Intersect(ray, triangles[i]))
+        if (!res || *distance < res->distance)
+          res = scene::SpatialIndex::Hit{i, *distance};
+    return res;
+  };
+
+  // Packets of nearby rays from outside the scene towards its inside
+  scene::Random random(7);
+  auto size = bounds.getSize();
+  size_t num_hits = 0;
+  for (size_t packet = 0; packet < 40; ++packet) {
+    glm::vec3 origin = bounds.getMin() - size * 0.5f;
+    // Drawn one by one, argument evaluation order is unspecified
+    glm::vec3 cell;
+    for (unsigned axis = 0; axis < 3; ++axis)
+      cell[axis] = random.uniform(0.f, 1.f);
+    glm::vec3 target = bounds.getMin() + size * cell;
+    std::array<geom::Ray, 8> rays;
+    for (size_t i = 0; i < rays.size(); ++i) {
+      auto offset = glm::vec3(i % 2, i / 2 % 2, i / 4) * size * 0.01f;
+      rays[i] = geom::Ray{origin, target + offset - origin};
+      // Some rays end inside the scene
+      if (i % 3 == 2)
+        rays[i].max_distance = 1.2f;
+    }
+    auto packet8 = index.castRays(rays);
+    auto any8 = index.hitAny(rays);
+    auto packet4 = index.castRays(std::array<geom::Ray, 4>{
+        rays[0], rays[1], rays[2], rays[3]});
+    for (size_t i = 0; i < rays.size(); ++i) {
+      auto expected = castLinear(rays[i]);
+      auto hit = index.castRay(rays[i]);
+      ASSERT_EQ(hit.has_value(), expected.has_value());
+      EXPECT_EQ(index.hitsAny(rays[i]), expected.has_value());
+      EXPECT_EQ(any8[i], expected.has_value());
+      if (!expected)
+        continue;
+      ++num_hits;
+      // Triangles hit at the same distance may be reported in any order
+      EXPECT_FLOAT_EQ(hit->distance, expected->distance);
+      EXPECT_EQ(geom::Intersect(rays[i], triangles[hit->triangle]),
+                hit->distance);
+      ASSERT_TRUE(packet8[i]);
+      EXPECT_EQ(packet8[i]->distance, hit->distance);
+      if (i < 4) {
+        ASSERT_TRUE(packet4[i]);
+        EXPECT_EQ(packet4[i]->distance, hit->distance);
+      }
+    }
+  }
+  EXPECT_GT(num_hits, 0u);
+}
+
+TEST(Scene, MutableScene) {
+  auto triangles =
+      scene::SceneGenerator(scene::Distribution::Clusters, 3000, 8)
+          .generate();
+  scene::MutableScene mutable_scene(triangles);
+  // Checks against a full recompute of the triangles left
+  auto check = [&]() {
+    scene::Scene left;
+    scene::Triangles indices;
+    for (scene::TriangleIdx i = 0; i < mutable_scene.getNumSlots(); ++i)
+      if (mutable_scene.contains(i)) {
+        left.push_back(mutable_scene[i]);
+        indices.push_back(i);
+      }
+    ASSERT_EQ(mutable_scene.size(), left.size());
+    std::vector<uint32_t> counts(left.size());
+    for (auto [idx1, idx2] : scene::findIntersectingPairs(left)) {
+      ++counts[idx1];
+      ++counts[idx2];
+    }
+    scene::Collisions expected;
+    for (scene::TriangleIdx i = 0; i < left.size(); ++i) {
+      EXPECT_EQ(mutable_scene.getNumCollisions(indices[i]), counts[i]);
+      if (counts[i])
+        expected.insert(indices[i]);
+    }
+    EXPECT_TRUE(mutable_scene.getCollisions() == expected);
+  };
+  check();
+
+  // Triangles are moved next to others, so collisions appear and vanish.
+  // Offsets are never zero: a copy with its vertices in another order gets a
+  // plane that differs only by rounding, which geom::Intersects handles as
+  // a non-coplanar pair with an empty range
+  scene::Random random(9);
+  auto randomIdx = [&](size_t size) {
+    return static_cast<scene::TriangleIdx>(random.next() % size);
+  };
+  auto nearTriangle = [&](scene::TriangleIdx idx) {
+    const auto &tri = triangles[idx];
+    glm::vec3 offset(0.f, 0.f,
+                     static_cast<float>(1 + random.next() % 3) * 0.1f);
+    return geom::Triangle{tri.getPoint(1) + offset, tri.getPoint(2) + offset,
+                          tri.getPoint(0) - offset};
+  };
+  for (size_t step = 0; step < 20; ++step) {
+    for (size_t edit = 0; edit < 10; ++edit) {
+      auto idx = randomIdx(mutable_scene.getNumSlots());
+      if (!mutable_scene.contains(idx))
+        continue;
+      switch (random.next() % 3) {
+      case 0:
+        mutable_scene.erase(idx);
+        break;
+      case 1:
+        mutable_scene.update(idx, nearTriangle(randomIdx(triangles.size())));
+        break;
+      case 2:
+        mutable_scene.insert(nearTriangle(randomIdx(triangles.size())));
+        break;
+      }
+    }
+    check();
+  }
+
+  // Erased indices are reused
+  mutable_scene.erase(0);
+  EXPECT_FALSE(mutable_scene.contains(0));
+  EXPECT_EQ(mutable_scene.insert(triangles[0]), 0u);
+  check();
+
+  // Pair closer than epsilon, built at once and inserted one by one
+  auto near = getNearTouchingPair();
+  EXPECT_EQ(scene::MutableScene(near).getCollisions().size(), 2u);
+  scene::MutableScene near_scene;
+  for (const auto &tri : near)
+    near_scene.insert(tri);
+  EXPECT_EQ(near_scene.getCollisions().size(), 2u);
+  near_scene.erase(1);
+  EXPECT_EQ(near_scene.getNumCollisions(0), 0u);
+}
+
+TEST(SpatialIndex, CrossPairs) {
+  auto static_scene =
+      scene::SceneGenerator(scene::Distribution::Clusters, 5000, 10)
+          .generate();
+  auto moving =
+      scene::SceneGenerator(scene::Distribution::Clusters, 600, 11)
+          .generate();
+  // Cross pairs of the merged scene
+  auto merged = static_scene;
+  merged.insert(merged.end(), moving.begin(), moving.end());
+  auto num_static = static_cast<scene::TriangleIdx>(static_scene.size());
+  scene::Pairs expected;
+  for (auto [idx1, idx2] : scene::findIntersectingPairs(merged))
+    if (idx1 < num_static && idx2 >= num_static)
+      expected.emplace_back(idx1, idx2 - num_static);
+  std::sort(expected.begin(), expected.end());
+  EXPECT_FALSE(expected.empty());
+
+  scene::SpatialIndex index(static_scene);
+  EXPECT_EQ(scene::findIntersectingPairs(index, moving), expected);
+  EXPECT_EQ(scene::findIntersectingPairs(index, moving, 4), expected);
+  EXPECT_EQ(scene::findIntersectingPairs(static_scene, moving), expected);
+  // The larger second scene is indexed, pairs keep the argument order
+  auto swapped = scene::findIntersectingPairs(moving, static_scene);
+  ASSERT_EQ(swapped.size(), expected.size());
+  for (auto [idx1, idx2] : swapped)
+    EXPECT_TRUE(std::binary_search(expected.begin(), expected.end(),
+                                   scene::TrianglePair{idx2, idx1}));
+
+  // Pairs closer than epsilon are found as in the merged scene
+  auto near = getNearTouchingPair();
+  EXPECT_EQ(scene::findIntersectingPairs(scene::SceneView(near.data(), 1),
+                                         scene::SceneView(&near[1], 1)),
+            (scene::Pairs{{0, 0}}));
+}
@@ -1,16 +1,104 @@
 #include "common.hpp"
 
-render::VertexData getVertexData(const scene::Scene &scene,
+static void addTriangle(render::VertexData &data, scene::SceneView scene,
+                        const scene::Collisions &collisions,
+                        scene::TriangleIdx i) {
+  auto status = collisions.count(i) ? render::Status::Colliding
+                                    : render::Status::Free;
+  glm::vec3 normal = scene[i].getNormal();
+  data.emplace_back(scene[i].getPoint(0), normal, status);
+  data.emplace_back(scene[i].getPoint(1), normal, status);
+  data.emplace_back(scene[i].getPoint(2), normal, status);
+}
+
+render::VertexData getVertexData(scene::SceneView scene,
                                  const scene::Collisions &collisions) {
   render::VertexData data;
   data.reserve(scene.size() * 3);
-  for (scene::TriangleIdx i = 0; i < scene.size(); ++i) {
-    glm::vec3 color = collisions.count(i) ? glm::vec3(1.f, 0.f, 0.f)
-                                          : glm::vec3(0.f, 0.f, 1.f);
-    glm::vec3 normal = glm::normalize(scene[i].getNormal());
-    data.push_back(render::Vertex{scene[i].getPoint(0), color, normal});
-    data.push_back(render::Vertex{scene[i].getPoint(1), color, normal});
-    data.push_back(render::Vertex{scene[i].getPoint(2), color, normal});
+  for (scene::TriangleIdx i = 0; i < scene.size(); ++i)
+    addTriangle(data, scene, collisions, i);
+  return data;
+}
+
+render::VertexData getVertexData(scene::SceneView scene,
+                                 const scene::Collisions &collisions,
+                                 const scene::SpatialIndex &index) {
+  render::VertexData data;
+  data.reserve(index.size() * 3);
+  for (auto i : index.getOrder())
+    addTriangle(data, scene, collisions, i);
+  return data;
+}
+
+render::VertexRanges getVisibleRanges(const scene::SpatialIndex &index,
+                                      const glm::mat4 &view_proj) {
+  render::VertexRanges ranges;
+  for (auto range : index.findVisible(geom::Frustum(view_proj)))
+    ranges.push_back({range.begin * 3, (range.end - range.begin) * 3});
+  return ranges;
+}
+
+render::VertexData getVertexData(const scene::IndexedScene &scene,
+                                 const scene::Collisions &collisions) {
+  std::vector<glm::vec3> normals(scene.vertices.size());
+  std::vector<bool> colliding(scene.vertices.size());
+  for (scene::TriangleIdx i = 0; i < scene.triangles.size(); ++i) {
+    const auto &tri = scene.triangles[i];
+    glm::vec3 p0 = scene.vertices[tri[0]], p1 = scene.vertices[tri[1]],
+              p2 = scene.vertices[tri[2]];
+    glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    bool collides = collisions.count(i);
+    for (auto idx : tri) {
+      normals[idx] += normal;
+      if (collides)
+        colliding[idx] = true;
+    }
   }
+  render::VertexData data;
+  data.reserve(scene.vertices.size());
+  for (uint32_t i = 0; i < scene.vertices.size(); ++i)
+    data.emplace_back(scene.vertices[i], normals[i],
+                      colliding[i] ? render::Status::Colliding
+                                   : render::Status::Free);
+  return data;
+}
+
+render::IndexData getIndexData(const scene::IndexedScene &scene) {
+  render::IndexData data;
+  data.reserve(scene.triangles.size() * 3);
+  for (const auto &tri : scene.triangles)
+    data.insert(data.end(), tri.begin(), tri.end());
+  return data;
+}
+
+render::DynamicVertexData
+getDynamicVertexData(const scene::DynamicScene &scene) {
+  render::DynamicVertexData data;
+  data.reserve(scene.size() * 3);
+  for (const auto &tri : scene) {
+    glm::vec3 normal = glm::normalize(tri.getTriangle().getNormal());
+    glm::vec3 point = tri.getAxis().getPoint(),
+              direction = tri.getAxis().getDirection();
+    for (unsigned i = 0; i < 3; ++i)
+      data.push_back(render::DynamicVertex{tri.getTriangle().getPoint(i),
+                                           normal, point, direction,
+                                           tri.getSpeed()});
+  }
+  return data;
+}
+
+render::FlagData getFlagData(size_t num_triangles,
+                             const scene::Collisions &collisions) {
+  render::FlagData data(render::FlagBuffer::getNumWords(num_triangles));
+  for (auto idx : collisions)
+    data[idx / 32] |= 1u << (idx % 32);
+  return data;
+}
+
+render::FlagData getFlagData(const std::vector<uint8_t> &colliding) {
+  render::FlagData data(render::FlagBuffer::getNumWords(colliding.size()));
+  for (size_t i = 0; i < colliding.size(); ++i)
+    if (colliding[i])
+      data[i / 32] |= 1u << (i % 32);
   return data;
 }
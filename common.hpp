@@ -2,9 +2,31 @@
 #define COMMON_HPP
 
 #include "collisions/scene.hpp"
+#include "collisions/spatial_index.hpp"
 #include "renderer/visualizer.hpp"
 
-render::VertexData getVertexData(const scene::Scene &scene,
+render::VertexData getVertexData(scene::SceneView scene,
                                  const scene::Collisions &collisions);
+// Triangles in the order of the index, so its ranges are vertex ranges
+render::VertexData getVertexData(scene::SceneView scene,
+                                 const scene::Collisions &collisions,
+                                 const scene::SpatialIndex &index);
+// Vertices of the triangles near the view frustum
+render::VertexRanges getVisibleRanges(const scene::SpatialIndex &index,
+                                      const glm::mat4 &view_proj);
+
+// Shared vertices get smooth normals and are marked as colliding if any of
+// their triangles collides
+render::VertexData getVertexData(const scene::IndexedScene &scene,
+                                 const scene::Collisions &collisions);
+render::IndexData getIndexData(const scene::IndexedScene &scene);
+
+// Vertices at time 0 for rotation by the vertex shader
+render::DynamicVertexData
+getDynamicVertexData(const scene::DynamicScene &scene);
+render::FlagData getFlagData(size_t num_triangles,
+                             const scene::Collisions &collisions);
+// From a nonzero byte per colliding triangle
+render::FlagData getFlagData(const std::vector<uint8_t> &colliding);
 
 #endif
@@ -0,0 +1,34 @@
+#include "collisions/scene_file.hpp"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+// Converts text scene from standard input into binary scene file
+int main(int argc, char *argv[]) {
+  bool dynamic = argc == 3 && std::strcmp(argv[1], "--dynamic") == 0;
+  if (argc != 2 && !dynamic) {
+    std::cerr << "Usage: " << argv[0] << " [--dynamic] <output file>\n";
+    return 1;
+  }
+  try {
+    std::ofstream os(argv[argc - 1], std::ios::binary);
+    if (!os)
+      throw std::runtime_error(std::string("can not open ") + argv[argc - 1]);
+    if (dynamic) {
+      float max_time;
+      auto triangles = scene::readTextDynamicScene(std::cin, max_time);
+      scene::writeBinaryScene(os, triangles, max_time);
+    } else
+      scene::writeBinaryScene(os, scene::readTextScene(std::cin));
+    // Buffered data is written on close
+    os.close();
+    if (!os)
+      throw std::runtime_error(std::string("failed to write ") +
+                               argv[argc - 1]);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
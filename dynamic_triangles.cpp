@@ -1,37 +1,360 @@
+#include "collisions/progressive.hpp"
+#include "collisions/scene_file.hpp"
 #include "common.hpp"
+#include "mailbox.hpp"
+#include "profiler.hpp"
 #include <GLFW/glfw3.h>
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
 
-int main(int argc, char *argv[]) {
-  scene::TriangleIdx N;
-  float MaxTime;
-  std::cin >> N >> MaxTime;
+namespace {
+
+struct Options {
+  // Fixed number of frames stepped by fixed dt instead of real time
+  std::optional<unsigned> frames;
+  float dt = 1.f / 60.f;
+  std::optional<vk::PresentModeKHR> present_mode;
+  unsigned frames_in_flight = 2;
+  unsigned num_threads = 1;
+  // Detection time per frame of lazy detection, visible triangles first
+  std::optional<scene::ProgressiveDetector::Budget> budget;
+  // Simulate and draw on one thread, one frame after another
+  bool serial = false;
+  // Rotate vertices on CPU and upload all of them every frame
+  bool cpu_rotation = false;
+  std::string profile, input;
+  // Image file pattern of offscreen frames, drawn without a window
+  std::string output;
+  vk::Extent2D size{1280, 720};
+};
+
+void printUsage(const char *name) {
+  std::cerr
+      << "Usage: " << name << " [options] [scene file]\n"
+      << "Reads binary dynamic scene file, or text scene from standard "
+         "input\n"
+      << "  --frames N           benchmark mode: render N frames with fixed "
+         "time step\n"
+      << "  --dt SECONDS         time step of benchmark mode (1/60)\n"
+      << "  --present-mode MODE  fifo, mailbox or immediate (fifo, immediate "
+         "in benchmark mode)\n"
+      << "  --frames-in-flight N frames drawn by GPU while the next one is "
+         "recorded, 0 waits for every frame (2)\n"
+      << "  --profile FILE       write frame stage percentiles, JSON for "
+         ".json files and CSV otherwise (standard output in benchmark "
+         "mode)\n"
+      << "  --threads N          collision detection threads, 0 for all (1)\n"
+      << "  --budget MS          detect collisions of visible triangles "
+         "first, then the others progressively, for MS milliseconds per "
+         "frame on one thread\n"
+      << "  --serial             simulate and draw frames one after another "
+         "on one thread\n"
+      << "  --cpu-rotation       rotate vertices on CPU and upload them every "
+         "frame instead of collision flags only\n"
+      << "  --output PATTERN     draw frames without a window into PNG or PPM "
+         "files, %d is the frame number (needs --frames)\n"
+      << "  --size WxH           offscreen image size (1280x720)\n";
+}
+
+std::optional<Options> parseOptions(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    auto has_value = [&]() { return i + 1 < argc; };
+    if (!std::strcmp(argv[i], "--frames") && has_value())
+      options.frames = std::stoul(argv[++i]);
+    else if (!std::strcmp(argv[i], "--dt") && has_value())
+      options.dt = std::stof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--present-mode") && has_value()) {
+      std::string mode = argv[++i];
+      if (mode == "fifo")
+        options.present_mode = vk::PresentModeKHR::eFifo;
+      else if (mode == "mailbox")
+        options.present_mode = vk::PresentModeKHR::eMailbox;
+      else if (mode == "immediate")
+        options.present_mode = vk::PresentModeKHR::eImmediate;
+      else
+        return std::nullopt;
+    } else if (!std::strcmp(argv[i], "--frames-in-flight") && has_value())
+      options.frames_in_flight = std::stoul(argv[++i]);
+    else if (!std::strcmp(argv[i], "--profile") && has_value())
+      options.profile = argv[++i];
+    else if (!std::strcmp(argv[i], "--threads") && has_value())
+      options.num_threads = std::stoul(argv[++i]);
+    else if (!std::strcmp(argv[i], "--budget") && has_value())
+      options.budget =
+          std::chrono::duration<double, std::milli>(std::stod(argv[++i]));
+    else if (!std::strcmp(argv[i], "--serial"))
+      options.serial = true;
+    else if (!std::strcmp(argv[i], "--cpu-rotation"))
+      options.cpu_rotation = true;
+    else if (!std::strcmp(argv[i], "--output") && has_value())
+      options.output = argv[++i];
+    else if (!std::strcmp(argv[i], "--size") && has_value()) {
+      std::string size = argv[++i];
+      auto x = size.find('x');
+      if (x == std::string::npos)
+        return std::nullopt;
+      options.size = vk::Extent2D{static_cast<uint32_t>(std::stoul(size)),
+                                  static_cast<uint32_t>(
+                                      std::stoul(size.substr(x + 1)))};
+      if (!options.size.width || !options.size.height)
+        return std::nullopt;
+    }
+    else if (argv[i][0] != '-' && options.input.empty())
+      options.input = argv[i];
+    else
+      return std::nullopt;
+  }
+  // Every simulated frame is written once, so frames are not dropped
+  if (!options.output.empty()) {
+    if (!options.frames)
+      return std::nullopt;
+    options.serial = true;
+  }
+  return options;
+}
+
+enum Stage {
+  Update,
+  Detect,
+  VertexData,
+  Wait,
+  Upload,
+  Submit,
+  Present,
+  Frame
+};
+
+struct SimulatedFrame {
+  float time;
+  scene::Scene scene;
+  // Vertex data with CPU rotation, flag data otherwise
+  render::VertexData vertex_data;
+  render::FlagData flag_data;
+};
+
+class Simulation {
+public:
+  Simulation(const Options &options, FrameProfiler &profiler)
+      : options_(options), profiler_(profiler) {}
+  // Reads the scene, throws on errors
+  void load();
+  size_t getNumTriangles() const { return triangles_.size(); }
+  // Vertices at time 0, empty with CPU rotation
+  const render::DynamicVertexData &getDynamicVertexData() const {
+    return dynamic_vertex_data_;
+  }
+  // Whether the frame is past the end of benchmark mode
+  bool isFinished(unsigned frame) const {
+    return options_.frames && frame >= *options_.frames;
+  }
+  // Camera of the drawn frames, whose view is detected first with a budget
+  void setViewProjection(const glm::mat4 &view_proj) {
+    std::lock_guard<std::mutex> lock(view_mutex_);
+    view_proj_ = view_proj;
+  }
+  void simulate(unsigned frame, SimulatedFrame &out);
+
+private:
+  const Options &options_;
+  FrameProfiler &profiler_;
+  scene::PackedDynamicScene triangles_;
+  scene::ProgressiveDetector detector_;
+  std::mutex view_mutex_;
+  glm::mat4 view_proj_{1.f};
+  render::DynamicVertexData dynamic_vertex_data_;
+  float max_time_;
+  std::chrono::steady_clock::time_point start_time_;
+};
+
+void Simulation::load() {
   scene::DynamicScene triangles;
-  triangles.reserve(N);
-  for (scene::TriangleIdx i = 0; i < N; ++i) {
-    scene::DynamicTriangle tri;
-    std::cin >> tri;
-    triangles.push_back(tri);
+  if (!options_.input.empty()) {
+    scene::MappedScene mapped(options_.input);
+    triangles = mapped.getDynamicScene();
+    max_time_ = mapped.getMaxTime();
+  } else
+    triangles = scene::readTextDynamicScene(std::cin, max_time_);
+  triangles_ = scene::PackedDynamicScene(triangles);
+  if (options_.budget)
+    detector_ = scene::ProgressiveDetector(triangles);
+  if (!options_.cpu_rotation)
+    dynamic_vertex_data_ = ::getDynamicVertexData(triangles);
+  start_time_ = std::chrono::steady_clock::now();
+}
+
+void Simulation::simulate(unsigned frame, SimulatedFrame &out) {
+  float time = options_.frames
+                   ? frame * options_.dt
+                   : std::chrono::duration<float>(
+                         std::chrono::steady_clock::now() - start_time_)
+                         .count();
+  out.time = std::min(time, max_time_);
+  Stopwatch stopwatch;
+  // Reuses the storage of the mailbox slot. Lazy detection moves only the
+  // triangles it tests.
+  if (!options_.budget || options_.cpu_rotation)
+    triangles_.update(out.time, out.scene, options_.num_threads);
+  profiler_.record(Update, stopwatch.lap());
+  if (options_.budget) {
+    glm::mat4 view_proj;
+    {
+      std::lock_guard<std::mutex> lock(view_mutex_);
+      view_proj = view_proj_;
+    }
+    detector_.update(out.time, geom::Frustum(view_proj), *options_.budget);
+    profiler_.record(Detect, stopwatch.lap());
+    if (options_.cpu_rotation)
+      out.vertex_data = getVertexData(out.scene, detector_.getCollisions());
+    else
+      out.flag_data = getFlagData(detector_.getColliding());
+  } else {
+    auto collisions =
+        scene::findIntersectingTriangles(out.scene, options_.num_threads);
+    profiler_.record(Detect, stopwatch.lap());
+    if (options_.cpu_rotation)
+      out.vertex_data = getVertexData(out.scene, collisions);
+    else
+      out.flag_data = getFlagData(out.scene.size(), collisions);
+  }
+  profiler_.record(VertexData, stopwatch.lap());
+}
+
+render::DrawTimings drawFrame(render::Visualizer &visualizer,
+                              const Options &options,
+                              const SimulatedFrame &frame) {
+  return options.cpu_rotation
+             ? visualizer.drawFrame(frame.vertex_data)
+             : visualizer.drawFrame(frame.time, frame.flag_data);
+}
+
+void recordDraw(FrameProfiler &profiler, const render::DrawTimings &timings) {
+  profiler.record(Wait, timings.wait);
+  profiler.record(Upload, timings.upload);
+  profiler.record(Submit, timings.submit);
+  profiler.record(Present, timings.present);
+}
+
+void runSerial(const Options &options, Simulation &simulation,
+               render::Visualizer &visualizer, FrameProfiler &profiler) {
+  SimulatedFrame frame;
+  for (unsigned i = 0; !visualizer.shouldClose() && !simulation.isFinished(i);
+       ++i) {
+    Stopwatch stopwatch;
+    simulation.setViewProjection(visualizer.getViewProjection());
+    simulation.simulate(i, frame);
+    recordDraw(profiler, drawFrame(visualizer, options, frame));
+    profiler.record(Frame, stopwatch.lap());
   }
+}
+
+// Producer thread simulates frame N + 1 while frame N is drawn. Drawing
+// never waits for the producer: without a new frame the last one is drawn
+// again, and frames produced faster than drawn are dropped.
+void runPipelined(const Options &options, Simulation &simulation,
+                  render::Visualizer &visualizer, FrameProfiler &profiler) {
+  Mailbox<SimulatedFrame> mailbox;
+  std::atomic<bool> stop{false}, finished{false};
+  std::exception_ptr error;
+  simulation.setViewProjection(visualizer.getViewProjection());
+  std::thread producer([&]() {
+    try {
+      for (unsigned i = 0; !stop && !simulation.isFinished(i); ++i) {
+        simulation.simulate(i, mailbox.getBack());
+        mailbox.publish();
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+    finished = true;
+  });
 
+  bool has_frame = false;
+  while (!visualizer.shouldClose()) {
+    simulation.setViewProjection(visualizer.getViewProjection());
+    // Read the flag first, so the last published frame is not missed
+    bool producer_finished = finished;
+    auto *frame = mailbox.take();
+    if (!frame && producer_finished)
+      break;
+    if (!frame && !has_frame) {
+      std::this_thread::yield();
+      continue;
+    }
+    Stopwatch stopwatch;
+    recordDraw(profiler, frame ? drawFrame(visualizer, options, *frame)
+                               : visualizer.drawFrame());
+    profiler.record(Frame, stopwatch.lap());
+    has_frame = true;
+  }
+  stop = true;
+  producer.join();
+  std::cerr << "dropped frames: " << mailbox.getNumDropped() << '\n';
+  if (error)
+    std::rethrow_exception(error);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::optional<Options> options;
+  try {
+    options = parseOptions(argc, argv);
+  } catch (const std::exception &) {
+  }
+  if (!options) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  FrameProfiler profiler({"update", "detect", "vertex-data", "wait",
+                          "upload", "submit", "present", "frame"});
+  Simulation simulation(*options, profiler);
+
+  // Benchmark mode does not wait for vertical sync by default
+  render::RenderOptions render_options;
+  render_options.present_mode = options->present_mode.value_or(
+      options->frames ? vk::PresentModeKHR::eImmediate
+                      : vk::PresentModeKHR::eFifo);
+  render_options.frames_in_flight = options->frames_in_flight;
+  if (!options->output.empty())
+    render_options.offscreen = options->size;
+  int res = 0;
   glfwInit();
   try {
-    render::Visualizer visualizer("Dynamic triangles", N * 3);
-    auto start_time = std::chrono::high_resolution_clock::now();
-    while (!visualizer.shouldClose()) {
-      float time = std::chrono::duration<float>(
-                       std::chrono::high_resolution_clock::now() - start_time)
-                       .count();
-      auto cur_scene =
-          scene::updateDynamicScene(triangles, std::min(time, MaxTime));
-      auto vertex_data =
-          getVertexData(cur_scene, scene::findIntersectingTriangles(cur_scene));
-      visualizer.drawFrame(vertex_data);
-    }
+    // Renderer is set up on another thread while the scene is loaded
+    render::Visualizer visualizer("Dynamic triangles",
+                                  options->cpu_rotation
+                                      ? render::VertexFormat::Vertex
+                                      : render::VertexFormat::DynamicVertex,
+                                  render_options);
+    simulation.load();
+    if (options->cpu_rotation)
+      visualizer.setScene(simulation.getNumTriangles() * 3);
+    else
+      visualizer.setScene(simulation.getDynamicVertexData());
+    if (!options->output.empty())
+      visualizer.writeImages(options->output);
+    if (options->serial)
+      runSerial(*options, simulation, visualizer, profiler);
+    else
+      runPipelined(*options, simulation, visualizer, profiler);
+    visualizer.finish();
+    if (!options->profile.empty())
+      profiler.write(options->profile);
+    else if (options->frames)
+      profiler.writeCSV(std::cout);
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
+    res = 1;
   }
   glfwTerminate();
-  return 0;
+  return res;
 }
@@ -0,0 +1,230 @@
+#include "collisions/mesh_file.hpp"
+#include "collisions/out_of_core.hpp"
+#include "collisions/scene_file.hpp"
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Collects formatted integers in a large buffer and writes it with a single
+// call once full, much faster than formatted stream output
+class BufferedWriter {
+public:
+  explicit BufferedWriter(std::FILE *file, size_t capacity = size_t(1) << 20)
+      : file_(file), buffer_(capacity) {}
+  BufferedWriter(const BufferedWriter &) = delete;
+  BufferedWriter &operator=(const BufferedWriter &) = delete;
+  ~BufferedWriter() {
+    if (size_)
+      std::fwrite(buffer_.data(), 1, size_, file_);
+  }
+  void write(uint32_t value, char separator) {
+    if (buffer_.size() - size_ < MaxEntrySize)
+      flush();
+    auto res = std::to_chars(buffer_.data() + size_,
+                             buffer_.data() + buffer_.size(), value);
+    *res.ptr = separator;
+    size_ = res.ptr + 1 - buffer_.data();
+  }
+  // Data that failed to be written is dropped, so the destructor does not
+  // write it again
+  void flush() {
+    size_t size = size_;
+    size_ = 0;
+    if (size && std::fwrite(buffer_.data(), 1, size, file_) != size)
+      throw std::runtime_error("failed to write collisions");
+  }
+
+private:
+  static constexpr size_t MaxEntrySize = 16;
+  std::FILE *file_;
+  std::vector<char> buffer_;
+  size_t size_ = 0;
+};
+
+enum class Engine { Tree, BruteForce, OutOfCore };
+
+struct Options {
+  Engine engine = Engine::Tree;
+  unsigned num_threads = 1;
+  bool pairs = false;
+  bool stats = false;
+  size_t memory_budget = scene::OutOfCoreOptions{}.memory_budget;
+  std::string input, output;
+};
+
+void printUsage(const char *name) {
+  std::cerr
+      << "Usage: " << name << " [options] [scene file]\n"
+      << "Reads binary scene or mesh (OBJ, STL, PLY) file, or text scene "
+         "from standard input, and prints intersecting triangles\n"
+      << "  --engine tree|brute|out-of-core  detection engine (tree)\n"
+      << "  --threads N                      worker threads, 0 for all (1)\n"
+      << "  --pairs                          print intersecting pairs\n"
+      << "  --stats                          print tree engine statistics\n"
+      << "  --memory-budget MB               out-of-core bin budget (1024)\n"
+      << "  --output FILE                    output file (standard output)\n";
+}
+
+// std::stoull accepts a minus sign and wraps negative values around
+template <typename T> T parseUnsigned(const std::string &value) {
+  if (value.find('-') != std::string::npos)
+    throw std::invalid_argument("negative value " + value);
+  auto res = std::stoull(value);
+  if (res > std::numeric_limits<T>::max())
+    throw std::out_of_range("too large value " + value);
+  return static_cast<T>(res);
+}
+
+std::optional<Options> parseOptions(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    auto has_value = [&]() { return i + 1 < argc; };
+    if (!std::strcmp(argv[i], "--engine") && has_value()) {
+      std::string engine = argv[++i];
+      if (engine == "tree")
+        options.engine = Engine::Tree;
+      else if (engine == "brute")
+        options.engine = Engine::BruteForce;
+      else if (engine == "out-of-core")
+        options.engine = Engine::OutOfCore;
+      else
+        return std::nullopt;
+    } else if (!std::strcmp(argv[i], "--threads") && has_value())
+      options.num_threads = parseUnsigned<unsigned>(argv[++i]);
+    else if (!std::strcmp(argv[i], "--pairs"))
+      options.pairs = true;
+    else if (!std::strcmp(argv[i], "--stats"))
+      options.stats = true;
+    else if (!std::strcmp(argv[i], "--memory-budget") && has_value())
+      options.memory_budget = parseUnsigned<size_t>(argv[++i]) << 20;
+    else if (!std::strcmp(argv[i], "--output") && has_value())
+      options.output = argv[++i];
+    else if (argv[i][0] != '-' && options.input.empty())
+      options.input = argv[i];
+    else
+      return std::nullopt;
+  }
+  if (options.pairs && options.engine == Engine::OutOfCore)
+    return std::nullopt;
+  return options;
+}
+
+class PhaseTimer {
+public:
+  void finish(const char *phase) {
+    auto now = std::chrono::steady_clock::now();
+    std::cerr << phase << ": "
+              << std::chrono::duration<double, std::milli>(now - start_).count()
+              << " ms\n";
+    start_ = now;
+  }
+
+private:
+  std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::optional<Options> options;
+  try {
+    options = parseOptions(argc, argv);
+  } catch (const std::exception &) {
+  }
+  if (!options) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  try {
+    PhaseTimer timer;
+    std::optional<scene::MappedScene> mapped;
+    scene::Scene parsed;
+    scene::IndexedScene mesh;
+    scene::SceneView triangles;
+    if (options->input.empty()) {
+      parsed = scene::readTextScene(std::cin);
+      triangles = parsed;
+    } else if (scene::isMeshFile(options->input)) {
+      mesh = scene::loadMesh(options->input);
+      triangles = mesh;
+    } else {
+      mapped.emplace(options->input);
+      triangles = mapped->getScene();
+    }
+    std::cerr << "triangles: " << triangles.size() << '\n';
+    timer.finish("read");
+
+    scene::Collisions collisions;
+    scene::Pairs pairs;
+    scene::Stats stats;
+    scene::Stats *stats_ptr = options->stats ? &stats : nullptr;
+    switch (options->engine) {
+    case Engine::Tree:
+      if (options->pairs)
+        pairs = scene::findIntersectingPairs(triangles, options->num_threads,
+                                             stats_ptr);
+      else
+        collisions = scene::findIntersectingTriangles(
+            triangles, options->num_threads, stats_ptr);
+      if (stats_ptr)
+        std::cerr << stats;
+      break;
+    case Engine::BruteForce:
+      if (options->pairs)
+        pairs = scene::findIntersectingPairsBruteForce(triangles,
+                                                       options->num_threads);
+      else
+        collisions = scene::findIntersectingTrianglesBruteForce(
+            triangles, options->num_threads);
+      break;
+    case Engine::OutOfCore: {
+      scene::OutOfCoreOptions ooc_options;
+      ooc_options.memory_budget = options->memory_budget;
+      ooc_options.num_threads = options->num_threads;
+      collisions =
+          scene::findIntersectingTrianglesOutOfCore(triangles, ooc_options);
+      break;
+    }
+    }
+    std::cerr << "collisions: "
+              << (options->pairs ? pairs.size() : collisions.size()) << '\n';
+    timer.finish("detect");
+
+    std::FILE *file = stdout;
+    if (!options->output.empty() &&
+        !(file = std::fopen(options->output.c_str(), "wb")))
+      throw std::runtime_error("can not open " + options->output);
+    {
+      BufferedWriter writer(file);
+      if (options->pairs)
+        for (auto [idx1, idx2] : pairs) {
+          writer.write(idx1, ' ');
+          writer.write(idx2, '\n');
+        }
+      else
+        for (auto idx : collisions)
+          writer.write(idx, '\n');
+      writer.flush();
+    }
+    // Data left in the stdio buffer is lost if closing or flushing fails,
+    // e.g. on a full disk
+    if (file != stdout ? std::fclose(file) != 0 : std::fflush(file) != 0)
+      throw std::runtime_error("failed to write collisions");
+    timer.finish("write");
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include "collisions/generator.hpp"
+#include "collisions/scene_file.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// Scenes are generated and written in pieces, so memory use does not grow
+// with the scene size
+constexpr size_t PieceSize = size_t(1) << 20;
+
+struct Options {
+  scene::Distribution distribution = scene::Distribution::Uniform;
+  size_t size = 100000;
+  uint64_t seed = 0;
+  float density = 1.25f;
+  bool dynamic = false;
+  float max_time = 10.f;
+  bool text = false;
+  unsigned num_threads = 0;
+  std::string output;
+};
+
+void printUsage(const char *name) {
+  std::cerr
+      << "Usage: " << name << " [options] <output file>\n"
+      << "Generates random scene, same options always give the same scene\n"
+      << "  --distribution NAME  uniform, clusters, sheets, slivers, pairs "
+         "or nested (uniform)\n"
+      << "  --size N             number of triangles (100000)\n"
+      << "  --seed N             random seed (0)\n"
+      << "  --density D          triangles per unit of volume (1.25)\n"
+      << "  --dynamic            rotating triangles with axes and speeds\n"
+      << "  --max-time T         dynamic scene duration in seconds (10)\n"
+      << "  --text               text format instead of binary, output file "
+         "may be - for standard output\n"
+      << "  --threads N          generator threads, 0 for all (0)\n";
+}
+
+std::optional<Options> parseOptions(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    auto has_value = [&]() { return i + 1 < argc; };
+    if (!std::strcmp(argv[i], "--distribution") && has_value()) {
+      auto distribution = scene::parseDistribution(argv[++i]);
+      if (!distribution)
+        return std::nullopt;
+      options.distribution = *distribution;
+    } else if (!std::strcmp(argv[i], "--size") && has_value())
+      options.size = std::stoull(argv[++i]);
+    else if (!std::strcmp(argv[i], "--seed") && has_value())
+      options.seed = std::stoull(argv[++i]);
+    else if (!std::strcmp(argv[i], "--density") && has_value())
+      options.density = std::stof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--dynamic"))
+      options.dynamic = true;
+    else if (!std::strcmp(argv[i], "--max-time") && has_value())
+      options.max_time = std::stof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--text"))
+      options.text = true;
+    else if (!std::strcmp(argv[i], "--threads") && has_value())
+      options.num_threads = std::stoul(argv[++i]);
+    else if ((argv[i][0] != '-' || !std::strcmp(argv[i], "-")) &&
+             options.output.empty())
+      options.output = argv[i];
+    else
+      return std::nullopt;
+  }
+  if (options.output.empty() || options.density <= 0.f ||
+      options.size > std::numeric_limits<scene::TriangleIdx>::max() ||
+      (options.output == "-" && !options.text))
+    return std::nullopt;
+  return options;
+}
+
+template <typename Func> void forEachPiece(size_t size, Func func) {
+  for (size_t first = 0; first < size; first += PieceSize)
+    func(first, std::min(first + PieceSize, size));
+}
+
+void writeText(const Options &options,
+               const scene::SceneGenerator &generator, std::ostream &os) {
+  if (options.dynamic) {
+    scene::writeTextSceneHeader(os, options.size, options.max_time);
+    forEachPiece(options.size, [&](size_t first, size_t last) {
+      scene::writeTextTriangles(
+          os, generator.generateDynamic(first, last, options.num_threads));
+    });
+  } else {
+    scene::writeTextSceneHeader(os, options.size);
+    forEachPiece(options.size, [&](size_t first, size_t last) {
+      scene::writeTextTriangles(
+          os, generator.generate(first, last, options.num_threads));
+    });
+  }
+  if (!os.flush())
+    throw std::runtime_error("failed to write text scene");
+}
+
+void writeBinary(const Options &options,
+                 const scene::SceneGenerator &generator) {
+  scene::BinarySceneWriter writer(options.output, options.size,
+                                  options.dynamic, options.max_time);
+  forEachPiece(options.size, [&](size_t first, size_t last) {
+    if (options.dynamic)
+      writer.write(first,
+                   generator.generateDynamic(first, last, options.num_threads));
+    else
+      writer.write(first, generator.generate(first, last, options.num_threads));
+  });
+  writer.close();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::optional<Options> options;
+  try {
+    options = parseOptions(argc, argv);
+  } catch (const std::exception &) {
+  }
+  if (!options) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  try {
+    scene::SceneGenerator generator(options->distribution, options->size,
+                                    options->seed, options->density);
+    if (!options->text)
+      writeBinary(*options, generator);
+    else if (options->output == "-")
+      writeText(*options, generator, std::cout);
+    else {
+      std::ofstream os(options->output);
+      if (!os)
+        throw std::runtime_error("can not open " + options->output);
+      writeText(*options, generator, os);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef MAILBOX_HPP
+#define MAILBOX_HPP
+
+#include <array>
+#include <mutex>
+#include <utility>
+
+// Triple buffer passing the latest value from one producer thread to one
+// consumer thread, neither of them waits for the other. Values published
+// before the consumer takes them replace each other, so stale ones are
+// dropped. Slots are reused, so their storage is allocated only once.
+template <typename T> class Mailbox {
+public:
+  // Slot owned by the producer until publish()
+  T &getBack() { return slots_[back_]; }
+  void publish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::swap(back_, middle_);
+    if (fresh_)
+      ++num_dropped_;
+    fresh_ = true;
+  }
+  // Latest published value owned by the consumer until the next take(), or
+  // nullptr if nothing was published since the previous call
+  T *take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!fresh_)
+      return nullptr;
+    std::swap(front_, middle_);
+    fresh_ = false;
+    return &slots_[front_];
+  }
+  size_t getNumDropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_dropped_;
+  }
+
+private:
+  std::array<T, 3> slots_;
+  unsigned back_ = 0, middle_ = 1, front_ = 2;
+  bool fresh_ = false;
+  size_t num_dropped_ = 0;
+  std::mutex mutex_;
+};
+
+#endif
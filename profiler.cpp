@@ -0,0 +1,70 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+
+double Stopwatch::lap() {
+  auto now = std::chrono::steady_clock::now();
+  double res = std::chrono::duration<double>(now - start_).count();
+  start_ = now;
+  return res;
+}
+
+FrameProfiler::FrameProfiler(std::vector<std::string> stages)
+    : stages_(std::move(stages)), samples_(stages_.size()) {}
+
+FrameProfiler::Summary FrameProfiler::getSummary(size_t stage) const {
+  auto samples = samples_[stage];
+  if (samples.empty())
+    return Summary{0, 0., 0., 0., 0., 0.};
+  std::sort(samples.begin(), samples.end());
+  // Nearest-rank percentile
+  auto percentile = [&samples](double p) {
+    size_t rank = static_cast<size_t>(p * samples.size() + 0.5);
+    return samples[std::min(std::max<size_t>(rank, 1), samples.size()) - 1];
+  };
+  double sum = std::accumulate(samples.begin(), samples.end(), 0.);
+  return Summary{samples.size(), sum / samples.size(), percentile(0.5),
+                 percentile(0.9), percentile(0.99), samples.back()};
+}
+
+void FrameProfiler::writeCSV(std::ostream &os) const {
+  os << "stage,frames,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    auto summary = getSummary(i);
+    os << stages_[i] << ',' << summary.count << ',' << summary.mean * 1e3
+       << ',' << summary.p50 * 1e3 << ',' << summary.p90 * 1e3 << ','
+       << summary.p99 * 1e3 << ',' << summary.max * 1e3 << '\n';
+  }
+}
+
+void FrameProfiler::writeJSON(std::ostream &os) const {
+  os << "{\n  \"stages\": [";
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    auto summary = getSummary(i);
+    os << (i ? ",\n" : "\n") << "    {\"name\": \"" << stages_[i]
+       << "\", \"frames\": " << summary.count
+       << ", \"mean_ms\": " << summary.mean * 1e3
+       << ", \"p50_ms\": " << summary.p50 * 1e3
+       << ", \"p90_ms\": " << summary.p90 * 1e3
+       << ", \"p99_ms\": " << summary.p99 * 1e3
+       << ", \"max_ms\": " << summary.max * 1e3 << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+void FrameProfiler::write(const std::string &path) const {
+  std::ofstream os(path);
+  if (!os)
+    throw std::runtime_error("can not open " + path);
+  auto ends_with = [&path](const std::string &suffix) {
+    return path.size() >= suffix.size() &&
+           path.compare(path.size() - suffix.size(), suffix.size(), suffix) ==
+               0;
+  };
+  if (ends_with(".json"))
+    writeJSON(os);
+  else
+    writeCSV(os);
+}
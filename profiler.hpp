@@ -0,0 +1,44 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <chrono>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+class Stopwatch {
+public:
+  // Seconds since construction or the previous call
+  double lap();
+
+private:
+  std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+};
+
+// Collects durations of named frame stages and reports their percentiles.
+// Different stages may be recorded from different threads.
+class FrameProfiler {
+public:
+  explicit FrameProfiler(std::vector<std::string> stages);
+  void record(size_t stage, double seconds) {
+    samples_[stage].push_back(seconds);
+  }
+  void writeCSV(std::ostream &os) const;
+  void writeJSON(std::ostream &os) const;
+  // JSON for .json files, CSV otherwise
+  void write(const std::string &path) const;
+
+private:
+  struct Summary {
+    size_t count;
+    double mean, p50, p90, p99, max;
+  };
+
+  std::vector<std::string> stages_;
+  std::vector<std::vector<double>> samples_;
+
+  Summary getSummary(size_t stage) const;
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "image.hpp"
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace render {
+
+namespace {
+
+void writeBigEndian(std::vector<uint8_t> &data, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8)
+    data.push_back(static_cast<uint8_t>(value >> shift));
+}
+
+uint32_t getCRC(const uint8_t *begin, const uint8_t *end) {
+  static const auto table = []() {
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+      table[i] = crc;
+    }
+    return table;
+  }();
+  uint32_t crc = 0xffffffffu;
+  for (auto it = begin; it != end; ++it)
+    crc = table[(crc ^ *it) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffffu;
+}
+
+void writeChunk(std::ostream &os, const char *type,
+                const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> chunk;
+  chunk.reserve(data.size() + 12);
+  writeBigEndian(chunk, static_cast<uint32_t>(data.size()));
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  writeBigEndian(chunk, getCRC(chunk.data() + 4, chunk.data() + chunk.size()));
+  os.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+}
+
+void writePNG(std::ostream &os, const Image &image) {
+  const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  os.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+  std::vector<uint8_t> header;
+  writeBigEndian(header, image.width);
+  writeBigEndian(header, image.height);
+  // 8 bits per channel RGBA, deflate, adaptive filtering, no interlace
+  header.insert(header.end(), {8, 6, 0, 0, 0});
+  writeChunk(os, "IHDR", header);
+
+  // Every row starts with filter type 0 (none)
+  size_t row_size = size_t{image.width} * 4;
+  std::vector<uint8_t> raw;
+  raw.reserve((row_size + 1) * image.height);
+  for (uint32_t y = 0; y < image.height; ++y) {
+    raw.push_back(0);
+    raw.insert(raw.end(), image.pixels + y * row_size,
+               image.pixels + (y + 1) * row_size);
+  }
+
+  // Zlib stream of stored deflate blocks
+  constexpr size_t MaxBlockSize = 65535;
+  std::vector<uint8_t> data{0x78, 0x01};
+  data.reserve(raw.size() + raw.size() / MaxBlockSize * 5 + 16);
+  uint32_t a = 1, b = 0;
+  for (size_t pos = 0; pos < raw.size() || pos == 0; pos += MaxBlockSize) {
+    auto size = static_cast<uint16_t>(std::min(MaxBlockSize, raw.size() - pos));
+    bool last = pos + size == raw.size();
+    auto inverse = static_cast<uint16_t>(~size);
+    data.insert(data.end(), {static_cast<uint8_t>(last),
+                             static_cast<uint8_t>(size),
+                             static_cast<uint8_t>(size >> 8),
+                             static_cast<uint8_t>(inverse),
+                             static_cast<uint8_t>(inverse >> 8)});
+    data.insert(data.end(), raw.begin() + pos, raw.begin() + pos + size);
+    if (last)
+      break;
+  }
+  for (auto byte : raw) {
+    a = (a + byte) % 65521;
+    b = (b + a) % 65521;
+  }
+  writeBigEndian(data, (b << 16) | a);
+  writeChunk(os, "IDAT", data);
+  writeChunk(os, "IEND", {});
+}
+
+void writePPM(std::ostream &os, const Image &image) {
+  os << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+  size_t num_pixels = size_t{image.width} * image.height;
+  std::vector<uint8_t> data;
+  data.reserve(num_pixels * 3);
+  for (size_t i = 0; i < num_pixels; ++i)
+    data.insert(data.end(), image.pixels + i * 4, image.pixels + i * 4 + 3);
+  os.write(reinterpret_cast<const char *>(data.data()), data.size());
+}
+
+} // namespace
+
+void writeImage(const std::string &path, const Image &image) {
+  std::ofstream os(path, std::ios::binary);
+  if (!os)
+    throw std::runtime_error("can not open " + path);
+  bool png = path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+  if (png)
+    writePNG(os, image);
+  else
+    writePPM(os, image);
+  if (!os)
+    throw std::runtime_error("can not write " + path);
+}
+
+} // namespace render
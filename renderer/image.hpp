@@ -0,0 +1,21 @@
+#ifndef RENDERER_IMAGE_HPP
+#define RENDERER_IMAGE_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace render {
+
+// RGBA pixels with 8 bits per channel, rows from top to bottom
+struct Image {
+  uint32_t width, height;
+  const uint8_t *pixels;
+};
+
+// PNG for .png files, binary PPM otherwise. PNG is not compressed, so no
+// zlib is needed.
+void writeImage(const std::string &path, const Image &image);
+
+} // namespace render
+
+#endif
@@ -1,10 +1,18 @@
 #include "renderer.hpp"
 #include "window.hpp"
-#include <GLFW/glfw3.h>
 #include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 #include <vector>
 
@@ -12,6 +20,43 @@ VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE;
 
 namespace render {
 
+using Clock = std::chrono::steady_clock;
+
+static double getSeconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double>(end - start).count();
+}
+
+static const std::vector<uint32_t> vert_code =
+#include "shader.vert.inc"
+    ;
+static const std::vector<uint32_t> dynamic_vert_code =
+#include "dynamic.vert.inc"
+    ;
+static const std::vector<uint32_t> frag_code =
+#include "shader.frag.inc"
+    ;
+
+// FNV-1a of all shaders, part of the pipeline cache key
+static uint64_t getShaderHash() {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const auto *code : {&vert_code, &dynamic_vert_code, &frag_code})
+    for (auto word : *code)
+      for (int shift = 0; shift < 32; shift += 8) {
+        hash ^= (word >> shift) & 0xff;
+        hash *= 0x100000001b3ull;
+      }
+  return hash;
+}
+
+// $XDG_CACHE_HOME/triangles or ~/.cache/triangles, empty if neither is set
+static std::filesystem::path getCacheDirectory() {
+  if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache)
+    return std::filesystem::path(cache) / "triangles";
+  if (const char *home = std::getenv("HOME"); home && *home)
+    return std::filesystem::path(home) / ".cache" / "triangles";
+  return {};
+}
+
 #ifndef NDEBUG
 static VKAPI_ATTR VkBool32 VKAPI_CALL
 debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
@@ -24,101 +69,305 @@ debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 }
 #endif
 
-Renderer::Renderer(const Window &window, const std::string &app_name,
-                   size_t num_vertices) {
-  createInstance(window, app_name);
+Renderer::Renderer(const Window *window, const std::string &app_name,
+                   VertexFormat vertex_format, const RenderOptions &options)
+    : window_(window), options_(options),
+      dynamic_(vertex_format == VertexFormat::DynamicVertex) {
+  createContext(app_name);
+  createResources();
+}
+
+Renderer::Renderer(const Window *window, const std::string &app_name,
+                   size_t num_vertices, const IndexData &index_data,
+                   const RenderOptions &options)
+    : Renderer(window, app_name, VertexFormat::Vertex, options) {
+  setScene(num_vertices, index_data);
+}
+
+Renderer::Renderer(const Window *window, const std::string &app_name,
+                   const VertexData &vertex_data, const IndexData &index_data,
+                   const RenderOptions &options)
+    : Renderer(window, app_name, VertexFormat::Vertex, options) {
+  setScene(vertex_data, index_data);
+}
+
+Renderer::Renderer(const Window *window, const std::string &app_name,
+                   const DynamicVertexData &vertex_data,
+                   const RenderOptions &options)
+    : Renderer(window, app_name, VertexFormat::DynamicVertex, options) {
+  setScene(vertex_data);
+}
+
+void Renderer::setScene(size_t num_vertices, const IndexData &index_data) {
+  assert(!dynamic_);
+  num_vertices_ = num_vertices;
+  createIndices(index_data);
+}
+
+void Renderer::setScene(const VertexData &vertex_data,
+                        const IndexData &index_data) {
+  setScene(vertex_data.size(), index_data);
+  frames_[0].vertices =
+      VertexChunks(*device_, physical_device_, vertex_data.size(),
+                   sizeof(Vertex), true, getChunkSize());
+  uploadStaged(frames_[0].vertices, vertex_data);
+}
+
+void Renderer::setScene(const DynamicVertexData &vertex_data) {
+  assert(dynamic_);
+  num_vertices_ = vertex_data.size();
+  createFlags();
+  frames_[0].vertices =
+      VertexChunks(*device_, physical_device_, vertex_data.size(),
+                   sizeof(DynamicVertex), true, getChunkSize());
+  uploadStaged(frames_[0].vertices, vertex_data);
+}
+
+size_t Renderer::getChunkSize() const {
+  // Indices address all vertices, so indexed scenes keep a single chunk
+  if (indices_.getNumIndices())
+    return std::max<size_t>(num_vertices_, 1);
+  return VertexChunks::ChunkSize;
+}
+
+Renderer::~Renderer() {
+  device_->waitIdle();
+  try {
+    savePipelineCache();
+  } catch (const std::exception &e) {
+    std::cerr << "can not save pipeline cache: " << e.what() << std::endl;
+  }
+}
+
+void Renderer::createContext(const std::string &app_name) {
+  start_time_ = Clock::now();
+  if (!window_ && !options_.offscreen)
+    throw std::runtime_error("offscreen rendering needs an image size");
+  createInstance(app_name);
 #ifndef NDEBUG
   createDebugCallback();
 #endif
-  surface_ = window.createSurface(*instance_);
+  if (window_)
+    surface_ = window_->createSurface(*instance_);
   selectPhysicalDevice();
   createDevice();
   createQueues();
   createCommandPool();
-  createSemaphores();
-  createSwapchain(window.getExtent());
-  scene_ = std::move(VertexBuffer(*device_, physical_device_, num_vertices));
-  camera_buffers_.reserve(image_count_);
-  for (unsigned i = 0; i < image_count_; ++i)
-    camera_buffers_.emplace_back(*device_, physical_device_);
+  // Swapchain of a window is created by the first draw, as its size can be
+  // queried only on the main thread
+  if (window_) {
+    format_ = vk::Format::eB8G8R8A8Unorm;
+    color_space_ = vk::ColorSpaceKHR::eSrgbNonlinear;
+  } else
+    createColorImage(*options_.offscreen);
+}
+
+void Renderer::createResources() {
+  palette_ = PaletteBuffer(*device_, physical_device_);
+  palette_.upload(PaletteData{
+      {glm::vec4{0.f, 0.f, 1.f, 1.f}, glm::vec4{1.f, 0.f, 0.f, 1.f},
+       glm::vec4{1.f, 1.f, 0.f, 1.f}}});
+  createFrames();
   createDescriptors();
-  createDepthResources();
   createRenderPass();
+  auto pipeline_start = Clock::now();
+  createPipelineCache();
   createPipeline();
-  createFramebuffers();
-  createCommandBuffers();
-  recordCommandBuffers();
-};
+  auto pipeline_end = Clock::now();
+  if (!window_) {
+    createDepthResources();
+    createFramebuffers();
+  }
+  std::cerr << "Renderer startup: "
+            << getSeconds(start_time_, Clock::now()) * 1e3
+            << " ms, pipeline: "
+            << getSeconds(pipeline_start, pipeline_end) * 1e3 << " ms\n";
+}
 
-void Renderer::resize(const Window &window) {
+void Renderer::resize() {
+  if (!window_)
+    return;
+  auto start = Clock::now();
+  // Viewport and scissor are dynamic and the formats do not change, so the
+  // render pass and pipeline are kept
   device_->waitIdle();
   depth_image_view_.reset();
   depth_image_.reset();
   depth_image_mem_.reset();
   framebuffers_.clear();
-  command_buffers_.clear();
-  pipeline_.reset();
-  pipeline_layout_.reset();
-  render_pass_.reset();
   swapchain_image_views_.clear();
   swapchain_images_.clear();
   swapchain_.reset();
 
-  createSwapchain(window.getExtent());
+  createSwapchain(window_->getExtent());
   createDepthResources();
-  createRenderPass();
-  createPipeline();
   createFramebuffers();
-  createCommandBuffers();
-  recordCommandBuffers();
+  std::cerr << "Renderer resize to " << extent_.width << "x" << extent_.height
+            << ": " << getSeconds(start, Clock::now()) * 1e3 << " ms
+";
+}
+
+DrawTimings Renderer::draw(const VertexData &vertex_data,
+                           const CameraData &camera_data) {
+  return drawScene(&vertex_data, nullptr, camera_data);
 }
 
-void Renderer::draw(const Window &window, const VertexData &vertex_data,
-                    const CameraData &camera_data) {
-  auto image_index = device_->acquireNextImageKHR(
-      *swapchain_, std::numeric_limits<uint64_t>::max(),
-      *image_available_semaphore_, {});
-  if (image_index.result == vk::Result::eErrorOutOfDateKHR) {
-    resize(window);
+DrawTimings Renderer::draw(const FlagData &flag_data,
+                           const CameraData &camera_data) {
+  return drawScene(nullptr, &flag_data, camera_data);
+}
+
+DrawTimings Renderer::draw(const CameraData &camera_data) {
+  return drawScene(nullptr, nullptr, camera_data);
+}
+
+DrawTimings Renderer::draw(const CameraData &camera_data,
+                           const VertexRanges &ranges) {
+  return drawScene(nullptr, nullptr, camera_data, &ranges);
+}
+
+void Renderer::finish() {
+  device_->waitIdle();
+  // Next frame slot holds the oldest image
+  for (size_t i = 0; i < frames_.size(); ++i)
+    deliverImage(frames_[(frame_ + i) % frames_.size()]);
+}
+
+void Renderer::deliverImage(Frame &frame) {
+  if (!frame.has_image)
     return;
+  frame.has_image = false;
+  if (image_callback_)
+    image_callback_(
+        Image{extent_.width, extent_.height,
+              static_cast<const uint8_t *>(frame.readback.getMapped())});
+}
+
+void Renderer::waitVertexBuffer(size_t frame) {
+  for (const auto &other : frames_)
+    if (other.vertex_source == frame)
+      (void)device_->waitForFences(*other.fence, true,
+                                   std::numeric_limits<uint64_t>::max());
+}
+
+DrawTimings Renderer::drawScene(const VertexData *vertex_data,
+                                const FlagData *flag_data,
+                                const CameraData &camera_data,
+                                const VertexRanges *ranges) {
+  DrawTimings timings;
+  auto start = Clock::now();
+  if (window_ && !swapchain_)
+    resize();
+  auto &frame = frames_[frame_];
+  (void)device_->waitForFences(*frame.fence, true,
+                               std::numeric_limits<uint64_t>::max());
+  deliverImage(frame);
+  if (vertex_data)
+    waitVertexBuffer(frame_);
+  auto waited = Clock::now();
+  timings.wait = getSeconds(start, waited);
+
+  // Scene is uploaded even if the frame is skipped, as it may not be passed
+  // again
+  if (vertex_data) {
+    if (!frame.vertices.getNumVertices())
+      frame.vertices =
+          VertexChunks(*device_, physical_device_, num_vertices_,
+                       sizeof(Vertex), false, getChunkSize());
+    frame.vertices.upload(*vertex_data);
+    latest_vertices_ = frame_;
+  }
+  if (flag_data) {
+    frame.flags.update(*flag_data);
+    latest_flags_ = frame_;
+  } else if (dynamic_ && latest_flags_ != frame_) {
+    frame.flags.update(frames_[latest_flags_].flags.getData());
+    latest_flags_ = frame_;
+  }
+  frame.vertex_source = latest_vertices_;
+  frame.culled = ranges && !dynamic_ && !indices_.getNumIndices();
+  if (frame.culled)
+    writeDrawCommands(frame, *ranges);
+
+  // Offscreen frames share the only image, the render pass dependency
+  // orders them
+  uint32_t image_index = 0;
+  if (window_) {
+    auto acquired = device_->acquireNextImageKHR(
+        *swapchain_, std::numeric_limits<uint64_t>::max(),
+        *frame.image_available, {});
+    if (acquired.result == vk::Result::eErrorOutOfDateKHR) {
+      resize();
+      return timings;
+    }
+    image_index = acquired.value;
+    // Swapchain may return images out of order, the frame that drew the
+    // image last has to finish
+    auto &image_fence = image_fences_[image_index];
+    if (image_fence)
+      (void)device_->waitForFences(image_fence, true,
+                                   std::numeric_limits<uint64_t>::max());
+    image_fence = *frame.fence;
   }
 
-  scene_.upload(*device_, vertex_data);
-  camera_buffers_[image_index.value].upload(*device_, camera_data);
+  // Triangles of indexed scenes are not numbered by the vertex shader
+  auto camera = camera_data;
+  if (indices_.getNumIndices())
+    camera.selected = std::numeric_limits<uint32_t>::max();
+  cameras_.write(frame_, camera);
+  auto uploaded = Clock::now();
+  timings.upload = getSeconds(waited, uploaded);
 
+  recordCommandBuffer(frame, image_index);
   vk::PipelineStageFlags wait_stage_mask =
       vk::PipelineStageFlagBits::eColorAttachmentOutput;
 
-  auto submit_info = vk::SubmitInfo{1,
-                                    &*image_available_semaphore_,
+  // Nothing to acquire or present offscreen
+  uint32_t num_semaphores = window_ ? 1 : 0;
+  auto submit_info = vk::SubmitInfo{num_semaphores,
+                                    &*frame.image_available,
                                     &wait_stage_mask,
                                     1,
-                                    &*command_buffers_[image_index.value],
-                                    1,
-                                    &*render_finished_semaphore_};
-
-  graphics_queue_.submit(submit_info, {});
-
-  auto present_info = vk::PresentInfoKHR{1, &*render_finished_semaphore_, 1,
-                                         &*swapchain_, &image_index.value};
-  auto result = present_queue_.presentKHR(&present_info);
-  if (result == vk::Result::eErrorOutOfDateKHR) {
-    resize(window);
-    return;
+                                    &*frame.command_buffer,
+                                    num_semaphores,
+                                    &*frame.render_finished};
+
+  device_->resetFences(*frame.fence);
+  graphics_queue_.submit(submit_info, *frame.fence);
+  frame.has_image = !window_;
+  auto submitted = Clock::now();
+  timings.submit = getSeconds(uploaded, submitted);
+  frame_ = (frame_ + 1) % frames_.size();
+
+  if (window_) {
+    auto present_info = vk::PresentInfoKHR{1, &*frame.render_finished, 1,
+                                           &*swapchain_, &image_index};
+    auto result = present_queue_.presentKHR(&present_info);
+    if (result == vk::Result::eErrorOutOfDateKHR) {
+      resize();
+      return timings;
+    }
   }
 
-  device_->waitIdle();
+  if (!options_.frames_in_flight) {
+    (void)device_->waitForFences(*frame.fence, true,
+                                 std::numeric_limits<uint64_t>::max());
+    deliverImage(frame);
+  }
+  timings.present = getSeconds(submitted, Clock::now());
+  return timings;
 }
 
-void Renderer::createInstance(const Window &window,
-                              const std::string &app_name) {
+void Renderer::createInstance(const std::string &app_name) {
   vk::ApplicationInfo app_info(app_name.c_str(), VK_MAKE_VERSION(1, 0, 0),
                                "No engine", VK_MAKE_VERSION(1, 0, 0),
                                VK_API_VERSION_1_1);
   auto layers = getValidationLayers();
-  auto extensions = getInstanceExtensions(window);
+  auto extensions = getInstanceExtensions();
   vk::InstanceCreateInfo create_info({}, &app_info, layers, extensions);
-  VULKAN_HPP_DEFAULT_DISPATCHER.init(glfwGetInstanceProcAddress);
+  VULKAN_HPP_DEFAULT_DISPATCHER.init(
+      loader_.getProcAddress<PFN_vkGetInstanceProcAddr>(
+          "vkGetInstanceProcAddr"));
   instance_ = vk::createInstanceUnique(create_info);
   VULKAN_HPP_DEFAULT_DISPATCHER.init(*instance_);
 }
@@ -162,11 +411,14 @@ void Renderer::createDevice() {
                      return qfp.queueFlags & vk::QueueFlagBits::eGraphics;
                    })));
 
-  present_queue_family_index_ = 0;
-  for (size_t i = 0; i < queue_family_properties.size(); i++)
-    if (physical_device_.getSurfaceSupportKHR(static_cast<uint32_t>(i),
-                                              surface_.get()))
-      present_queue_family_index_ = static_cast<uint32_t>(i);
+  present_queue_family_index_ = graphics_queue_family_index_;
+  if (surface_) {
+    present_queue_family_index_ = 0;
+    for (size_t i = 0; i < queue_family_properties.size(); i++)
+      if (physical_device_.getSurfaceSupportKHR(static_cast<uint32_t>(i),
+                                                surface_.get()))
+        present_queue_family_index_ = static_cast<uint32_t>(i);
+  }
 
   std::set<uint32_t> unique_queue_family_indices = {
       graphics_queue_family_index_, present_queue_family_index_};
@@ -181,9 +433,13 @@ void Renderer::createDevice() {
     queue_create_info.emplace_back(vk::DeviceQueueCreateFlags(),
                                    queue_family_index, 1, &queue_priority);
   auto extensions = getDeviceExtensions();
+  vk::PhysicalDeviceFeatures features;
+  features.multiDrawIndirect =
+      physical_device_.getFeatures().multiDrawIndirect;
+  multi_draw_indirect_ = features.multiDrawIndirect;
 
-  device_ = physical_device_.createDeviceUnique(
-      vk::DeviceCreateInfo({}, queue_create_info, {}, extensions));
+  device_ = physical_device_.createDeviceUnique(vk::DeviceCreateInfo(
+      {}, queue_create_info, {}, extensions, &features));
 }
 
 void Renderer::createQueues() {
@@ -195,19 +451,24 @@ void Renderer::createSwapchain(vk::Extent2D extent) {
   auto capabilities = physical_device_.getSurfaceCapabilitiesKHR(*surface_);
   auto formats = physical_device_.getSurfaceFormatsKHR(*surface_);
 
-  constexpr vk::SurfaceFormatKHR default_format{
-      vk::Format::eB8G8R8A8Unorm, vk::ColorSpaceKHR::eSrgbNonlinear};
+  // Format is chosen before the render pass, see createContext
+  vk::SurfaceFormatKHR default_format{format_, color_space_};
   if (std::none_of(formats.begin(), formats.end(),
                    [default_format](const auto &surface_format) {
                      return surface_format == default_format;
                    }))
     throw std::runtime_error("Can not find B9G8R8A8Unorm surface format");
-  format_ = default_format.format;
-  color_space_ = default_format.colorSpace;
 
   extent_ = extent;
   image_count_ = capabilities.minImageCount + 1;
 
+  // FIFO is the only mode every implementation has to support
+  auto present_modes = physical_device_.getSurfacePresentModesKHR(*surface_);
+  auto present_mode = vk::PresentModeKHR::eFifo;
+  if (std::find(present_modes.begin(), present_modes.end(),
+                options_.present_mode) != present_modes.end())
+    present_mode = options_.present_mode;
+
   struct SM {
     vk::SharingMode sharing_mode;
     std::vector<uint32_t> family_indices;
@@ -222,12 +483,12 @@ void Renderer::createSwapchain(vk::Extent2D extent) {
       vk::ImageUsageFlagBits::eColorAttachment, sharingModeUtil.sharing_mode,
       sharingModeUtil.family_indices,
       vk::SurfaceTransformFlagBitsKHR::eIdentity,
-      vk::CompositeAlphaFlagBitsKHR::eOpaque, vk::PresentModeKHR::eFifo, true,
-      nullptr);
+      vk::CompositeAlphaFlagBitsKHR::eOpaque, present_mode, true, nullptr);
 
   swapchain_ = device_->createSwapchainKHRUnique(swapchain_create_info);
 
   swapchain_images_ = device_->getSwapchainImagesKHR(swapchain_.get());
+  image_fences_.assign(swapchain_images_.size(), vk::Fence{});
 
   swapchain_image_views_.reserve(swapchain_images_.size());
   for (auto image : swapchain_images_) {
@@ -242,33 +503,93 @@ void Renderer::createSwapchain(vk::Extent2D extent) {
   }
 }
 
+void Renderer::createColorImage(vk::Extent2D extent) {
+  format_ = vk::Format::eR8G8B8A8Unorm;
+  extent_ = extent;
+  image_count_ = 1;
+  auto image_info =
+      vk::ImageCreateInfo{{},
+                          vk::ImageType::e2D,
+                          format_,
+                          vk::Extent3D{extent_.width, extent_.height, 1},
+                          1,
+                          1,
+                          vk::SampleCountFlagBits::e1,
+                          vk::ImageTiling::eOptimal,
+                          vk::ImageUsageFlagBits::eColorAttachment |
+                              vk::ImageUsageFlagBits::eTransferSrc,
+                          vk::SharingMode::eExclusive,
+                          0,
+                          nullptr,
+                          vk::ImageLayout::eUndefined};
+  color_image_ = device_->createImageUnique(image_info, nullptr);
+  auto memory_properties = physical_device_.getMemoryProperties();
+  auto memory_requirements = device_->getImageMemoryRequirements(*color_image_);
+  auto memory_index =
+      findMemoryTypeIndex(memory_properties, memory_requirements,
+                          vk::MemoryPropertyFlagBits::eDeviceLocal);
+  color_image_mem_ = device_->allocateMemoryUnique(
+      vk::MemoryAllocateInfo{memory_requirements.size, memory_index});
+  device_->bindImageMemory(*color_image_, *color_image_mem_, 0);
+  image_fences_.assign(1, vk::Fence{});
+  swapchain_image_views_.push_back(
+      device_->createImageViewUnique(vk::ImageViewCreateInfo{
+          {},
+          *color_image_,
+          vk::ImageViewType::e2D,
+          format_,
+          {},
+          {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}}));
+}
+
 void Renderer::createDescriptors() {
-  auto pool_size =
-      vk::DescriptorPoolSize{vk::DescriptorType::eUniformBuffer, image_count_};
+  auto num_frames = static_cast<uint32_t>(frames_.size());
+  std::vector<vk::DescriptorPoolSize> pool_sizes = {
+      {vk::DescriptorType::eUniformBuffer, 2 * num_frames}};
+  std::vector<vk::DescriptorSetLayoutBinding> bindings = {
+      {0, vk::DescriptorType::eUniformBuffer, 1,
+       vk::ShaderStageFlagBits::eVertex},
+      {2, vk::DescriptorType::eUniformBuffer, 1,
+       vk::ShaderStageFlagBits::eVertex}};
+  // Dynamic triangles also read collision flags
+  if (dynamic_) {
+    pool_sizes.emplace_back(vk::DescriptorType::eStorageBuffer, num_frames);
+    bindings.emplace_back(1, vk::DescriptorType::eStorageBuffer, 1,
+                          vk::ShaderStageFlagBits::eVertex);
+  }
   descriptor_pool_ = device_->createDescriptorPoolUnique(
-      {{}, image_count_, 1, &pool_size}, nullptr);
-  vk::DescriptorSetLayoutBinding ubo_layout_binding{
-      0, vk::DescriptorType::eUniformBuffer, 1,
-      vk::ShaderStageFlagBits::eVertex};
+      {{}, num_frames, pool_sizes}, nullptr);
   descriptor_set_layout_ =
-      device_->createDescriptorSetLayoutUnique({{}, 1, &ubo_layout_binding});
-  std::vector<vk::DescriptorSetLayout> layouts(image_count_,
+      device_->createDescriptorSetLayoutUnique({{}, bindings});
+  std::vector<vk::DescriptorSetLayout> layouts(num_frames,
                                                *descriptor_set_layout_);
-  descriptor_sets_ =
+  auto descriptor_sets =
       device_->allocateDescriptorSets({*descriptor_pool_, layouts});
-  for (unsigned i = 0; i < image_count_; ++i) {
-    auto buffer_info = vk::DescriptorBufferInfo{camera_buffers_[i].get(), 0,
-                                                sizeof(CameraData)};
-    auto descriptor_write =
-        vk::WriteDescriptorSet{descriptor_sets_[i],
+  for (size_t i = 0; i < frames_.size(); ++i) {
+    auto &frame = frames_[i];
+    frame.descriptor_set = descriptor_sets[i];
+    auto buffer_info = cameras_.getDescriptorInfo(i);
+    auto palette_buffer_info = vk::DescriptorBufferInfo{palette_.get(), 0,
+                                                        sizeof(PaletteData)};
+    std::vector<vk::WriteDescriptorSet> descriptor_writes = {
+        vk::WriteDescriptorSet{frame.descriptor_set,
                                0,
                                0,
                                1,
                                vk::DescriptorType::eUniformBuffer,
                                nullptr,
                                &buffer_info,
-                               nullptr};
-    device_->updateDescriptorSets(1, &descriptor_write, 0, nullptr);
+                               nullptr},
+        vk::WriteDescriptorSet{frame.descriptor_set,
+                               2,
+                               0,
+                               1,
+                               vk::DescriptorType::eUniformBuffer,
+                               nullptr,
+                               &palette_buffer_info,
+                               nullptr}};
+    // Collision flags are written by createFlags
+    device_->updateDescriptorSets(descriptor_writes, nullptr);
   }
 }
 
@@ -282,7 +603,8 @@ void Renderer::createRenderPass() {
                                 {},
                                 {},
                                 {},
-                                vk::ImageLayout::ePresentSrcKHR};
+                                window_ ? vk::ImageLayout::ePresentSrcKHR
+                                        : vk::ImageLayout::eTransferSrcOptimal};
 
   auto color_attachment_ref =
       vk::AttachmentReference{0, vk::ImageLayout::eColorAttachmentOptimal};
@@ -310,29 +632,98 @@ void Renderer::createRenderPass() {
                                          nullptr,
                                          &depth_attachment_ref}};
 
-  auto subpass_dependency = {
-      vk::SubpassDependency{VK_SUBPASS_EXTERNAL,
-                            0,
-                            vk::PipelineStageFlagBits::eColorAttachmentOutput,
-                            vk::PipelineStageFlagBits::eColorAttachmentOutput,
-                            {},
-                            vk::AccessFlagBits::eColorAttachmentRead |
-                                vk::AccessFlagBits::eColorAttachmentWrite}};
+  // Frames in flight share the depth image, so its clear waits for the
+  // depth writes of the previous frame. Offscreen frames also share the
+  // color image, which waits for the copy of the previous frame.
+  vk::PipelineStageFlags src_stages =
+      vk::PipelineStageFlagBits::eColorAttachmentOutput |
+      vk::PipelineStageFlagBits::eLateFragmentTests;
+  if (!window_)
+    src_stages |= vk::PipelineStageFlagBits::eTransfer;
+  std::vector<vk::SubpassDependency> subpass_dependencies = {
+      vk::SubpassDependency{
+          VK_SUBPASS_EXTERNAL, 0, src_stages,
+          vk::PipelineStageFlagBits::eColorAttachmentOutput |
+              vk::PipelineStageFlagBits::eEarlyFragmentTests,
+          vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+          vk::AccessFlagBits::eColorAttachmentRead |
+              vk::AccessFlagBits::eColorAttachmentWrite |
+              vk::AccessFlagBits::eDepthStencilAttachmentWrite}};
+  // Copy of the offscreen image waits for the color writes
+  if (!window_)
+    subpass_dependencies.emplace_back(
+        0, VK_SUBPASS_EXTERNAL,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::AccessFlagBits::eColorAttachmentWrite,
+        vk::AccessFlagBits::eTransferRead);
   std::array<vk::AttachmentDescription, 2> attachments = {color_attachment,
                                                           depth_attachment};
   render_pass_ = device_->createRenderPassUnique(
-      vk::RenderPassCreateInfo{{}, attachments, subpass, subpass_dependency});
+      vk::RenderPassCreateInfo{{}, attachments, subpass, subpass_dependencies});
+}
+
+std::string Renderer::getPipelineCachePath() const {
+  auto directory = getCacheDirectory();
+  if (!options_.pipeline_cache || directory.empty())
+    return {};
+  auto properties = physical_device_.getProperties();
+  std::ostringstream name;
+  name << std::hex << std::setfill('0') << "pipeline-" << std::setw(4)
+       << properties.vendorID << '-' << std::setw(4) << properties.deviceID
+       << '-' << std::setw(8) << properties.driverVersion << '-'
+       << std::setw(16) << getShaderHash() << ".bin";
+  return (directory / name.str()).string();
+}
+
+void Renderer::createPipelineCache() {
+  pipeline_cache_path_ = getPipelineCachePath();
+  std::vector<char> data;
+  if (!pipeline_cache_path_.empty()) {
+    std::ifstream is(pipeline_cache_path_, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(is),
+                std::istreambuf_iterator<char>());
+  }
+  // Header is checked as well, as not every driver rejects foreign data:
+  // length, version, vendor ID, device ID and cache UUID
+  auto properties = physical_device_.getProperties();
+  uint32_t header[4];
+  if (data.size() < sizeof(header) + VK_UUID_SIZE)
+    data.clear();
+  else {
+    memcpy(header, data.data(), sizeof(header));
+    if (header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+        header[2] != properties.vendorID || header[3] != properties.deviceID ||
+        memcmp(data.data() + sizeof(header),
+               properties.pipelineCacheUUID.data(), VK_UUID_SIZE))
+      data.clear();
+  }
+  pipeline_cache_ = device_->createPipelineCacheUnique(
+      vk::PipelineCacheCreateInfo{{}, data.size(), data.data()});
+}
+
+void Renderer::savePipelineCache() const {
+  if (pipeline_cache_path_.empty())
+    return;
+  auto data = device_->getPipelineCacheData(*pipeline_cache_);
+  std::filesystem::path path(pipeline_cache_path_);
+  std::filesystem::create_directories(path.parent_path());
+  // Renamed into place, so other instances never read a partial file
+  auto temporary = path;
+  temporary += ".tmp";
+  {
+    std::ofstream os(temporary, std::ios::binary);
+    os.write(reinterpret_cast<const char *>(data.data()), data.size());
+    if (!os)
+      throw std::runtime_error("can not write " + temporary.string());
+  }
+  std::filesystem::rename(temporary, path);
 }
 
 void Renderer::createPipeline() {
-  std::vector<uint32_t> vert_code =
-#include "shader.vert.inc"
-      ;
-  std::vector<uint32_t> frag_code =
-#include "shader.frag.inc"
-      ;
+  const auto &vertex_code = dynamic_ ? dynamic_vert_code : vert_code;
   auto vert_module = device_->createShaderModuleUnique(
-      {{}, vert_code.size() * sizeof(uint32_t), vert_code.data()});
+      {{}, vertex_code.size() * sizeof(uint32_t), vertex_code.data()});
   auto frag_module = device_->createShaderModuleUnique(
       {{}, frag_code.size() * sizeof(uint32_t), frag_code.data()});
   auto vert_shader_stage_info = vk::PipelineShaderStageCreateInfo{
@@ -345,7 +736,15 @@ void Renderer::createPipeline() {
       vert_shader_stage_info, frag_shader_stage_info};
 
   auto binding_description = Vertex::getBindingDescription();
-  auto attribute_descriptions = Vertex::getAttributeDescriptions();
+  std::vector<vk::VertexInputAttributeDescription> attribute_descriptions;
+  if (dynamic_) {
+    binding_description = DynamicVertex::getBindingDescription();
+    auto descriptions = DynamicVertex::getAttributeDescriptions();
+    attribute_descriptions.assign(descriptions.begin(), descriptions.end());
+  } else {
+    auto descriptions = Vertex::getAttributeDescriptions();
+    attribute_descriptions.assign(descriptions.begin(), descriptions.end());
+  }
   auto vertex_input_info =
       vk::PipelineVertexInputStateCreateInfo{{},
                                              1,
@@ -356,17 +755,13 @@ void Renderer::createPipeline() {
   auto input_assembly = vk::PipelineInputAssemblyStateCreateInfo{
       {}, vk::PrimitiveTopology::eTriangleList, false};
 
-  auto viewport = vk::Viewport{0.0f,
-                               0.0f,
-                               static_cast<float>(extent_.width),
-                               static_cast<float>(extent_.height),
-                               0.0f,
-                               1.0f};
-
-  auto scissor = vk::Rect2D{{0, 0}, extent_};
-
+  // Viewport and scissor are set with the commands, so the pipeline does not
+  // depend on the extent
   auto viewport_state =
-      vk::PipelineViewportStateCreateInfo{{}, 1, &viewport, 1, &scissor};
+      vk::PipelineViewportStateCreateInfo{{}, 1, nullptr, 1, nullptr};
+  std::array<vk::DynamicState, 2> dynamic_states = {
+      vk::DynamicState::eViewport, vk::DynamicState::eScissor};
+  auto dynamic_state = vk::PipelineDynamicStateCreateInfo{{}, dynamic_states};
 
   auto rasterizer = vk::PipelineRasterizationStateCreateInfo{
       {},    false,
@@ -396,8 +791,13 @@ void Renderer::createPipeline() {
   auto color_blending = vk::PipelineColorBlendStateCreateInfo{
       {}, false, vk::LogicOp::eCopy, 1, &color_blend_attachment};
 
+  // First triangle of the drawn chunk, for collision flags and the selected
+  // triangle
+  auto push_constant_range =
+      vk::PushConstantRange{vk::ShaderStageFlagBits::eVertex, 0,
+                            sizeof(uint32_t)};
   pipeline_layout_ = device_->createPipelineLayoutUnique(
-      {{}, 1, &*descriptor_set_layout_}, nullptr);
+      {{}, 1, &*descriptor_set_layout_, 1, &push_constant_range}, nullptr);
 
   auto pipeline_create_info =
       vk::GraphicsPipelineCreateInfo{{},
@@ -410,16 +810,17 @@ void Renderer::createPipeline() {
                                      &multisampling,
                                      &depth_stencil,
                                      &color_blending,
-                                     nullptr,
+                                     &dynamic_state,
                                      *pipeline_layout_,
                                      *render_pass_,
                                      0};
   pipeline_ =
-      device_->createGraphicsPipelineUnique({}, pipeline_create_info).value;
+      device_->createGraphicsPipelineUnique(*pipeline_cache_,
+                                            pipeline_create_info)
+          .value;
 }
 
 void Renderer::createDepthResources() {
-  depth_format_ = vk::Format::eD32Sfloat;
   auto image_info =
       vk::ImageCreateInfo{{},
                           vk::ImageType::e2D,
@@ -465,57 +866,208 @@ void Renderer::createFramebuffers() {
 }
 
 void Renderer::createCommandPool() {
+  // Command buffers are recorded again every frame
   command_pool_ = device_->createCommandPoolUnique(
-      {{}, static_cast<uint32_t>(graphics_queue_family_index_)});
+      {vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+       static_cast<uint32_t>(graphics_queue_family_index_)});
 }
 
-void Renderer::createCommandBuffers() {
-  command_buffers_ =
+void Renderer::createFrames() {
+  frames_.resize(std::max(options_.frames_in_flight, 1u));
+  cameras_ =
+      UniformRing<CameraData>(*device_, physical_device_, frames_.size());
+  auto command_buffers =
       device_->allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(
           command_pool_.get(), vk::CommandBufferLevel::ePrimary,
-          static_cast<uint32_t>(framebuffers_.size())));
-}
-
-void Renderer::recordCommandBuffers() {
-  for (size_t i = 0; i < command_buffers_.size(); i++) {
-
-    auto begin_info = vk::CommandBufferBeginInfo{};
-    command_buffers_[i]->begin(begin_info);
-    auto color_clear_value =
-        vk::ClearColorValue{std::array<float, 4>{0.0f, 0.0f, 0.f, 1.f}};
-    auto depth_clear_value = vk::ClearDepthStencilValue{1.f, 0};
-    std::array<vk::ClearValue, 2> clear_values{color_clear_value,
-                                               depth_clear_value};
-    auto render_pass_begin_info =
-        vk::RenderPassBeginInfo{*render_pass_, *framebuffers_[i],
-                                vk::Rect2D{{0, 0}, extent_}, clear_values};
-
-    command_buffers_[i]->beginRenderPass(render_pass_begin_info,
-                                         vk::SubpassContents::eInline);
-    command_buffers_[i]->bindPipeline(vk::PipelineBindPoint::eGraphics,
-                                      *pipeline_);
-    command_buffers_[i]->bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
-                                            *pipeline_layout_, 0, 1,
-                                            &descriptor_sets_[i], 0, nullptr);
-    vk::Buffer vertex_buffers[] = {scene_.get()};
-    vk::DeviceSize offsets[] = {0};
-    command_buffers_[i]->bindVertexBuffers(0, 1, vertex_buffers, offsets);
-    command_buffers_[i]->draw(scene_.getNumVertices(), 1, 0, 0);
-    command_buffers_[i]->endRenderPass();
-    command_buffers_[i]->end();
+          static_cast<uint32_t>(frames_.size())));
+  for (size_t i = 0; i < frames_.size(); ++i) {
+    auto &frame = frames_[i];
+    // Signaled, as the first wait has nothing to wait for
+    frame.fence = device_->createFenceUnique(
+        vk::FenceCreateInfo{vk::FenceCreateFlagBits::eSignaled});
+    frame.image_available =
+        device_->createSemaphoreUnique(vk::SemaphoreCreateInfo{});
+    frame.render_finished =
+        device_->createSemaphoreUnique(vk::SemaphoreCreateInfo{});
+    frame.command_buffer = std::move(command_buffers[i]);
+    if (!window_)
+      frame.readback =
+          Buffer(*device_, physical_device_,
+                 size_t{extent_.width} * extent_.height * 4,
+                 vk::BufferUsageFlagBits::eTransferDst,
+                 vk::MemoryPropertyFlagBits::eHostVisible |
+                     vk::MemoryPropertyFlagBits::eHostCoherent);
   }
 }
 
-void Renderer::createSemaphores() {
-  image_available_semaphore_ =
-      device_->createSemaphoreUnique(vk::SemaphoreCreateInfo{});
-  render_finished_semaphore_ =
-      device_->createSemaphoreUnique(vk::SemaphoreCreateInfo{});
+void Renderer::createFlags() {
+  for (auto &frame : frames_) {
+    frame.flags = FlagBuffer(*device_, physical_device_, num_vertices_ / 3);
+    frame.flags.update(FlagData(frame.flags.getNumWords()));
+    auto flag_buffer_info =
+        vk::DescriptorBufferInfo{frame.flags.get(), 0, VK_WHOLE_SIZE};
+    device_->updateDescriptorSets(
+        vk::WriteDescriptorSet{frame.descriptor_set, 1, 0, 1,
+                               vk::DescriptorType::eStorageBuffer, nullptr,
+                               &flag_buffer_info, nullptr},
+        nullptr);
+  }
+}
+
+void Renderer::createIndices(const IndexData &index_data) {
+  if (index_data.empty())
+    return;
+  indices_ = IndexBuffer(*device_, physical_device_, index_data.size());
+  uploadStaged(indices_, index_data);
+}
+
+void Renderer::uploadStaged(const Buffer &buffer, const void *data,
+                            size_t size) {
+  Buffer staging(*device_, physical_device_, size,
+                 vk::BufferUsageFlagBits::eTransferSrc,
+                 vk::MemoryPropertyFlagBits::eHostVisible |
+                     vk::MemoryPropertyFlagBits::eHostCoherent);
+  memcpy(staging.getMapped(), data, size);
+  auto command_buffers =
+      device_->allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(
+          command_pool_.get(), vk::CommandBufferLevel::ePrimary, 1));
+  auto &command_buffer = command_buffers[0];
+  command_buffer->begin(vk::CommandBufferBeginInfo{
+      vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  command_buffer->copyBuffer(staging.get(), buffer.get(),
+                             vk::BufferCopy{0, 0, size});
+  command_buffer->end();
+  graphics_queue_.submit(vk::SubmitInfo{0, nullptr, nullptr, 1,
+                                        &*command_buffer},
+                         {});
+  // Only at startup, so there is nothing to overlap with
+  graphics_queue_.waitIdle();
+}
+
+void Renderer::writeDrawCommands(Frame &frame, const VertexRanges &ranges) {
+  const auto &vertices = frames_[frame.vertex_source].vertices;
+  size_t chunk_size = vertices.getChunkSize();
+  std::vector<vk::DrawIndirectCommand> commands;
+  frame.chunk_draws.assign(vertices.getChunks().size(), 0);
+  for (const auto &range : ranges) {
+    size_t first = range.first;
+    size_t end = std::min<size_t>(first + range.count,
+                                  vertices.getNumVertices());
+    while (first < end) {
+      size_t chunk = first / chunk_size;
+      size_t chunk_end = std::min(end, (chunk + 1) * chunk_size);
+      commands.push_back(vk::DrawIndirectCommand{
+          static_cast<uint32_t>(chunk_end - first), 1,
+          static_cast<uint32_t>(first - chunk * chunk_size), 0});
+      ++frame.chunk_draws[chunk];
+      first = chunk_end;
+    }
+  }
+  if (commands.size() > frame.indirect_capacity) {
+    frame.indirect_capacity =
+        std::max(commands.size(), frame.indirect_capacity * 2);
+    frame.indirect =
+        Buffer(*device_, physical_device_,
+               sizeof(vk::DrawIndirectCommand) * frame.indirect_capacity,
+               vk::BufferUsageFlagBits::eIndirectBuffer,
+               vk::MemoryPropertyFlagBits::eHostVisible |
+                   vk::MemoryPropertyFlagBits::eHostCoherent);
+  }
+  if (!commands.empty())
+    frame.indirect.upload(commands);
+}
+
+void Renderer::recordCommandBuffer(const Frame &frame, uint32_t image_index) {
+  const auto &command_buffer = frame.command_buffer;
+  command_buffer->reset();
+  command_buffer->begin(vk::CommandBufferBeginInfo{
+      vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  auto color_clear_value =
+      vk::ClearColorValue{std::array<float, 4>{0.0f, 0.0f, 0.f, 1.f}};
+  auto depth_clear_value = vk::ClearDepthStencilValue{1.f, 0};
+  std::array<vk::ClearValue, 2> clear_values{color_clear_value,
+                                             depth_clear_value};
+  auto render_pass_begin_info =
+      vk::RenderPassBeginInfo{*render_pass_, *framebuffers_[image_index],
+                              vk::Rect2D{{0, 0}, extent_}, clear_values};
+
+  command_buffer->beginRenderPass(render_pass_begin_info,
+                                  vk::SubpassContents::eInline);
+  const auto &vertices = frames_[frame.vertex_source].vertices;
+  if (vertices.getNumVertices()) {
+    command_buffer->bindPipeline(vk::PipelineBindPoint::eGraphics,
+                                 *pipeline_);
+    command_buffer->setViewport(
+        0, vk::Viewport{0.f, 0.f, static_cast<float>(extent_.width),
+                        static_cast<float>(extent_.height), 0.f, 1.f});
+    command_buffer->setScissor(0, vk::Rect2D{{0, 0}, extent_});
+    command_buffer->bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                       *pipeline_layout_, 0, 1,
+                                       &frame.descriptor_set, 0, nullptr);
+    if (indices_.getNumIndices()) {
+      uint32_t first_triangle = 0;
+      command_buffer->pushConstants(*pipeline_layout_,
+                                    vk::ShaderStageFlagBits::eVertex, 0,
+                                    sizeof(first_triangle), &first_triangle);
+      command_buffer->bindVertexBuffers(0, vertices.getChunks()[0].get(),
+                                        vk::DeviceSize{0});
+      command_buffer->bindIndexBuffer(indices_.get(), 0,
+                                      vk::IndexType::eUint32);
+      command_buffer->drawIndexed(indices_.getNumIndices(), 1, 0, 0, 0);
+    } else {
+      const auto &chunks = vertices.getChunks();
+      vk::DeviceSize command_offset = 0;
+      uint32_t stride = sizeof(vk::DrawIndirectCommand);
+      for (size_t i = 0; i < chunks.size(); ++i) {
+        if (frame.culled && !frame.chunk_draws[i])
+          continue;
+        auto first_triangle =
+            static_cast<uint32_t>(i * vertices.getChunkSize() / 3);
+        command_buffer->pushConstants(*pipeline_layout_,
+                                      vk::ShaderStageFlagBits::eVertex, 0,
+                                      sizeof(first_triangle), &first_triangle);
+        command_buffer->bindVertexBuffers(0, chunks[i].get(),
+                                          vk::DeviceSize{0});
+        if (!frame.culled)
+          command_buffer->draw(chunks[i].getNumVertices(), 1, 0, 0);
+        else if (multi_draw_indirect_)
+          command_buffer->drawIndirect(frame.indirect.get(), command_offset,
+                                       frame.chunk_draws[i], stride);
+        else
+          for (uint32_t j = 0; j < frame.chunk_draws[i]; ++j)
+            command_buffer->drawIndirect(frame.indirect.get(),
+                                         command_offset + j * stride, 1,
+                                         stride);
+        if (frame.culled)
+          command_offset += frame.chunk_draws[i] * stride;
+      }
+    }
+  }
+  command_buffer->endRenderPass();
+  if (!window_) {
+    command_buffer->copyImageToBuffer(
+        *color_image_, vk::ImageLayout::eTransferSrcOptimal,
+        frame.readback.get(),
+        vk::BufferImageCopy{0,
+                            0,
+                            0,
+                            {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+                            {0, 0, 0},
+                            {extent_.width, extent_.height, 1}});
+    // Makes the copy visible to the host after the fence
+    command_buffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost,
+        {},
+        vk::MemoryBarrier{vk::AccessFlagBits::eTransferWrite,
+                          vk::AccessFlagBits::eHostRead},
+        nullptr, nullptr);
+  }
+  command_buffer->end();
 }
 
-std::vector<const char *>
-Renderer::getInstanceExtensions(const Window &window) const {
-  auto extensions = window.getRequiredExtensions();
+std::vector<const char *> Renderer::getInstanceExtensions() const {
+  auto extensions =
+      window_ ? window_->getRequiredExtensions() : std::vector<const char *>{};
 #ifndef NDEBUG
   extensions.emplace_back("VK_EXT_debug_utils");
 #endif
@@ -531,6 +1083,8 @@ std::vector<const char *> Renderer::getValidationLayers() const {
 }
 
 std::vector<const char *> Renderer::getDeviceExtensions() const {
+  if (!window_)
+    return {};
   return std::vector<const char *>{VK_KHR_SWAPCHAIN_EXTENSION_NAME};
 }
 
@@ -1,7 +1,11 @@
 #ifndef RENDERER_HPP
 #define RENDERER_HPP
 
+#include "image.hpp"
 #include "scene.hpp"
+#include <chrono>
+#include <functional>
+#include <optional>
 #include <string>
 #include <vector>
 #include <vulkan/vulkan.hpp>
@@ -10,71 +14,218 @@ namespace render {
 
 class Window;
 
+// Seconds spent in the stages of Renderer::draw, wait is for a free frame in
+// flight and includes passing its offscreen image to the callback, present
+// includes waiting for the frame to finish only without frames in flight
+struct DrawTimings {
+  double wait = 0., upload = 0., submit = 0., present = 0.;
+};
+
+struct RenderOptions {
+  // Unsupported present mode falls back to FIFO
+  vk::PresentModeKHR present_mode = vk::PresentModeKHR::eFifo;
+  // Frames the GPU may still draw while the next one is recorded, each with
+  // its own buffers. Zero waits for every frame to finish before returning.
+  unsigned frames_in_flight = 2;
+  // Image size of renderers without a window
+  std::optional<vk::Extent2D> offscreen;
+  // Pipeline cache in $XDG_CACHE_HOME/triangles (~/.cache/triangles), keyed
+  // by device, driver and shaders, loaded at startup and saved at exit
+  bool pipeline_cache = true;
+};
+
+// Called with every finished offscreen frame, pixels are valid only during
+// the call
+using ImageCallback = std::function<void(const Image &)>;
+
+// Selects the pipeline: render::Vertex drawn as is, or DynamicVertex rotated
+// by the vertex shader
+enum class VertexFormat { Vertex, DynamicVertex };
+
+// Without a window frames are drawn into an offscreen image, which is copied
+// into a host-visible buffer of the frame in flight and passed to the image
+// callback once the frame slot is reused, so readback does not stall drawing
 class Renderer {
 public:
-  Renderer(const Window &window, const std::string &app_name,
-           size_t num_vertices);
-  void resize(const Window &window);
-  void draw(const Window &window, const VertexData &vertex_data,
-            const CameraData &camera_data);
+  // Creates everything except the scene buffers, so it can run on another
+  // thread while the scene is loaded. setScene has to be called before
+  // drawing; the swapchain of a window is created by the first draw.
+  Renderer(const Window *window, const std::string &app_name,
+           VertexFormat vertex_format,
+           const RenderOptions &options = RenderOptions{});
+  // Non-empty index data switches to indexed drawing of shared vertices,
+  // indices are uploaded once
+  Renderer(const Window *window, const std::string &app_name,
+           size_t num_vertices, const IndexData &index_data = IndexData{},
+           const RenderOptions &options = RenderOptions{});
+  // Static scene is uploaded once into device-local memory
+  Renderer(const Window *window, const std::string &app_name,
+           const VertexData &vertex_data,
+           const IndexData &index_data = IndexData{},
+           const RenderOptions &options = RenderOptions{});
+  // Dynamic triangles are rotated by the vertex shader, so their vertices are
+  // uploaded once and only collision flags are uploaded every frame
+  Renderer(const Window *window, const std::string &app_name,
+           const DynamicVertexData &vertex_data,
+           const RenderOptions &options = RenderOptions{});
+  ~Renderer();
+  // Scene setup of the constructors below, called once
+  void setScene(size_t num_vertices, const IndexData &index_data = {});
+  void setScene(const VertexData &vertex_data,
+                const IndexData &index_data = {});
+  void setScene(const DynamicVertexData &vertex_data);
+  void resize();
+  // Only for renderers constructed with the number of vertices
+  DrawTimings draw(const VertexData &vertex_data,
+                   const CameraData &camera_data);
+  DrawTimings draw(const FlagData &flag_data, const CameraData &camera_data);
+  // Redraws previously uploaded vertex data with a new camera
+  DrawTimings draw(const CameraData &camera_data);
+  // Draws only the ranges, sorted by first vertex, through indirect draw
+  // commands. Indexed scenes and dynamic triangles are drawn whole.
+  DrawTimings draw(const CameraData &camera_data, const VertexRanges &ranges);
+  void setImageCallback(ImageCallback callback) {
+    image_callback_ = std::move(callback);
+  }
+  // Waits for all frames and passes the remaining offscreen images to the
+  // callback
+  void finish();
   void waitIdle() const { device_->waitIdle(); }
 
 private:
+  // Loads Vulkan without GLFW, which needs a display
+  vk::DynamicLoader loader_;
+  // Null for offscreen rendering
+  const Window *window_;
   vk::UniqueInstance instance_;
 #ifndef NDEBUG
   vk::UniqueDebugUtilsMessengerEXT messenger_;
 #endif
   vk::UniqueSurfaceKHR surface_;
   vk::PhysicalDevice physical_device_;
+  // Draws of a chunk are issued by one command if supported
+  bool multi_draw_indirect_ = false;
   uint32_t graphics_queue_family_index_, present_queue_family_index_;
   vk::UniqueDevice device_;
   vk::Queue graphics_queue_, present_queue_;
   vk::UniqueCommandPool command_pool_;
-  vk::UniqueSemaphore image_available_semaphore_, render_finished_semaphore_;
 
   vk::Format format_;
   vk::ColorSpaceKHR color_space_;
   vk::Extent2D extent_;
+  RenderOptions options_;
   unsigned image_count_;
   vk::UniqueSwapchainKHR swapchain_;
   std::vector<vk::Image> swapchain_images_;
   std::vector<vk::UniqueImageView> swapchain_image_views_;
+  // Offscreen image, its view is the only swapchain image view
+  vk::UniqueImage color_image_;
+  vk::UniqueDeviceMemory color_image_mem_;
+  ImageCallback image_callback_;
 
-  VertexBuffer scene_;
-  std::vector<CameraBuffer> camera_buffers_;
+  bool dynamic_ = false;
+  size_t num_vertices_ = 0;
+  IndexBuffer indices_;
+  PaletteBuffer palette_;
 
   vk::UniqueDescriptorPool descriptor_pool_;
   vk::UniqueDescriptorSetLayout descriptor_set_layout_;
-  std::vector<vk::DescriptorSet> descriptor_sets_;
+
+  struct Frame {
+    vk::UniqueFence fence;
+    vk::UniqueSemaphore image_available, render_finished;
+    vk::UniqueCommandBuffer command_buffer;
+    FlagBuffer flags;
+    // Allocated with the first upload, static scenes and dynamic triangles
+    // use only the one of the first frame
+    VertexChunks vertices;
+    vk::DescriptorSet descriptor_set;
+    // Frame whose vertex buffer is drawn
+    size_t vertex_source = 0;
+    // Offscreen image copy, passed to the callback after the fence
+    Buffer readback;
+    bool has_image = false;
+    // Draw commands of the visible ranges, grown on demand
+    Buffer indirect;
+    size_t indirect_capacity = 0;
+    // Whether only the commands are drawn, and their number per chunk
+    bool culled = false;
+    std::vector<uint32_t> chunk_draws;
+  };
+  std::vector<Frame> frames_;
+  UniformRing<CameraData> cameras_;
+  size_t frame_ = 0;
+  // Frames with the latest vertices and collision flags, drawn again when
+  // no new ones are passed
+  size_t latest_vertices_ = 0, latest_flags_ = 0;
+  // Fences of the last frames drawn into swapchain images
+  std::vector<vk::Fence> image_fences_;
 
   vk::UniqueRenderPass render_pass_;
+  vk::UniquePipelineCache pipeline_cache_;
+  // Empty without a cache file
+  std::string pipeline_cache_path_;
   vk::UniquePipelineLayout pipeline_layout_;
   vk::UniquePipeline pipeline_;
 
-  vk::Format depth_format_;
+  vk::Format depth_format_ = vk::Format::eD32Sfloat;
   vk::UniqueImage depth_image_;
   vk::UniqueDeviceMemory depth_image_mem_;
   vk::UniqueImageView depth_image_view_;
   std::vector<vk::UniqueFramebuffer> framebuffers_;
-  std::vector<vk::UniqueCommandBuffer> command_buffers_;
+  std::chrono::steady_clock::time_point start_time_;
 
-  void createInstance(const Window &window, const std::string &app_name);
+  void createContext(const std::string &app_name);
+  void createResources();
+  void createInstance(const std::string &app_name);
   void createDebugCallback();
   void selectPhysicalDevice();
   void createDevice();
   void createQueues();
   void createCommandPool();
-  void createSemaphores();
+  void createFrames();
+  // Flag buffers of dynamic triangles, sized by the scene
+  void createFlags();
+  void createIndices(const IndexData &index_data);
+  // Copies data into device-local buffer through a staging buffer
+  void uploadStaged(const Buffer &buffer, const void *data, size_t size);
+  template <typename T>
+  void uploadStaged(const Buffer &buffer, const std::vector<T> &data) {
+    uploadStaged(buffer, data.data(), sizeof(T) * data.size());
+  }
+  // Chunk by chunk, so staging buffers stay small
+  template <typename T>
+  void uploadStaged(const VertexChunks &vertices, const std::vector<T> &data) {
+    const auto &chunks = vertices.getChunks();
+    for (size_t i = 0; i < chunks.size(); ++i)
+      uploadStaged(chunks[i], data.data() + i * vertices.getChunkSize(),
+                   sizeof(T) * chunks[i].getNumVertices());
+  }
+  // Vertices of a chunk, all of them for indexed scenes
+  size_t getChunkSize() const;
   void createSwapchain(vk::Extent2D extent);
+  void createColorImage(vk::Extent2D extent);
   void createDescriptors();
   void createRenderPass();
+  std::string getPipelineCachePath() const;
+  void createPipelineCache();
+  void savePipelineCache() const;
   void createPipeline();
   void createDepthResources();
   void createFramebuffers();
-  void createCommandBuffers();
-  void recordCommandBuffers();
+  // Splits the ranges at chunk boundaries into the indirect buffer
+  void writeDrawCommands(Frame &frame, const VertexRanges &ranges);
+  void recordCommandBuffer(const Frame &frame, uint32_t image_index);
+  // Waits for frames drawing vertex buffer of the frame before overwriting it
+  void waitVertexBuffer(size_t frame);
+  // Passes the offscreen image of a finished frame to the callback
+  void deliverImage(Frame &frame);
+  DrawTimings drawScene(const VertexData *vertex_data,
+                        const FlagData *flag_data,
+                        const CameraData &camera_data,
+                        const VertexRanges *ranges = nullptr);
 
-  std::vector<const char *> getInstanceExtensions(const Window &window) const;
+  std::vector<const char *> getInstanceExtensions() const;
   std::vector<const char *> getValidationLayers() const;
   std::vector<const char *> getDeviceExtensions() const;
 };
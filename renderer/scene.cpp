@@ -2,6 +2,7 @@
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/gtc/matrix_transform.hpp>
+#include <functional>
 
 namespace render {
 
@@ -17,6 +18,26 @@ findMemoryTypeIndex(const vk::PhysicalDeviceMemoryProperties &memory_properties,
   throw std::runtime_error("can not find suitable memory type!");
 }
 
+// Octahedral encoding: projection onto the octahedron |x| + |y| + |z| = 1,
+// lower half folded over the upper one
+static std::array<int8_t, 2> encodeNormal(glm::vec3 normal) {
+  float norm = glm::abs(normal.x) + glm::abs(normal.y) + glm::abs(normal.z);
+  if (norm == 0.f)
+    return {0, 0};
+  normal /= norm;
+  glm::vec2 res{normal.x, normal.y};
+  if (normal.z < 0.f) {
+    glm::vec2 sign{res.x >= 0.f ? 1.f : -1.f, res.y >= 0.f ? 1.f : -1.f};
+    res = (1.f - glm::abs(glm::vec2{res.y, res.x})) * sign;
+  }
+  return {static_cast<int8_t>(glm::round(res.x * 127.f)),
+          static_cast<int8_t>(glm::round(res.y * 127.f))};
+}
+
+Vertex::Vertex(glm::vec3 position, glm::vec3 normal, Status status)
+    : position(position), normal(encodeNormal(normal)), status(status),
+      padding(0) {}
+
 vk::VertexInputBindingDescription Vertex::getBindingDescription() {
   return vk::VertexInputBindingDescription{0, sizeof(Vertex),
                                            vk::VertexInputRate::eVertex};
@@ -26,10 +47,33 @@ std::array<vk::VertexInputAttributeDescription, 3>
 Vertex::getAttributeDescriptions() {
   return {vk::VertexInputAttributeDescription{
               0, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, position)},
+          vk::VertexInputAttributeDescription{1, 0, vk::Format::eR8G8Snorm,
+                                              offsetof(Vertex, normal)},
+          vk::VertexInputAttributeDescription{2, 0, vk::Format::eR8Uint,
+                                              offsetof(Vertex, status)}};
+}
+
+vk::VertexInputBindingDescription DynamicVertex::getBindingDescription() {
+  return vk::VertexInputBindingDescription{0, sizeof(DynamicVertex),
+                                           vk::VertexInputRate::eVertex};
+}
+
+std::array<vk::VertexInputAttributeDescription, 5>
+DynamicVertex::getAttributeDescriptions() {
+  return {vk::VertexInputAttributeDescription{
+              0, 0, vk::Format::eR32G32B32Sfloat,
+              offsetof(DynamicVertex, position)},
+          vk::VertexInputAttributeDescription{
+              1, 0, vk::Format::eR32G32B32Sfloat,
+              offsetof(DynamicVertex, normal)},
+          vk::VertexInputAttributeDescription{
+              2, 0, vk::Format::eR32G32B32Sfloat,
+              offsetof(DynamicVertex, axis_point)},
           vk::VertexInputAttributeDescription{
-              1, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, color)},
+              3, 0, vk::Format::eR32G32B32Sfloat,
+              offsetof(DynamicVertex, axis_direction)},
           vk::VertexInputAttributeDescription{
-              2, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, normal)}};
+              4, 0, vk::Format::eR32Sfloat, offsetof(DynamicVertex, speed)}};
 }
 
 Buffer::Buffer(vk::Device device, vk::PhysicalDevice physical_device,
@@ -44,6 +88,89 @@ Buffer::Buffer(vk::Device device, vk::PhysicalDevice physical_device,
   memory_ = device.allocateMemoryUnique(
       vk::MemoryAllocateInfo{memory_requirements.size, memory_index});
   device.bindBufferMemory(*buffer_, *memory_, 0);
+  if (memory_type & vk::MemoryPropertyFlagBits::eHostVisible)
+    mapped_ = device.mapMemory(*memory_, 0, VK_WHOLE_SIZE, {});
+}
+
+Buffer::Buffer(vk::Device device, size_t size, vk::BufferUsageFlags usage,
+               MemoryPool &pool) {
+  buffer_ = device.createBufferUnique(
+      vk::BufferCreateInfo{{}, size, usage, vk::SharingMode::eExclusive});
+  mapped_ = pool.bind(*buffer_);
+}
+
+MemoryPool::MemoryPool(vk::Device device, vk::PhysicalDevice physical_device,
+                       vk::MemoryPropertyFlags memory_type)
+    : device_(device),
+      memory_properties_(physical_device.getMemoryProperties()),
+      memory_type_(memory_type) {}
+
+void *MemoryPool::bind(vk::Buffer buffer) {
+  auto memory_requirements = device_.getBufferMemoryRequirements(buffer);
+  auto memory_index = findMemoryTypeIndex(memory_properties_,
+                                          memory_requirements, memory_type_);
+  size_t alignment = memory_requirements.alignment;
+  auto fits = [&](const Block &block) {
+    size_t offset = (block.used + alignment - 1) / alignment * alignment;
+    return block.memory_index == memory_index &&
+           offset + memory_requirements.size <= block.size;
+  };
+  // Only the last block is filled, earlier ones are left with their gaps
+  if (blocks_.empty() || !fits(blocks_.back())) {
+    Block block;
+    block.size = std::max<size_t>(BlockSize, memory_requirements.size);
+    block.memory = device_.allocateMemoryUnique(
+        vk::MemoryAllocateInfo{block.size, memory_index});
+    block.memory_index = memory_index;
+    block.used = 0;
+    block.mapped =
+        memory_type_ & vk::MemoryPropertyFlagBits::eHostVisible
+            ? device_.mapMemory(*block.memory, 0, VK_WHOLE_SIZE, {})
+            : nullptr;
+    blocks_.push_back(std::move(block));
+  }
+  auto &block = blocks_.back();
+  size_t offset = (block.used + alignment - 1) / alignment * alignment;
+  device_.bindBufferMemory(buffer, *block.memory, offset);
+  block.used = offset + memory_requirements.size;
+  return block.mapped ? static_cast<char *>(block.mapped) + offset : nullptr;
+}
+
+VertexChunks::VertexChunks(vk::Device device,
+                           vk::PhysicalDevice physical_device,
+                           size_t num_vertices, size_t vertex_size,
+                           bool device_local, size_t chunk_size)
+    : pool_(device, physical_device,
+            device_local ? vk::MemoryPropertyFlagBits::eDeviceLocal
+                         : vk::MemoryPropertyFlagBits::eHostVisible |
+                               vk::MemoryPropertyFlagBits::eHostCoherent),
+      num_vertices_(num_vertices), chunk_size_(chunk_size) {
+  for (size_t first = 0; first < num_vertices; first += chunk_size)
+    chunks_.emplace_back(device, std::min(chunk_size, num_vertices - first),
+                         vertex_size, pool_);
+}
+
+size_t FlagBuffer::update(const FlagData &data) {
+  if (uploaded_.size() != data.size()) {
+    upload(data);
+    uploaded_ = data;
+    return sizeof(uint32_t) * data.size();
+  }
+  auto *mem = static_cast<uint32_t *>(mapped_);
+  size_t num_words = 0;
+  auto changed = std::mismatch(data.begin(), data.end(), uploaded_.begin());
+  while (changed.first != data.end()) {
+    // End of the changed range is the first unchanged word
+    auto end = std::mismatch(changed.first, data.end(), changed.second,
+                             std::not_equal_to<uint32_t>())
+                   .first;
+    size_t begin = changed.first - data.begin(), count = end - changed.first;
+    std::copy(changed.first, end, mem + begin);
+    std::copy(changed.first, end, changed.second);
+    num_words += count;
+    changed = std::mismatch(end, data.end(), changed.second + count);
+  }
+  return sizeof(uint32_t) * num_words;
 }
 
 void Camera::pan(glm::vec2 dir) {
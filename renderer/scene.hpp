@@ -1,29 +1,83 @@
 #ifndef RENDERER_SCENE_HPP
 #define RENDERER_SCENE_HPP
 
+#include <algorithm>
 #include <array>
+#include <cassert>
+#include <cstring>
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <limits>
 #include <vector>
 #include <vulkan/vulkan.hpp>
 
 namespace render {
 
+// Index into the palette of vertex colors, Selected only highlights the
+// picked triangle
+enum class Status : uint8_t { Free, Colliding, Selected, Count };
+
+// 16 bytes: float position, octahedral normal and status
 struct Vertex {
   glm::vec3 position;
-  glm::vec3 color;
-  glm::vec3 normal;
+  std::array<int8_t, 2> normal;
+  Status status;
+  uint8_t padding;
 
+  Vertex() = default;
+  // Zero normal is replaced with an arbitrary one
+  Vertex(glm::vec3 position, glm::vec3 normal, Status status);
   static vk::VertexInputBindingDescription getBindingDescription();
   static std::array<vk::VertexInputAttributeDescription, 3>
   getAttributeDescriptions();
 };
+static_assert(sizeof(Vertex) == 16, "unexpected vertex padding");
+
+// Vertex of a triangle rotating around an axis, the vertex shader rotates
+// it to the current time, so it is uploaded only once
+struct DynamicVertex {
+  // Position and normal at time 0
+  glm::vec3 position;
+  glm::vec3 normal;
+  glm::vec3 axis_point;
+  // Not normalized, like in geom::Line
+  glm::vec3 axis_direction;
+  // Degrees per second
+  float speed;
+
+  static vk::VertexInputBindingDescription getBindingDescription();
+  static std::array<vk::VertexInputAttributeDescription, 5>
+  getAttributeDescriptions();
+};
 
 using VertexData = std::vector<Vertex>;
+using DynamicVertexData = std::vector<DynamicVertex>;
+using IndexData = std::vector<uint32_t>;
+// Collision flags of dynamic triangles, bit i % 32 of word i / 32 is set if
+// triangle i collides
+using FlagData = std::vector<uint32_t>;
+
+// Vertices [first, first + count) of a static scene, e.g. the ones in the
+// camera frustum
+struct VertexRange {
+  uint32_t first, count;
+};
+using VertexRanges = std::vector<VertexRange>;
+
+// Colors of vertex statuses, uploaded once
+struct PaletteData {
+  // vec4 for std140 array stride
+  std::array<glm::vec4, static_cast<size_t>(Status::Count)> colors;
+};
 
 struct CameraData {
   glm::mat4 view;
   glm::mat4 proj;
+  // Seconds, rotates dynamic triangles
+  float time = 0.f;
+  // Drawn triangle highlighted by the vertex shaders, none by default
+  uint32_t selected = std::numeric_limits<uint32_t>::max();
 };
 
 uint32_t
@@ -31,52 +85,195 @@ findMemoryTypeIndex(const vk::PhysicalDeviceMemoryProperties &memory_properties,
                     const vk::MemoryRequirements &memory_requirements,
                     vk::MemoryPropertyFlags memory_type);
 
+// Bump allocator of large device memory blocks that buffers are bound into,
+// so big scenes need few allocations and none of them exceeds
+// maxMemoryAllocationSize. Memory is freed only with the pool.
+class MemoryPool {
+public:
+  // Well below the 1 GiB minimum of maxMemoryAllocationSize
+  static constexpr size_t BlockSize = size_t{256} << 20;
+
+  MemoryPool() = default;
+  MemoryPool(vk::Device device, vk::PhysicalDevice physical_device,
+             vk::MemoryPropertyFlags memory_type);
+  // Binds the buffer at the next aligned offset, starting a new block if it
+  // does not fit. Returns its mapping if the memory is host-visible.
+  void *bind(vk::Buffer buffer);
+
+private:
+  struct Block {
+    vk::UniqueDeviceMemory memory;
+    uint32_t memory_index;
+    size_t size, used;
+    void *mapped;
+  };
+  vk::Device device_;
+  vk::PhysicalDeviceMemoryProperties memory_properties_;
+  vk::MemoryPropertyFlags memory_type_;
+  std::vector<Block> blocks_;
+};
+
+// Host-visible buffers stay mapped for their whole lifetime, device-local
+// ones are written by Renderer with staging uploads
 class Buffer {
 public:
   Buffer() = default;
   Buffer(vk::Device device, vk::PhysicalDevice physical_device, size_t size,
          vk::BufferUsageFlags usage, vk::MemoryPropertyFlags memory_type);
+  // Bound into memory of the pool, which has to outlive the buffer
+  Buffer(vk::Device device, size_t size, vk::BufferUsageFlags usage,
+         MemoryPool &pool);
   vk::Buffer get() const { return *buffer_; }
-  template <typename T> void upload(vk::Device device, const T &data) const {
-    size_t size = sizeof(T);
-    void *mem = device.mapMemory(*memory_, 0, size, {});
-    memcpy(mem, &data, size);
-    device.unmapMemory(*memory_);
+  void *getMapped() const { return mapped_; }
+  template <typename T> void upload(const T &data, size_t offset = 0) const {
+    assert(mapped_);
+    memcpy(static_cast<char *>(mapped_) + offset, &data, sizeof(T));
   }
-  template <typename T>
-  void upload(vk::Device device, const std::vector<T> &data) const {
-    size_t size = sizeof(T) * data.size();
-    void *mem = device.mapMemory(*memory_, 0, size, {});
-    memcpy(mem, data.data(), size);
-    device.unmapMemory(*memory_);
+  template <typename T> void upload(const std::vector<T> &data) const {
+    assert(mapped_);
+    memcpy(mapped_, data.data(), sizeof(T) * data.size());
   }
 
 protected:
   vk::UniqueBuffer buffer_;
   vk::UniqueDeviceMemory memory_;
+  void *mapped_ = nullptr;
 };
 
 class VertexBuffer final : public Buffer {
 public:
   VertexBuffer() = default;
-  VertexBuffer(vk::Device device, vk::PhysicalDevice physical_device,
-               size_t num_vertices)
-      : Buffer(device, physical_device, sizeof(Vertex) * num_vertices,
-               vk::BufferUsageFlagBits::eVertexBuffer,
-               vk::MemoryPropertyFlagBits::eHostVisible |
-                   vk::MemoryPropertyFlagBits::eHostCoherent),
+  VertexBuffer(vk::Device device, size_t num_vertices, size_t vertex_size,
+               MemoryPool &pool)
+      : Buffer(device, vertex_size * num_vertices,
+               vk::BufferUsageFlagBits::eVertexBuffer |
+                   vk::BufferUsageFlagBits::eTransferDst,
+               pool),
         num_vertices_(num_vertices) {}
   size_t getNumVertices() const { return num_vertices_; }
 
 private:
-  size_t num_vertices_;
+  size_t num_vertices_ = 0;
+};
+
+// Vertices split into buffers of at most chunk size vertices, drawn with a
+// draw call each, so scene size is not limited by a single allocation.
+// Chunks are written independently.
+class VertexChunks {
+public:
+  // Whole triangles and whole words of collision flags, 12 MiB of Vertex
+  static constexpr size_t ChunkSize = 3 * 32 * 8192;
+
+  VertexChunks() = default;
+  VertexChunks(vk::Device device, vk::PhysicalDevice physical_device,
+               size_t num_vertices, size_t vertex_size, bool device_local,
+               size_t chunk_size = ChunkSize);
+  size_t getNumVertices() const { return num_vertices_; }
+  size_t getChunkSize() const { return chunk_size_; }
+  const std::vector<VertexBuffer> &getChunks() const { return chunks_; }
+  // Host-visible only: writes vertices from the first one on, touching only
+  // the chunks they fall into
+  template <typename T>
+  void upload(const std::vector<T> &data, size_t first_vertex = 0) const {
+    for (size_t i = 0; i < data.size();) {
+      size_t vertex = first_vertex + i;
+      const auto &chunk = chunks_[vertex / chunk_size_];
+      size_t offset = vertex % chunk_size_;
+      size_t count = std::min(chunk.getNumVertices() - offset, data.size() - i);
+      assert(chunk.getMapped());
+      memcpy(static_cast<T *>(chunk.getMapped()) + offset, data.data() + i,
+             sizeof(T) * count);
+      i += count;
+    }
+  }
+
+private:
+  // Destroyed after the chunks bound into it
+  MemoryPool pool_;
+  std::vector<VertexBuffer> chunks_;
+  size_t num_vertices_ = 0, chunk_size_ = ChunkSize;
+};
+
+// Device-local, as indices are uploaded once
+class IndexBuffer final : public Buffer {
+public:
+  IndexBuffer() = default;
+  IndexBuffer(vk::Device device, vk::PhysicalDevice physical_device,
+              size_t num_indices)
+      : Buffer(device, physical_device, sizeof(uint32_t) * num_indices,
+               vk::BufferUsageFlagBits::eIndexBuffer |
+                   vk::BufferUsageFlagBits::eTransferDst,
+               vk::MemoryPropertyFlagBits::eDeviceLocal),
+        num_indices_(num_indices) {}
+  size_t getNumIndices() const { return num_indices_; }
+
+private:
+  size_t num_indices_ = 0;
+};
+
+class FlagBuffer final : public Buffer {
+public:
+  FlagBuffer() = default;
+  FlagBuffer(vk::Device device, vk::PhysicalDevice physical_device,
+             size_t num_triangles)
+      : Buffer(device, physical_device,
+               sizeof(uint32_t) * getNumWords(num_triangles),
+               vk::BufferUsageFlagBits::eStorageBuffer,
+               vk::MemoryPropertyFlagBits::eHostVisible |
+                   vk::MemoryPropertyFlagBits::eHostCoherent),
+        num_words_(getNumWords(num_triangles)) {}
+  size_t getNumWords() const { return num_words_; }
+  // At least one word, empty buffers are not allowed
+  static size_t getNumWords(size_t num_triangles) {
+    return std::max<size_t>((num_triangles + 31) / 32, 1);
+  }
+  // Writes only the ranges of words changed since the previous update, so
+  // the transfer is proportional to the number of changes. Returns the
+  // number of written bytes.
+  size_t update(const FlagData &data);
+  const FlagData &getData() const { return uploaded_; }
+
+private:
+  size_t num_words_ = 0;
+  // Copy of the buffer contents, empty before the first update
+  FlagData uploaded_;
+};
+
+// Uniform buffer with a slot for every frame in flight, slots are aligned
+// for descriptor offsets
+template <typename T> class UniformRing final : public Buffer {
+public:
+  UniformRing() = default;
+  UniformRing(vk::Device device, vk::PhysicalDevice physical_device,
+              size_t num_slots)
+      : Buffer(device, physical_device,
+               getStride(physical_device) * num_slots,
+               vk::BufferUsageFlagBits::eUniformBuffer,
+               vk::MemoryPropertyFlagBits::eHostVisible |
+                   vk::MemoryPropertyFlagBits::eHostCoherent),
+        stride_(getStride(physical_device)) {}
+  void write(size_t slot, const T &data) const {
+    upload(data, slot * stride_);
+  }
+  vk::DescriptorBufferInfo getDescriptorInfo(size_t slot) const {
+    return vk::DescriptorBufferInfo{get(), slot * stride_, sizeof(T)};
+  }
+
+private:
+  size_t stride_ = 0;
+
+  static size_t getStride(vk::PhysicalDevice physical_device) {
+    size_t alignment =
+        physical_device.getProperties().limits.minUniformBufferOffsetAlignment;
+    return (sizeof(T) + alignment - 1) / alignment * alignment;
+  }
 };
 
-class CameraBuffer final : public Buffer {
+class PaletteBuffer final : public Buffer {
 public:
-  CameraBuffer() = default;
-  CameraBuffer(vk::Device device, vk::PhysicalDevice physical_device)
-      : Buffer(device, physical_device, sizeof(CameraData),
+  PaletteBuffer() = default;
+  PaletteBuffer(vk::Device device, vk::PhysicalDevice physical_device)
+      : Buffer(device, physical_device, sizeof(PaletteData),
                vk::BufferUsageFlagBits::eUniformBuffer,
                vk::MemoryPropertyFlagBits::eHostVisible |
                    vk::MemoryPropertyFlagBits::eHostCoherent) {}
@@ -1,17 +1,173 @@
 #include "visualizer.hpp"
+#include <glm/matrix.hpp>
+#include <iostream>
+#include <stdexcept>
 
 namespace render {
 
-Visualizer::Visualizer(const std::string &app_name, size_t num_vertices)
-    : window_(1280, 720, app_name, reinterpret_cast<void *>(&camera_)),
-      camera_(glm::vec3{}, 1.f, window_.getAspectRatio()),
-      renderer_(window_, app_name, num_vertices) {}
+static std::optional<Window> createWindow(const std::string &app_name,
+                                          const RenderOptions &options,
+                                          void *user_data) {
+  if (options.offscreen)
+    return std::nullopt;
+  return Window(1280, 720, app_name, user_data);
+}
+
+static float getAspectRatio(const std::optional<Window> &window,
+                            const RenderOptions &options) {
+  if (window)
+    return window->getAspectRatio();
+  return static_cast<float>(options.offscreen->width) /
+         static_cast<float>(options.offscreen->height);
+}
+
+// Replaces %d or %0Nd with the frame number
+static std::string formatPath(const std::string &path, unsigned frame) {
+  auto begin = path.find('%');
+  if (begin == std::string::npos)
+    return path;
+  auto end = path.find('d', begin);
+  auto width = path.substr(begin + 1, end - begin - 1);
+  if (end == std::string::npos ||
+      width.find_first_not_of("0123456789") != std::string::npos)
+    throw std::runtime_error("unsupported frame number format in " + path);
+  auto number = std::to_string(frame);
+  if (!width.empty() && number.size() < std::stoul(width))
+    number.insert(0, std::stoul(width) - number.size(), '0');
+  return path.substr(0, begin) + number + path.substr(end + 1);
+}
+
+Visualizer::Visualizer(const std::string &app_name, VertexFormat vertex_format,
+                       const RenderOptions &options)
+    : window_(createWindow(app_name, options, &camera_)),
+      camera_(glm::vec3{}, 1.f, getAspectRatio(window_, options)),
+      start_time_(std::chrono::steady_clock::now()) {
+  // Window is created on the main thread, as GLFW requires
+  const Window *window = window_ ? &*window_ : nullptr;
+  pending_renderer_ = std::async(std::launch::async, [=]() {
+    return std::make_unique<Renderer>(window, app_name, vertex_format,
+                                      options);
+  });
+}
+
+Visualizer::Visualizer(const std::string &app_name, size_t num_vertices,
+                       const IndexData &index_data,
+                       const RenderOptions &options)
+    : Visualizer(app_name, VertexFormat::Vertex, options) {
+  setScene(num_vertices, index_data);
+}
+
+Visualizer::Visualizer(const std::string &app_name,
+                       const VertexData &vertex_data,
+                       const IndexData &index_data,
+                       const RenderOptions &options)
+    : Visualizer(app_name, VertexFormat::Vertex, options) {
+  setScene(vertex_data, index_data);
+}
+
+Visualizer::Visualizer(const std::string &app_name,
+                       const DynamicVertexData &vertex_data,
+                       const RenderOptions &options)
+    : Visualizer(app_name, VertexFormat::DynamicVertex, options) {
+  setScene(vertex_data);
+}
+
+void Visualizer::setScene(size_t num_vertices, const IndexData &index_data) {
+  getRenderer().setScene(num_vertices, index_data);
+}
+
+void Visualizer::setScene(const VertexData &vertex_data,
+                          const IndexData &index_data) {
+  getRenderer().setScene(vertex_data, index_data);
+}
+
+void Visualizer::setScene(const DynamicVertexData &vertex_data) {
+  getRenderer().setScene(vertex_data);
+}
+
+bool Visualizer::shouldClose() const {
+  return window_ && window_->shouldClose();
+}
+
+DrawTimings Visualizer::drawFrame(const VertexData &vertex_data) {
+  processEvents();
+  auto timings = getRenderer().draw(vertex_data, getCameraData());
+  reportFirstFrame();
+  return timings;
+}
+
+DrawTimings Visualizer::drawFrame(float time, const FlagData &flag_data) {
+  processEvents();
+  time_ = time;
+  auto timings = getRenderer().draw(flag_data, getCameraData());
+  reportFirstFrame();
+  return timings;
+}
+
+DrawTimings Visualizer::drawFrame() {
+  processEvents();
+  auto camera_data = getCameraData();
+  auto timings =
+      culling_
+          ? getRenderer().draw(camera_data,
+                               culling_(camera_data.proj * camera_data.view))
+          : getRenderer().draw(camera_data);
+  reportFirstFrame();
+  return timings;
+}
 
-bool Visualizer::shouldClose() const { return window_.shouldClose(); }
+void Visualizer::writeImages(const std::string &path) {
+  // Checks the pattern before the first frame
+  formatPath(path, 0);
+  getRenderer().setImageCallback(
+      [path, frame = 0u](const Image &image) mutable {
+        writeImage(formatPath(path, frame++), image);
+      });
+}
+
+Renderer &Visualizer::getRenderer() {
+  // Rethrows setup errors
+  if (pending_renderer_.valid())
+    renderer_ = pending_renderer_.get();
+  return *renderer_;
+}
+
+void Visualizer::reportFirstFrame() {
+  if (drawn_)
+    return;
+  drawn_ = true;
+  std::cerr << "First frame after "
+            << std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start_time_)
+                   .count()
+            << " ms\n";
+}
+
+void Visualizer::processEvents() {
+  if (!window_)
+    return;
+  window_->processEvents();
+  auto click = window_->takeClick();
+  if (!click || !picking_)
+    return;
+  // Clicked pixel at the near and the far plane
+  auto inverse = glm::inverse(getViewProjection());
+  glm::vec4 near = inverse * glm::vec4(*click, 0.f, 1.f);
+  glm::vec4 far = inverse * glm::vec4(*click, 1.f, 1.f);
+  glm::vec3 origin = glm::vec3(near) / near.w;
+  selected_ = picking_(origin, glm::vec3(far) / far.w - origin);
+}
+
+glm::mat4 Visualizer::getViewProjection() const {
+  return camera_.getProjectionMatrix() * camera_.getViewMatrix();
+}
 
-void Visualizer::drawFrame(const VertexData &vertex_data) {
-  window_.processEvents();
-  renderer_.draw(window_, vertex_data, camera_.getData());
+CameraData Visualizer::getCameraData() const {
+  auto data = camera_.getData();
+  data.time = time_;
+  if (selected_)
+    data.selected = *selected_;
+  return data;
 }
 
 } // namespace render
@@ -3,19 +3,82 @@
 
 #include "renderer.hpp"
 #include "window.hpp"
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
 
 namespace render {
 
+// Opens a window, unless RenderOptions::offscreen is set
 class Visualizer {
 public:
-  Visualizer(const std::string &app_name, size_t num_vertices);
+  // Vertex ranges of the static scene visible with the view projection
+  // matrix, see Renderer::draw
+  using Culling = std::function<VertexRanges(const glm::mat4 &view_proj)>;
+  // Drawn triangle hit by the ray of a clicked pixel, the ray ends at the far
+  // plane
+  using Picking = std::function<std::optional<uint32_t>(glm::vec3 origin,
+                                                        glm::vec3 direction)>;
+
+  // Opens the window and sets the renderer up on another thread, which
+  // setScene waits for, so the scene can be loaded meanwhile
+  Visualizer(const std::string &app_name, VertexFormat vertex_format,
+             const RenderOptions &options = RenderOptions{});
+  Visualizer(const std::string &app_name, size_t num_vertices,
+             const IndexData &index_data = IndexData{},
+             const RenderOptions &options = RenderOptions{});
+  // Static scene uploaded once, drawn by drawFrame()
+  Visualizer(const std::string &app_name, const VertexData &vertex_data,
+             const IndexData &index_data = IndexData{},
+             const RenderOptions &options = RenderOptions{});
+  // Rotates dynamic triangles on GPU, see Renderer
+  Visualizer(const std::string &app_name, const DynamicVertexData &vertex_data,
+             const RenderOptions &options = RenderOptions{});
+  // See Renderer::setScene
+  void setScene(size_t num_vertices, const IndexData &index_data = {});
+  void setScene(const VertexData &vertex_data,
+                const IndexData &index_data = {});
+  void setScene(const DynamicVertexData &vertex_data);
   bool shouldClose() const;
-  void drawFrame(const VertexData &vertex_data);
+  DrawTimings drawFrame(const VertexData &vertex_data);
+  DrawTimings drawFrame(float time, const FlagData &flag_data);
+  // Draws last frame again, camera can still move
+  DrawTimings drawFrame();
+  // Projection times view matrix of the camera, read only on the thread
+  // drawing frames
+  glm::mat4 getViewProjection() const;
+  // Culls the redrawn frames of the static scene against the camera
+  void setCulling(Culling culling) { culling_ = std::move(culling); }
+  // Highlights the triangle picked by clicking into the window
+  void setPicking(Picking picking) { picking_ = std::move(picking); }
+  // Writes offscreen frames into image files, see writeImage. %d or %0Nd in
+  // the path is replaced with the frame number.
+  void writeImages(const std::string &path);
+  // Waits for the last frames, so their images are written
+  void finish() { getRenderer().finish(); }
 
 private:
-  Window window_;
+  std::optional<Window> window_;
   Camera camera_;
-  Renderer renderer_;
+  std::future<std::unique_ptr<Renderer>> pending_renderer_;
+  std::unique_ptr<Renderer> renderer_;
+  float time_ = 0.f;
+  Culling culling_;
+  Picking picking_;
+  std::optional<uint32_t> selected_;
+  // Time to first frame is reported from the construction
+  std::chrono::steady_clock::time_point start_time_;
+  bool drawn_ = false;
+
+  // Waits for the setup thread
+  Renderer &getRenderer();
+  // Prints time to first frame after the first draw
+  void reportFirstFrame();
+  // Processes window events and picks the clicked triangle
+  void processEvents();
+  CameraData getCameraData() const;
 };
 
 } // namespace render
@@ -1,17 +1,21 @@
 #include "window.hpp"
 #include "scene.hpp"
 #include <GLFW/glfw3.h>
+#include <glm/geometric.hpp>
 #include <iostream>
 #include <optional>
 
 namespace render {
 
 Window::Window(unsigned width, unsigned height, const std::string &title,
-               void *user_data) {
+               void *user_data)
+    : input_(std::make_unique<Input>()) {
+  input_->user_data = user_data;
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
   window_ = glfwCreateWindow(width, height, title.c_str(), nullptr, nullptr);
-  glfwSetWindowUserPointer(window_, user_data);
+  glfwSetWindowUserPointer(window_, input_.get());
   glfwSetWindowSizeCallback(window_, WindowSizeCallback);
+  glfwSetMouseButtonCallback(window_, MouseButtonCallback);
   glfwSetCursorPosCallback(window_, CursorPosCallback);
   glfwSetScrollCallback(window_, ScrollCallback);
 }
@@ -31,6 +35,18 @@ float Window::getAspectRatio() const {
   return static_cast<float>(width) / static_cast<float>(height);
 }
 
+std::optional<glm::vec2> Window::takeClick() {
+  if (!input_->clicked)
+    return std::nullopt;
+  int width, height;
+  glfwGetWindowSize(window_, &width, &height);
+  glm::vec2 pos = *input_->clicked;
+  input_->clicked = std::nullopt;
+  // Vulkan NDC has y pointing down like the screen
+  return glm::vec2{2.f * pos.x / static_cast<float>(width) - 1.f,
+                   2.f * pos.y / static_cast<float>(height) - 1.f};
+}
+
 std::vector<const char *> Window::getRequiredExtensions() const {
   uint32_t count;
   const char **extensions = glfwGetRequiredInstanceExtensions(&count);
@@ -50,13 +66,33 @@ Window::~Window() {
     glfwDestroyWindow(window_);
 }
 
+Window::Input &Window::getInput(GLFWwindow *window) {
+  return *static_cast<Input *>(glfwGetWindowUserPointer(window));
+}
+
 void Window::WindowSizeCallback(GLFWwindow *window, int width, int height) {
-  Camera *camera = reinterpret_cast<Camera *>(glfwGetWindowUserPointer(window));
+  Camera *camera = static_cast<Camera *>(getInput(window).user_data);
   camera->setAspect(static_cast<float>(width) / static_cast<float>(height));
 }
 
+void Window::MouseButtonCallback(GLFWwindow *window, int button, int action,
+                                 int) {
+  if (button != GLFW_MOUSE_BUTTON_LEFT)
+    return;
+  auto &input = getInput(window);
+  double xpos, ypos;
+  glfwGetCursorPos(window, &xpos, &ypos);
+  glm::vec2 cur_pos{static_cast<float>(xpos), static_cast<float>(ypos)};
+  // Releasing the button after rotating the camera is not a click
+  if (action == GLFW_PRESS)
+    input.pressed_pos = cur_pos;
+  else if (action == GLFW_RELEASE &&
+           glm::length(cur_pos - input.pressed_pos) < 3.f)
+    input.clicked = cur_pos;
+}
+
 void Window::CursorPosCallback(GLFWwindow *window, double xpos, double ypos) {
-  Camera *camera = reinterpret_cast<Camera *>(glfwGetWindowUserPointer(window));
+  Camera *camera = static_cast<Camera *>(getInput(window).user_data);
   static std::optional<glm::vec2> prev_pos;
   glm::vec2 cur_pos{static_cast<float>(xpos), static_cast<float>(ypos)};
   bool left_button =
@@ -78,7 +114,7 @@ void Window::CursorPosCallback(GLFWwindow *window, double xpos, double ypos) {
 
 void Window::ScrollCallback(GLFWwindow *window, double xoffset,
                             double yoffset) {
-  Camera *camera = reinterpret_cast<Camera *>(glfwGetWindowUserPointer(window));
+  Camera *camera = static_cast<Camera *>(getInput(window).user_data);
   camera->zoom(static_cast<float>(yoffset));
 }
 
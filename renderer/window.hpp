@@ -1,6 +1,9 @@
 #ifndef WINDOW_HPP
 #define WINDOW_HPP
 
+#include <glm/vec2.hpp>
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 #include <vulkan/vulkan.hpp>
@@ -14,10 +17,14 @@ public:
   Window(unsigned width, unsigned height, const std::string &title,
          void *user_data = nullptr);
   Window(const Window &) = delete;
-  Window(Window &&rhs) : window_(rhs.window_) { rhs.window_ = nullptr; }
+  Window(Window &&rhs)
+      : window_(rhs.window_), input_(std::move(rhs.input_)) {
+    rhs.window_ = nullptr;
+  }
   Window &operator=(const Window &) = delete;
   Window &operator=(Window &&rhs) {
     window_ = rhs.window_;
+    input_ = std::move(rhs.input_);
     rhs.window_ = nullptr;
     return *this;
   }
@@ -27,14 +34,31 @@ public:
   void processEvents() const;
   vk::Extent2D getExtent() const;
   float getAspectRatio() const;
+  // Position of the last click without dragging since the previous call, in
+  // normalized device coordinates
+  std::optional<glm::vec2> takeClick();
 
   std::vector<const char *> getRequiredExtensions() const;
   vk::UniqueSurfaceKHR createSurface(vk::Instance instance) const;
 
 private:
+  // State of the callbacks, reached through the window user pointer and
+  // kept on the heap so that it does not move with the window
+  struct Input {
+    void *user_data = nullptr;
+    glm::vec2 pressed_pos{};
+    // Clicked cursor position in screen coordinates
+    std::optional<glm::vec2> clicked;
+  };
+
   GLFWwindow *window_;
+  std::unique_ptr<Input> input_;
+
+  static Input &getInput(GLFWwindow *window);
 
   static void WindowSizeCallback(GLFWwindow *window, int width, int height);
+  static void MouseButtonCallback(GLFWwindow *window, int button, int action,
+                                  int mods);
   static void CursorPosCallback(GLFWwindow *window, double xpos, double ypos);
   static void ScrollCallback(GLFWwindow *window, double xoffset,
                              double yoffset);
@@ -0,0 +1,55 @@
+#version 450
+
+layout(binding = 0) uniform Camera {
+    mat4 view;
+    mat4 proj;
+    float time;
+    uint selected;
+} camera;
+
+layout(binding = 2) uniform Palette {
+    vec4 colors[3];
+} palette;
+
+// Bit i % 32 of word i / 32 is set if triangle i collides
+layout(std430, binding = 1) readonly buffer Flags {
+    uint words[];
+} flags;
+
+// Vertices are drawn in chunks, each starting at vertex 0
+layout(push_constant) uniform Chunk {
+    uint firstTriangle;
+} chunk;
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in vec3 axisPoint;
+layout(location = 3) in vec3 axisDirection;
+layout(location = 4) in float speed;
+
+layout(location = 0) out vec3 fragPosition;
+layout(location = 1) out vec3 fragColor;
+layout(location = 2) out vec3 fragNormal;
+
+// Rotation by unit quaternion q
+vec3 rotate(vec3 v, vec4 q) {
+    vec3 t = 2. * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+void main() {
+    // Same rotation as DynamicTriangle::get: quaternion of angle around
+    // non-normalized axis direction is normalized afterwards
+    float halfAngle = radians(mod(speed * camera.time, 360.)) * 0.5;
+    vec4 q = normalize(vec4(axisDirection * sin(halfAngle), cos(halfAngle)));
+    vec3 worldPosition = axisPoint + rotate(position - axisPoint, q);
+    gl_Position = camera.proj * camera.view * vec4(worldPosition, 1.0);
+
+    uint triangle = chunk.firstTriangle + uint(gl_VertexIndex) / 3u;
+    uint bit = 1u << (triangle % 32u);
+    bool collides = (flags.words[triangle / 32u] & bit) != 0u;
+    fragPosition = worldPosition;
+    int color = triangle == camera.selected ? 2 : collides ? 1 : 0;
+    fragColor = palette.colors[color].rgb;
+    fragNormal = rotate(normal, q);
+}
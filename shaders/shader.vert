@@ -3,20 +3,41 @@
 layout(binding = 0) uniform Camera {
     mat4 view;
     mat4 proj;
+    float time;
+    uint selected;
 } camera;
 
+layout(binding = 2) uniform Palette {
+    vec4 colors[3];
+} palette;
+
+// Vertices are drawn in chunks, each starting at vertex 0
+layout(push_constant) uniform Chunk {
+    uint firstTriangle;
+} chunk;
+
 layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 color;
-layout(location = 2) in vec3 normal;
+// Octahedral encoding
+layout(location = 1) in vec2 normal;
+layout(location = 2) in uint status;
 
 layout(location = 0) out vec3 fragPosition;
 layout(location = 1) out vec3 fragColor;
 layout(location = 2) out vec3 fragNormal;
 
+vec3 decodeNormal(vec2 e) {
+    vec3 n = vec3(e, 1. - abs(e.x) - abs(e.y));
+    if (n.z < 0.) {
+        vec2 signs = mix(vec2(-1.), vec2(1.), greaterThanEqual(n.xy, vec2(0.)));
+        n.xy = (1. - abs(n.yx)) * signs;
+    }
+    return normalize(n);
+}
+
 void main() {
     gl_Position = camera.proj * camera.view * vec4(position, 1.0);
     fragPosition = position;
-    fragColor = color;
-    fragNormal = normal;
+    uint triangle = chunk.firstTriangle + uint(gl_VertexIndex) / 3u;
+    fragColor = palette.colors[triangle == camera.selected ? 2u : status].rgb;
+    fragNormal = decodeNormal(normal);
 }
-
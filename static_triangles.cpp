@@ -1,28 +1,89 @@
+#include "collisions/mesh_file.hpp"
+#include "collisions/scene_file.hpp"
 #include "common.hpp"
 #include <GLFW/glfw3.h>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
 
 int main(int argc, char *argv[]) {
-  scene::TriangleIdx N;
-  std::cin >> N;
-  scene::Scene triangles;
-  triangles.reserve(N);
-  for (scene::TriangleIdx i = 0; i < N; ++i) {
-    geom::Triangle tri;
-    std::cin >> tri;
-    triangles.push_back(tri);
+  // --output FILE draws one frame without a window into a PNG or PPM file
+  std::string output;
+  if (argc > 2 && std::string(argv[1]) == "--output") {
+    output = argv[2];
+    argc -= 2;
+    argv += 2;
   }
-  auto collisions = scene::findIntersectingTriangles(triangles);
-  auto vertex_data = getVertexData(triangles, collisions);
-
+  render::RenderOptions options;
+  if (!output.empty())
+    options.offscreen = vk::Extent2D{1280, 720};
+  int res = 0;
   glfwInit();
   try {
-    render::Visualizer visualizer("Static triangles", N * 3);
-    while (!visualizer.shouldClose())
-      visualizer.drawFrame(vertex_data);
+    // Renderer is set up on another thread while the scene is loaded
+    render::Visualizer visualizer("Static triangles",
+                                  render::VertexFormat::Vertex, options);
+    // Binary scene file is mapped and used in place, meshes (OBJ, STL, PLY)
+    // keep shared vertices, text scene is read from standard input
+    std::optional<scene::MappedScene> mapped;
+    scene::Scene parsed;
+    scene::IndexedScene mesh;
+    scene::SceneView triangles;
+    bool indexed = argc > 1 && scene::isMeshFile(argv[1]);
+    if (indexed) {
+      mesh = scene::loadMesh(argv[1]);
+      triangles = mesh;
+    } else if (argc > 1) {
+      mapped.emplace(argv[1]);
+      triangles = mapped->getScene();
+    } else {
+      parsed = scene::readTextScene(std::cin);
+      triangles = parsed;
+    }
+    auto collisions = scene::findIntersectingTriangles(triangles);
+    // Triangle soups are culled against the camera, reordered so that every
+    // subtree of the index is a contiguous vertex range
+    scene::SpatialIndex index;
+    if (indexed)
+      visualizer.setScene(getVertexData(mesh, collisions), getIndexData(mesh));
+    else {
+      index = scene::SpatialIndex(triangles);
+      visualizer.setScene(getVertexData(triangles, collisions, index));
+      visualizer.setCulling([&index](const glm::mat4 &view_proj) {
+        return getVisibleRanges(index, view_proj);
+      });
+      // Clicked triangles are reported with their scene index and highlighted
+      // at their drawn position
+      std::vector<uint32_t> positions(index.size());
+      for (uint32_t pos = 0; pos < index.size(); ++pos)
+        positions[index.getOrder()[pos]] = pos;
+      visualizer.setPicking(
+          [&index, &collisions, positions = std::move(positions)](
+              glm::vec3 origin,
+              glm::vec3 direction) -> std::optional<uint32_t> {
+            auto hit = index.castRay(geom::Ray{origin, direction, 1.f});
+            if (!hit)
+              return std::nullopt;
+            std::cerr << "Picked triangle " << hit->triangle
+                      << (collisions.count(hit->triangle) ? ", colliding\n"
+                                                          : "\n");
+            return positions[hit->triangle];
+          });
+    }
+
+    if (output.empty()) {
+      while (!visualizer.shouldClose())
+        visualizer.drawFrame();
+    } else {
+      visualizer.writeImages(output);
+      visualizer.drawFrame();
+      visualizer.finish();
+    }
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
+    res = 1;
   }
   glfwTerminate();
-  return 0;
+  return res;
 }